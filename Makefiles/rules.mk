@@ -61,6 +61,39 @@ FORCE_LINK	+= -Wl,--undefined=uart5_isr
 FORCE_LINK	+= -Wl,--undefined=usart6_isr
 FORCE_LINK	+= -Wl,--undefined=uart7_isr
 FORCE_LINK	+= -Wl,--undefined=uart8_isr
+FORCE_LINK	+= -Wl,--undefined=i2c1_ev_isr
+FORCE_LINK	+= -Wl,--undefined=i2c1_er_isr
+FORCE_LINK	+= -Wl,--undefined=i2c2_ev_isr
+FORCE_LINK	+= -Wl,--undefined=i2c2_er_isr
+FORCE_LINK	+= -Wl,--undefined=i2c3_ev_isr
+FORCE_LINK	+= -Wl,--undefined=i2c3_er_isr
+FORCE_LINK	+= -Wl,--undefined=i2c4_ev_isr
+FORCE_LINK	+= -Wl,--undefined=i2c4_er_isr
+FORCE_LINK	+= -Wl,--undefined=adc_isr
+FORCE_LINK	+= -Wl,--undefined=exti0_isr
+FORCE_LINK	+= -Wl,--undefined=exti1_isr
+FORCE_LINK	+= -Wl,--undefined=exti2_isr
+FORCE_LINK	+= -Wl,--undefined=exti3_isr
+FORCE_LINK	+= -Wl,--undefined=exti4_isr
+FORCE_LINK	+= -Wl,--undefined=exti9_5_isr
+FORCE_LINK	+= -Wl,--undefined=exti15_10_isr
+FORCE_LINK	+= -Wl,--undefined=tim7_isr
+FORCE_LINK	+= -Wl,--undefined=dma1_stream0_isr
+FORCE_LINK	+= -Wl,--undefined=dma1_stream1_isr
+FORCE_LINK	+= -Wl,--undefined=dma1_stream2_isr
+FORCE_LINK	+= -Wl,--undefined=dma1_stream3_isr
+FORCE_LINK	+= -Wl,--undefined=dma1_stream4_isr
+FORCE_LINK	+= -Wl,--undefined=dma1_stream5_isr
+FORCE_LINK	+= -Wl,--undefined=dma1_stream6_isr
+FORCE_LINK	+= -Wl,--undefined=dma1_stream7_isr
+FORCE_LINK	+= -Wl,--undefined=dma2_stream0_isr
+FORCE_LINK	+= -Wl,--undefined=dma2_stream1_isr
+FORCE_LINK	+= -Wl,--undefined=dma2_stream2_isr
+FORCE_LINK	+= -Wl,--undefined=dma2_stream3_isr
+FORCE_LINK	+= -Wl,--undefined=dma2_stream4_isr
+FORCE_LINK	+= -Wl,--undefined=dma2_stream5_isr
+FORCE_LINK	+= -Wl,--undefined=dma2_stream6_isr
+FORCE_LINK	+= -Wl,--undefined=dma2_stream7_isr
 
 # Floating point *printf *scanf support
 #SPECS		+= -u _scanf_float -u _printf_float
@@ -21,6 +21,7 @@
 #include <string>
 
 #include "i2c.h"
+#include "i2c_scheduler.h"
 #include "ostrich.h"
 #include "systick.h"
 #include "usb/serial.h"
@@ -31,11 +32,8 @@ constexpr uint8_t kI2CAddress = 0x20;
 constexpr uint8_t kMoistureRegister = 0x0;
 constexpr uint8_t kTemperatureRegister = 0x5;
 
-template <typename I2CType>
-uint16_t ReadRegister(I2CType* i2c, uint8_t register_addr) {
-  uint8_t buf[2];
-  i2c->SendReceive(kI2CAddress, &register_addr, 1, buf, 2);
-  return (static_cast<uint8_t>(buf[0]) << 8) | buf[1];
+uint16_t ToUint16(const uint8_t* buf) {
+  return (static_cast<uint16_t>(buf[0]) << 8) | buf[1];
 }
 
 int main() {
@@ -53,12 +51,30 @@ int main() {
   });
 
   I2C<I2C4, PIN_D13, PIN_D12> i2c(I2CSpeed::Speed100kHz);
+  I2CScheduler<decltype(i2c)> scheduler(&i2c);
+
+  uint8_t moisture_buf[2];
+  uint8_t temperature_buf[2];
+  I2CTransaction moisture_read(kI2CAddress, &kMoistureRegister, 1,
+                               moisture_buf, sizeof(moisture_buf));
+  I2CTransaction temperature_read(kI2CAddress, &kTemperatureRegister, 1,
+                                  temperature_buf, sizeof(temperature_buf));
 
   while (true) {
-    auto moisture = ReadRegister(&i2c, kMoistureRegister);
-    auto temperature = ReadRegister(&i2c, kTemperatureRegister);
-    usb_serial << "Moisture: " << moisture << ", Temperature: " << temperature
-        << std::endl;
+    // Both reads are queued, and run back to back from the I2C interrupt.
+    scheduler.Submit(&moisture_read);
+    scheduler.Submit(&temperature_read);
+
+    while (!moisture_read.Done() || !temperature_read.Done()) {
+      WaitForInterrupt();
+    }
+
+    if (moisture_read.Succeeded() && temperature_read.Succeeded()) {
+      usb_serial << "Moisture: " << ToUint16(moisture_buf)
+          << ", Temperature: " << ToUint16(temperature_buf) << std::endl;
+    } else {
+      usb_serial << "Read failed" << std::endl;
+    }
     DelayMilliseconds(1000);
   }
 }
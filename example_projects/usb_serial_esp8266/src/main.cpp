@@ -22,6 +22,7 @@
 
 #include "ostrich.h"
 #include "systick.h"
+#include "timer_wheel.h"
 #include "usart.h"
 #include "usb/serial.h"
 
@@ -65,9 +66,21 @@ int main() {
   using UsartPortType = USART<kUart, kUartTxPin, kUartRxPin>;
   auto usart = std::make_unique<UsartPortType>(baud_rate);
 
-  uint64_t last_flush_time = GetTimeMilliseconds();
+  // Don't let data sit in the buffer for too long.
+  SoftwareTimer flush_timer([&usart, &usb_serial]() {
+    usart->Flush();
+    usb_serial.Flush();
+  });
+  flush_timer.StartPeriodic(Duration::Milliseconds(10));
+
+  // Sleep when there's nothing to forward.
+  AddIdleCallback([&usart, &usb_serial]() {
+    return usb_serial.DataAvailable() || usart->DataAvailable();
+  });
 
   while (true) {
+    TimerWheel::GetInstance().RunDeferred();
+
     auto usb_available = usb_serial.DataAvailable();
 
     if (usb_available) {
@@ -90,12 +103,6 @@ int main() {
       usart.reset(new USART<kUart, kUartTxPin, kUartRxPin>(baud_rate));
     }
 
-    // Don't let data sit in the buffer for too long.
-    uint64_t now = GetTimeMilliseconds();
-    if ((now - last_flush_time) > 10) {
-      usart->Flush();
-      usb_serial.Flush();
-      last_flush_time = now;
-    }
+    Idle();
   }
 }
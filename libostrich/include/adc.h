@@ -17,11 +17,14 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef __ADC_H____
+#ifndef __ADC_H__
 #define __ADC_H__
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <initializer_list>
 #include <memory>
 #include <optional>
 
@@ -29,10 +32,13 @@
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/cm3/nvic.h>
 
+#include "adc_calibration.h"
 #include "adc_defs.h"
+#include "dma.h"
 #include "gpio.h"
 #include "ostrich.h"
 #include "systick.h"
+#include "timer.h"
 #include "util.h"
 
 namespace Ostrich {
@@ -44,16 +50,25 @@ constexpr int kTemperatureChannel = 18;
 constexpr int kVrefintChannel = 17;
 constexpr float kVrefintVoltage = 1.21f;
 
+// Maximum length of the regular sequence.
+constexpr int kMaxScanChannels = 16;
+
 struct ADCInfo {
   uint32_t adc_base;
   rcc_periph_clken adc_rcc;
   const char* str_name;
+
+  // Regular group DMA request mapping.
+  DMAChannel dma;
 };
 
+// DMA request mappings are from RM0410 table "DMA2 request mapping". Each ADC
+// has two options, and these are chosen to leave DMA2 stream 1 and 5 (TIM8_UP
+// and TIM1_UP) free.
 constexpr std::array<ADCInfo, kNumADCs> kADCInfos{{
-  {ADC1, RCC_ADC1, "ADC1"},
-  {ADC2, RCC_ADC2, "ADC2"},
-  {ADC3, RCC_ADC3, "ADC3"}
+  {ADC1, RCC_ADC1, "ADC1", {DMA2, 4, DMA_SxCR_CHSEL_0}},
+  {ADC2, RCC_ADC2, "ADC2", {DMA2, 2, DMA_SxCR_CHSEL_1}},
+  {ADC3, RCC_ADC3, "ADC3", {DMA2, 0, DMA_SxCR_CHSEL_2}}
 }};
 
 constexpr int GetIndex(uint32_t adc) {
@@ -73,6 +88,16 @@ constexpr const ADCInfo& GetInfo(uint32_t adc) {
   return kADCInfos[GetIndex(adc)];
 }
 
+// The regular and injected groups of an ADC can be used independently (eg.
+// a background scan in the regular group, with high priority conversions in
+// the injected group).
+enum class ADCGroup {
+  kRegular,
+  kInjected
+};
+
+constexpr int kNumADCGroups = 2;
+
 class ADCManager : public Singleton {
  public:
   static ADCManager& GetInstance() {
@@ -80,61 +105,169 @@ class ADCManager : public Singleton {
     return instance;
   }
 
-  bool AllocateADC(uint32_t adc) {
-    if (in_use_[GetIndex(adc)]) {
+  using Callback = std::function<void()>;
+
+  // This struct represents a channel allocation. At the moment it only consists
+  // of the underlying GPIO pin allocation. The destruction of the channel
+  // allocation will also lead to the GPIO pin being deallocated.
+  struct ChannelAllocation {
+    std::optional<GPIOManager::PinAllocation> pin_allocation;
+  };
+
+  bool AllocateADC(uint32_t adc, ADCGroup group = ADCGroup::kRegular) {
+    uint8_t group_bit = 1 << static_cast<int>(group);
+    auto& in_use = in_use_[GetIndex(adc)];
+    if (in_use & group_bit) {
       return false;
     } else {
-      in_use_[GetIndex(adc)] = true;
-      rcc_periph_clock_enable(GetInfo(adc).adc_rcc);
+      if (in_use == 0) {
+        rcc_periph_clock_enable(GetInfo(adc).adc_rcc);
+      }
+      in_use |= group_bit;
       return true;
     }
   }
 
-  void DeallocateADC(uint32_t adc) {
-    in_use_[GetIndex(adc)] = false;
-    rcc_periph_clock_disable(GetInfo(adc).adc_rcc);
+  void DeallocateADC(uint32_t adc, ADCGroup group = ADCGroup::kRegular) {
+    auto& in_use = in_use_[GetIndex(adc)];
+    in_use &= ~(1 << static_cast<int>(group));
+    if (in_use == 0) {
+      rcc_periph_clock_disable(GetInfo(adc).adc_rcc);
+    }
+  }
+
+  bool GroupAllocated(uint32_t adc, ADCGroup group) const {
+    return in_use_[GetIndex(adc)] & (1 << static_cast<int>(group));
   }
 
   uint64_t ADCClock() const { return adc_clock_; }
 
   void SetADCPreDivider();
 
+  // Allocate the pin or turn on the internal source for a channel.
+  ChannelAllocation SetupChannel(uint32_t adc, int channel, bool is_vbatt);
+
+  // Pick the shortest sampling time that is at least sampling_time_ns.
+  void SetSamplingTime(uint32_t adc, uint32_t channel,
+                       uint64_t sampling_time_ns);
+
+  // Configure the common multi-ADC mode (ADC_CCR_MULTI_*), DMA mode
+  // (ADC_CCR_DMA_*, optionally with ADC_CCR_DDS), and the delay between
+  // sampling phases in interleaved modes (ADC_CCR_DELAY_*). The ADCs involved
+  // must be powered off.
+  void SetMultiMode(uint32_t multi, uint32_t dma_mode, uint32_t delay);
+
+  // All ADCs share one interrupt. Callbacks should check and clear the flags
+  // they are interested in.
+  void SetISRCallback(uint32_t adc, ADCGroup group, Callback callback) {
+    SetCallback(adc, static_cast<int>(group), callback);
+  }
+
+  void ClearISRCallback(uint32_t adc, ADCGroup group) {
+    ClearCallback(adc, static_cast<int>(group));
+  }
+
+  // The analog watchdog is shared by both groups, so it has its own callback.
+  void SetWatchdogCallback(uint32_t adc, Callback callback) {
+    SetCallback(adc, kWatchdogSlot, callback);
+  }
+
+  void ClearWatchdogCallback(uint32_t adc) {
+    ClearCallback(adc, kWatchdogSlot);
+  }
+
+  void InvokeCallbacks();
+
  private:
   ADCManager();
 
-  std::array<bool, kNumADCs> in_use_;
+  // Bitfields indexed by ADCGroup.
+  std::array<uint8_t, kNumADCs> in_use_;
   uint64_t adc_clock_;
+
+  // Callback slots for each ADC - one for each group, then the watchdog.
+  static constexpr int kWatchdogSlot = kNumADCGroups;
+  static constexpr int kNumCallbackSlots = kNumADCGroups + 1;
+
+  void SetCallback(uint32_t adc, int slot, Callback callback);
+  void ClearCallback(uint32_t adc, int slot);
+
+  std::array<std::array<Callback, kNumCallbackSlots>, kNumADCs> isr_callbacks_;
+  int num_isr_callbacks_;
+
+  // These are connected to the internal ADC1 channels - Vref, Vsense (temp),
+  // and Vbatt. Either Vref + Vsense, or Vbat can be on at a time.
+  bool vbatt_on_;
+  bool vref_vsense_on_;
 };
 
+// Watchdog channel meaning all channels.
+constexpr int kWatchdogAllChannels = -1;
+
 template <uint32_t kADC>
 class ADCBase : public NonCopyable {
  public:
-  ADCBase() : adc_info_(GetInfo(kADC)) {
+  using ChannelAllocation = ADCManager::ChannelAllocation;
+  using WatchdogCallback = std::function<void()>;
+
+  ADCBase() : adc_info_(GetInfo(kADC)), watchdog_enabled_(false) {
     AssertTrue(ADCManager::GetInstance().AllocateADC(kADC),
                std::string(adc_info_.str_name) + " already in use");
   }
 
   ~ADCBase() {
+    DisableWatchdog();
     ADCManager::GetInstance().DeallocateADC(kADC);
   }
 
+  // The analog watchdog checks every conversion result (regular and injected)
+  // of one channel (or kWatchdogAllChannels) in hardware, and calls the
+  // callback from the ADC interrupt if one is below low or above high. This
+  // doesn't use any CPU time until that happens, and works with any kind of
+  // conversion running, including DMA scans in the background.
+  // The interrupt is disabled after firing (as it would otherwise fire on
+  // every conversion while the input stays out of range), until
+  // RearmWatchdog() is called.
+  void EnableWatchdog(int channel, uint16_t low, uint16_t high,
+                      WatchdogCallback callback);
+
+  // Same as above, with thresholds in volts. Vdda is found from vrefint_raw,
+  // which should be a recent conversion of kVrefintChannel (eg. part of a
+  // scan sequence), and the factory Vrefint calibration.
+  void EnableWatchdogVolts(int channel, float low, float high,
+                           uint16_t vrefint_raw, WatchdogCallback callback);
+
+  void RearmWatchdog() {
+    adc_enable_awd_interrupt(kADC);
+  }
+
+  void DisableWatchdog();
+
  protected:
+  // Allocate the pin or turn on the internal source for a channel.
+  ChannelAllocation SetupChannel(int channel, bool is_vbatt) {
+    return ADCManager::GetInstance().SetupChannel(kADC, channel, is_vbatt);
+  }
+
+  // Pick the shortest sampling time that is at least sampling_time_ns.
+  void SetSamplingTime(uint32_t channel, uint64_t sampling_time_ns) {
+    ADCManager::GetInstance().SetSamplingTime(kADC, channel, sampling_time_ns);
+  }
+
   const ADCInfo& adc_info_;
+
+ private:
+  bool watchdog_enabled_;
 };
 
 template <uint32_t kADC>
 class SingleConversionADC : public ADCBase<kADC> {
  public:
+  using ChannelAllocation = typename ADCBase<kADC>::ChannelAllocation;
+
   SingleConversionADC();
   ~SingleConversionADC();
 
-  // This struct represents a channel allocation. At the moment it only consists
-  // of the underlying GPIO pin allocation. The destruction of the channel
-  // allocation will also lead to the GPIO pin being deallocated.
-  struct ChannelAllocation {
-    std::optional<GPIOManager::PinAllocation> pin_allocation;
-  };
-
   template <uint8_t kChannel>
   class ChannelSampler {
    public:
@@ -147,6 +280,14 @@ class SingleConversionADC : public ADCBase<kADC> {
 
     uint16_t ReadU16() { return adc_->ReadChannel<kChannel>(); }
 
+    // Start a conversion and return immediately. The result is delivered
+    // through the future from the ADC interrupt, and the future must stay
+    // alive until then (Future's destructor ensures that). Returns false if
+    // the ADC is busy with another read.
+    bool ReadAsync(Future<uint16_t>* result) {
+      return adc_->StartRead(kChannel, result);
+    }
+
     float ReadNormalized() {
       return static_cast<float>(ReadU16()) / kADCFullScale;
     }
@@ -160,19 +301,35 @@ class SingleConversionADC : public ADCBase<kADC> {
    public:
     TemperatureSampler(SingleConversionADC* adc)
         : ChannelSampler<kTemperatureChannel>(adc, false),
-          vref_int_allocation_(adc->SetupChannel(kVrefintChannel, false)) {}
-
-    float ReadTempC() {
-      // Compute temperature as per RM00410, using Vrefint as reference.
-      float lsb_volts =
-          kVrefintVoltage / this->adc_->template ReadChannel<kVrefintChannel>();
-      float vsense = this->ReadU16() * lsb_volts;
-      return (vsense - 0.76f) / 0.0025f + 25.0f;
+          vref_int_allocation_(adc->SetupChannel(kVrefintChannel, false)),
+          calibrated_(false) {}
+
+    // Temperature in 1/100 degrees C, using the factory calibration, with
+    // Vrefint for Vdda compensation. Vdda is measured on the first read, and
+    // then only when Recalibrate() is called, so reads are a single
+    // conversion.
+    int32_t ReadTempCentiDegrees() {
+      if (!calibrated_) {
+        Recalibrate();
+      }
+      return calibration_.ToCentiDegrees(this->ReadU16());
+    }
+
+    // Measure Vdda again (from a Vrefint conversion). Call this periodically
+    // if the supply may drift.
+    void Recalibrate() {
+      calibration_.UpdateVrefint(
+          this->adc_->template ReadChannel<kVrefintChannel>());
+      calibrated_ = true;
     }
 
+    float ReadTempC() { return ReadTempCentiDegrees() / 100.0f; }
+
    private:
     // We use vref for Vref referencing.
     ChannelAllocation vref_int_allocation_;
+    ADCCalibration calibration_;
+    bool calibrated_;
   };
 
   template <uint8_t kChannel>
@@ -187,27 +344,449 @@ class SingleConversionADC : public ADCBase<kADC> {
     return TemperatureSampler(this);
   }
 
+  // Convert all the channels (which must have been set up through samplers)
+  // in one scan, and write the results to results in the same order. This
+  // uses the ADC's DMA stream if it's free, and falls back to one conversion
+  // at a time otherwise. Returns false if the ADC is busy with another read.
+  //
+  // uint16_t results[2];
+  // adc.ReadChannels({3, kTemperatureChannel}, results);
+  bool ReadChannels(std::initializer_list<uint8_t> channels,
+                    uint16_t* results);
+
  private:
-  ChannelAllocation SetupChannel(int channel, bool is_vbatt);
-  void SetSamplingTime(uint32_t channel, uint64_t sampling_time_ns);
+  using ADCBase<kADC>::SetupChannel;
+  using ADCBase<kADC>::SetSamplingTime;
+
+  bool StartRead(uint8_t channel, Future<uint16_t>* result);
 
   template <uint8_t kChannel>
   uint16_t ReadChannel() {
-    uint8_t channel = kChannel;
-    adc_set_regular_sequence(kADC, 1, &channel);
-    adc_start_conversion_regular(kADC);
-    while (!adc_eoc(kADC)) {
-      WaitForInterrupt();
+    Future<uint16_t> result;
+    if (!StartRead(kChannel, &result)) {
+      return 0;
     }
-    return adc_read_regular(kADC);
+    return result.GetValue();
   }
 
-  const ADCInfo& adc_info_;
+  bool ScanWithDMA(std::initializer_list<uint8_t> channels, uint16_t* results);
 
-  // These are connected to the internal ADC1 channels - Vref, Vsense (temp),
-  // and Vbatt. Either Vref + Vsense, or Vbat can be on at a time.
-  bool vbatt_on_;
-  bool vref_vsense_on_;
+  void HandleInterrupt();
+
+  // Pending single conversion, if any. Cleared by the ISR.
+  Future<uint16_t>* volatile pending_read_;
+
+  // Pending scan, if any. Cleared by the DMA ISR.
+  Future<bool>* volatile pending_scan_;
+
+  // Allocated on the first ReadChannels(), since the stream may be used by
+  // something else if we never scan.
+  std::optional<DMAManager::StreamAllocation> dma_;
+};
+
+// Base for ADCs converting a sequence of channels (in scan mode), with results
+// transferred by DMA.
+template <uint32_t kADC>
+class SequenceADC : public ADCBase<kADC> {
+ public:
+  using ChannelAllocation = typename ADCBase<kADC>::ChannelAllocation;
+
+  SequenceADC();
+
+  // Append a channel to the sequence, and return its position. A channel can
+  // appear more than once. sampling_time_ns of 0 means the shortest sampling
+  // time. Must not be called while running.
+  int AddChannel(uint8_t channel, uint64_t sampling_time_ns = 0,
+                 bool is_vbatt = false);
+
+  int NumChannels() const { return num_channels_; }
+
+  bool Running() const { return running_; }
+
+ protected:
+  using ADCBase<kADC>::SetupChannel;
+  using ADCBase<kADC>::SetSamplingTime;
+
+  // Power off the ADC, and set up the sequence and DMA requests. The caller
+  // sets up the conversion trigger and the DMA stream, then powers on the ADC.
+  void ConfigureSequence();
+
+  // Power off the ADC (aborting the conversion in progress) and the DMA
+  // stream.
+  void StopSequence();
+
+  DMAManager::StreamAllocation dma_;
+
+  std::array<uint8_t, kMaxScanChannels> channels_;
+  std::array<ChannelAllocation, kMaxScanChannels> allocations_;
+  int num_channels_;
+  bool running_;
+};
+
+// ScanADC converts a sequence of up to 16 channels continuously in scan mode,
+// with DMA writing results into a circular buffer (one entry per sequence
+// position). No CPU time is used after Start(), and the latest value of each
+// channel can be read at any time without locking.
+//
+// ScanADC<ADC1> scan;
+// int pot = scan.AddChannel(3);
+// int temp = scan.AddChannel(kTemperatureChannel, 10000);
+// scan.Start();
+// ...
+// uint16_t value = scan.Latest(pot);
+template <uint32_t kADC>
+class ScanADC : public SequenceADC<kADC> {
+ public:
+  ScanADC();
+  ~ScanADC();
+
+  void Start();
+  void Stop();
+
+  // Latest conversion result for the channel at the given sequence position.
+  uint16_t Latest(int index) const { return buffer_[index]; }
+
+  // Latest result for every channel in the sequence. Individual values are
+  // always whole, but the DMA may be part-way through a scan, so values can
+  // be from two consecutive scans.
+  void Snapshot(uint16_t* out) const {
+    for (int i = 0; i < this->num_channels_; ++i) {
+      out[i] = buffer_[i];
+    }
+  }
+
+ private:
+  // Written by DMA.
+  volatile uint16_t buffer_[kMaxScanChannels];
+};
+
+// Regular group external trigger (EXTSEL) for each timer's TRGO, from RM0410
+// table "External trigger for regular channels". -1 if the timer can't trigger
+// regular conversions through TRGO.
+constexpr int RegularTriggerForTimer(uint32_t timer) {
+  switch (timer) {
+    case TIM1: return 9;
+    case TIM2: return 11;
+    case TIM4: return 12;
+    case TIM5: return 4;
+    case TIM6: return 13;
+    case TIM8: return 7;
+    default: return -1;
+  }
+}
+
+// TimedADC converts the channel sequence once per timer update, so the sample
+// rate is set by hardware, and doesn't jitter with interrupt and scheduling
+// latency. DMA fills the two halves of a buffer alternately, and each full half
+// (a block) is handed to the callback from the DMA interrupt.
+//
+// The application owns a block until it calls ReleaseBlock(), and must do that
+// before DMA comes back around to the block (one block period later). Blocks
+// still held when DMA starts overwriting them are counted as overruns.
+//
+// TimedADC<ADC1> adc(TIM6);
+// adc.AddChannel(3);
+// adc.Start(48000, buffer, 256, [&](const uint16_t* block, std::size_t len) {
+//   Process(block, len);
+//   adc.ReleaseBlock(block);
+// });
+template <uint32_t kADC>
+class TimedADC : public SequenceADC<kADC> {
+ public:
+  // Samples are interleaved in sequence order, and len is the number of
+  // samples (not sequences).
+  using BlockCallback =
+      std::function<void(const uint16_t* block, std::size_t len)>;
+
+  // timer must be one that can trigger regular conversions (TIM1, TIM2, TIM4,
+  // TIM5, TIM6, or TIM8). TIM6 is the obvious choice as it has no other use.
+  explicit TimedADC(uint32_t timer);
+  ~TimedADC();
+
+  // Start converting the sequence at sample_rate_hz. buffer must hold
+  // 2 * block_len samples, and block_len must be a multiple of the number of
+  // channels. Returns the actual sample rate, which may be slightly different
+  // due to timer resolution.
+  // Sampling times must be short enough for the whole sequence to be converted
+  // in one sample period.
+  float Start(float sample_rate_hz, uint16_t* buffer, std::size_t block_len,
+              BlockCallback callback);
+  void Stop();
+
+  // Give the block back to be refilled.
+  void ReleaseBlock(const uint16_t* block);
+
+  // Number of blocks that were overwritten before being released.
+  uint32_t Overruns() const { return overruns_; }
+
+ private:
+  void HandleDMAInterrupt();
+
+  // half has been filled, and DMA has moved on to the other half.
+  void BlockDone(int half);
+
+  TimerManager::TimerAllocation timer_;
+
+  uint16_t* buffer_;
+  std::size_t block_len_;
+  BlockCallback callback_;
+
+  // Whether each half is owned by the application.
+  volatile bool held_[2];
+  volatile uint32_t overruns_;
+};
+
+// InterleavedADC uses all three ADCs to convert the same channel, with their
+// sampling phases staggered, for up to ADC clock / 5 samples per second (5.4
+// MSPS with a 27 MHz ADC clock). Samples are streamed into a circular buffer
+// (which can be large, eg. in SDRAM) until a trigger, and a capture is
+// complete when the requested number of post-trigger samples have been
+// collected.
+// Every third sample comes from the same ADC, so offset and gain mismatch
+// between the ADCs shows up as a small tone at 1/3 of the sample rate.
+//
+// InterleavedADC adc(0);
+// adc.Arm(sdram_buffer, 100000, 1000, 9000, [&]() { capture_ready = true; });
+// ...
+// adc.Trigger();  // Eg. from an EXTI or analog watchdog interrupt.
+class InterleavedADC : public ADCBase<ADC1> {
+ public:
+  using CaptureCallback = std::function<void()>;
+
+  // Only channels routed to the same pin on all three ADCs can be used
+  // (0 to 3, and 10 to 13). delay_cycles is the ADC clock cycles between
+  // samples, from 5 to 20.
+  explicit InterleavedADC(uint8_t channel, uint32_t delay_cycles = 5);
+  ~InterleavedADC();
+
+  float SampleRate() const {
+    return static_cast<float>(ADCManager::GetInstance().ADCClock()) /
+           delay_cycles_;
+  }
+
+  // Start sampling continuously into buffer, which must be 4 bytes aligned.
+  // len must be even, and at most 2 * kDMAMaxTransfer.
+  // pre_trigger + post_trigger must be at most len / 2. Capture completion is
+  // checked at the half and full transfer interrupts, so this guarantees the
+  // capture is stopped before pre-trigger samples are overwritten.
+  // The callback is called from the DMA interrupt when the capture is done.
+  void Arm(uint16_t* buffer, std::size_t len, std::size_t pre_trigger,
+           std::size_t post_trigger, CaptureCallback callback);
+
+  // Mark the trigger point at the current sample. Safe to call from
+  // interrupts.
+  void Trigger();
+
+  // Stop sampling without completing the capture.
+  void Abort();
+
+  bool Armed() const { return state_ == State::kArmed; }
+  bool Triggered() const { return state_ == State::kTriggered; }
+  bool Done() const { return state_ == State::kDone; }
+
+  // Number of valid samples before the trigger. This is less than the
+  // requested pre-trigger length if the trigger came before the buffer had
+  // that many samples.
+  std::size_t PreTriggerSamples() const { return pre_valid_; }
+
+  // Sample i relative to the trigger, from -PreTriggerSamples() to
+  // post_trigger - 1. Only valid when Done().
+  uint16_t Sample(int i) const {
+    return buffer_[(trigger_pos_ + len_ + i) % len_];
+  }
+
+  // Copy the capture out in order, starting from the first pre-trigger sample.
+  // Returns the number of samples copied (PreTriggerSamples() + post_trigger).
+  std::size_t CopyCapture(uint16_t* out) const;
+
+ private:
+  enum class State {
+    kIdle,
+    kArmed,
+    kTriggered,
+    kDone
+  };
+
+  // Position in the buffer DMA will write the next sample to.
+  std::size_t CurrentPosition() const;
+
+  void HandleDMAInterrupt();
+
+  // Stop all three ADCs and DMA.
+  void StopSampling();
+
+  ChannelAllocation channel_allocation_;
+  uint32_t delay_cycles_;
+  DMAManager::StreamAllocation dma_;
+
+  uint16_t* buffer_;
+  std::size_t len_;
+  std::size_t pre_trigger_;
+  std::size_t post_trigger_;
+  CaptureCallback callback_;
+
+  volatile State state_;
+
+  // Whether DMA has been through the whole buffer at least once.
+  volatile bool wrapped_;
+  volatile std::size_t trigger_pos_;
+  volatile std::size_t pre_valid_;
+};
+
+// SimultaneousADC runs ADC1 and ADC2 (and ADC3 if kWidth is 3) in regular
+// simultaneous mode, so each tuple of channels is sampled at exactly the same
+// instant (eg. voltage and current for power measurement). Conversions are
+// triggered by a timer at a fixed rate, and tuples are written by DMA into a
+// ring buffer, from which they can be read without locking.
+//
+// SimultaneousADC<2> adc(TIM6);
+// adc.AddTuple({3, 4});  // Voltage on ADC1 channel 3, current on ADC2 channel 4.
+// adc.Start(10000, ring, 1024);
+// ...
+// SimultaneousADC<2>::Tuple t;
+// while (adc.Read(&t, 1)) { power += t[0] * t[1]; }
+template <int kWidth>
+class SimultaneousADC : public ADCBase<ADC1> {
+ public:
+  static_assert(kWidth == 2 || kWidth == 3, "Only dual and triple modes");
+
+  // Results from ADC1, ADC2, (ADC3).
+  using Tuple = std::array<uint16_t, kWidth>;
+
+  // timer must be one that can trigger regular conversions (see TimedADC).
+  explicit SimultaneousADC(uint32_t timer);
+  ~SimultaneousADC();
+
+  // Append a tuple of channels (for ADC1, ADC2, (ADC3)) to the sequence, and
+  // return its position. Every trigger converts the whole sequence. Channels
+  // in a tuple must be different (the same channel can't be converted by two
+  // ADCs at the same time). The sampling time applies to all channels in the
+  // tuple, as they must take the same time.
+  int AddTuple(const std::array<uint8_t, kWidth>& channels,
+               uint64_t sampling_time_ns = 0);
+
+  int SequenceLength() const { return num_tuples_; }
+
+  // Start converting the sequence at sample_rate_hz into a ring buffer of len
+  // tuples. Returns the actual sample rate. In dual mode DMA writes whole
+  // tuples as words, so buffer must be 4 bytes aligned.
+  float Start(float sample_rate_hz, Tuple* buffer, std::size_t len);
+  void Stop();
+
+  bool Running() const { return running_; }
+
+  // Number of tuples ready to be read.
+  std::size_t Available();
+
+  // Read up to max_tuples oldest unread tuples, and return the number read. If
+  // the reader falls behind by close to a full buffer, the oldest tuples are
+  // dropped and counted as overruns.
+  std::size_t Read(Tuple* out, std::size_t max_tuples);
+
+  // The most recently converted tuple, regardless of what has been read.
+  Tuple Latest();
+
+  uint64_t Overruns() const { return overruns_; }
+
+ private:
+  // Number of tuples written since Start().
+  uint64_t WriteCount() const;
+
+  void SetupPin(uint32_t adc, uint8_t channel);
+
+  TimerManager::TimerAllocation timer_;
+  DMAManager::StreamAllocation dma_;
+
+  std::array<std::array<uint8_t, kMaxScanChannels>, kWidth> sequences_;
+  int num_tuples_;
+
+  std::array<ChannelAllocation, kMaxScanChannels * kWidth> allocations_;
+  std::array<GPIOPortPin, kMaxScanChannels * kWidth> pins_;
+  int num_pins_;
+
+  Tuple* buffer_;
+  std::size_t len_;
+  bool running_;
+
+  // Incremented on every DMA wrap-around.
+  volatile uint32_t wraps_;
+
+  uint64_t read_count_;
+  uint64_t overruns_;
+};
+
+// Injected group external trigger (JEXTSEL), from RM0410 table "External
+// trigger for injected channels".
+enum class InjectedTrigger : uint32_t {
+  kTIM1TRGO = 0,
+  kTIM1CC4 = 1,
+  kTIM2TRGO = 2,
+  kTIM2CC1 = 3,
+  kTIM3CC4 = 4,
+  kTIM4TRGO = 5,
+  kTIM8CC4 = 7,
+  kTIM1TRGO2 = 8,
+  kTIM8TRGO = 9,
+  kTIM8TRGO2 = 10,
+  kTIM3CC3 = 11,
+  kTIM5TRGO = 12,
+  kTIM3CC1 = 13,
+  kTIM6TRGO = 14
+};
+
+constexpr int kMaxInjectedChannels = 4;
+
+// InjectedADC uses the injected group of an ADC, which can interrupt regular
+// conversions (eg. a ScanADC running in the background on the same ADC) for
+// low latency sampling of up to 4 channels. Results are delivered from the
+// JEOC interrupt.
+// The usual case is sampling motor or power stage currents at a fixed point
+// in the PWM period, using a PWM timer channel or TRGO as the trigger.
+// Starting or stopping regular conversions on the same ADC briefly powers it
+// off, so injected conversions should be triggered after that.
+//
+// InjectedADC<ADC1> current;
+// current.AddChannel(5);
+// current.SetCallback([](const uint16_t* results, int num) { ... });
+// current.SetHardwareTrigger(InjectedTrigger::kTIM1CC4);
+template <uint32_t kADC>
+class InjectedADC : public NonCopyable {
+ public:
+  using ChannelAllocation = ADCManager::ChannelAllocation;
+
+  // Called from the ADC interrupt with results of all channels, in the order
+  // they were added.
+  using Callback = std::function<void(const uint16_t* results, int num)>;
+
+  InjectedADC();
+  ~InjectedADC();
+
+  // Append a channel to the injected sequence, and return its position.
+  int AddChannel(uint8_t channel, uint64_t sampling_time_ns = 0,
+                 bool is_vbatt = false);
+
+  void SetCallback(Callback callback);
+
+  // Convert the sequence on the given edge of a timer event.
+  void SetHardwareTrigger(InjectedTrigger trigger,
+                          uint32_t edge = ADC_CR2_JEXTEN_RISING_EDGE);
+  void ClearHardwareTrigger();
+
+  // Convert the sequence now.
+  void TriggerSoftware();
+
+  // Results of the last conversion.
+  uint16_t Latest(int index) const { return results_[index]; }
+
+ private:
+  void HandleInterrupt();
+
+  std::array<uint8_t, kMaxInjectedChannels> channels_;
+  std::array<ChannelAllocation, kMaxInjectedChannels> allocations_;
+  int num_channels_;
+
+  Callback callback_;
+  volatile uint16_t results_[kMaxInjectedChannels];
 };
 
 }  // namespace Ostrich
@@ -0,0 +1,154 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ADC_CALIBRATION_H__
+#define __ADC_CALIBRATION_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Ostrich {
+
+// Factory calibration values in system memory, from the datasheet
+// "Temperature sensor calibration values" and "Internal reference voltage
+// calibration values". All were measured with Vdda = 3.3V.
+constexpr uint32_t kVrefintCalAddress = 0x1FF0F44A;  // At 30 degrees C.
+constexpr uint32_t kTSCal1Address = 0x1FF0F44C;  // At 30 degrees C.
+constexpr uint32_t kTSCal2Address = 0x1FF0F44E;  // At 110 degrees C.
+constexpr float kVrefintCalVdda = 3.3f;
+constexpr int32_t kCalVddaMillivolts = 3300;
+constexpr int32_t kTSCal1CentiDegrees = 3000;
+constexpr int32_t kTSCal2CentiDegrees = 11000;
+
+// 12-bit conversion results.
+constexpr int32_t kADCMaxCode = 4095;
+
+inline uint16_t ReadCalibrationValue(uint32_t address) {
+  return *reinterpret_cast<const volatile uint16_t*>(address);
+}
+
+inline uint16_t VrefintCal() {
+  return ReadCalibrationValue(kVrefintCalAddress);
+}
+
+// ADCCalibration converts raw conversion results to millivolts and
+// centi-degrees C using the factory calibration values, with coefficients
+// precomputed so conversions are only a multiply, an add, and a shift.
+// Conversions depend on Vdda, which is found from a conversion of the Vrefint
+// channel (eg. included in a scan sequence). Until UpdateVrefint() is called,
+// Vdda is assumed to be 3.3V.
+//
+// ADCCalibration cal;
+// cal.UpdateVrefint(scan.Latest(vrefint_index));
+// int32_t temp = cal.ToCentiDegrees(scan.Latest(temp_index));
+class ADCCalibration {
+ public:
+  ADCCalibration()
+      : vrefint_cal_(VrefintCal()),
+        ts_cal1_(ReadCalibrationValue(kTSCal1Address)),
+        ts_cal2_(ReadCalibrationValue(kTSCal2Address)),
+        vdda_mv_(kCalVddaMillivolts), mv_scale_(0), temp_scale_(0),
+        temp_offset_(0) {
+    UpdateVrefint(vrefint_cal_);
+  }
+
+  // Recompute coefficients with a new Vrefint conversion result. This is the
+  // only place with divisions.
+  void UpdateVrefint(uint16_t vrefint_raw) {
+    if (vrefint_raw == 0) {
+      return;
+    }
+
+    // Vdda = 3.3V * VREFINT_CAL / vrefint_raw.
+    vdda_mv_ = (kCalVddaMillivolts * vrefint_cal_ + vrefint_raw / 2) /
+               vrefint_raw;
+
+    // mV = raw * Vdda / 4095. This is computed from the calibration values
+    // directly, to not include rounding error from vdda_mv_.
+    int64_t mv_divisor = static_cast<int64_t>(vrefint_raw) * kADCMaxCode;
+    mv_scale_ = ((static_cast<int64_t>(kCalVddaMillivolts * vrefint_cal_)
+                  << kMillivoltShift) + mv_divisor / 2) / mv_divisor;
+
+    // The temperature sensor calibration was done at 3.3V, so we first scale
+    // raw to what it would have been at 3.3V, then interpolate between the
+    // calibration points:
+    // T = T1 + (T2 - T1) * (raw * VREFINT_CAL / vrefint_raw - TS_CAL1) /
+    //     (TS_CAL2 - TS_CAL1)
+    int64_t cal_span = ts_cal2_ - ts_cal1_;
+    if (cal_span <= 0) {
+      return;
+    }
+
+    constexpr int64_t kTempSpan = kTSCal2CentiDegrees - kTSCal1CentiDegrees;
+    temp_scale_ = ((kTempSpan * vrefint_cal_) << kTemperatureShift) /
+                  (cal_span * vrefint_raw);
+    temp_offset_ =
+        (static_cast<int64_t>(kTSCal1CentiDegrees) << kTemperatureShift) -
+        ((kTempSpan * ts_cal1_) << kTemperatureShift) / cal_span +
+        (1 << (kTemperatureShift - 1));
+  }
+
+  int32_t VddaMillivolts() const { return vdda_mv_; }
+
+  int32_t ToMillivolts(uint16_t raw) const {
+    return (raw * mv_scale_ + (1 << (kMillivoltShift - 1))) >> kMillivoltShift;
+  }
+
+  // Vbat is measured through a divide-by-4 bridge.
+  int32_t VbatToMillivolts(uint16_t raw) const {
+    return ToMillivolts(raw) * 4;
+  }
+
+  int32_t ToCentiDegrees(uint16_t temp_raw) const {
+    return (static_cast<int32_t>(temp_raw) * temp_scale_ + temp_offset_) >>
+           kTemperatureShift;
+  }
+
+  // Bulk conversions (eg. of DMA blocks).
+  void ToMillivolts(const uint16_t* raw, int32_t* out, std::size_t n) const {
+    for (std::size_t i = 0; i < n; ++i) {
+      out[i] = ToMillivolts(raw[i]);
+    }
+  }
+
+  void ToCentiDegrees(const uint16_t* raw, int32_t* out, std::size_t n) const {
+    for (std::size_t i = 0; i < n; ++i) {
+      out[i] = ToCentiDegrees(raw[i]);
+    }
+  }
+
+ private:
+  // Fixed point shifts. These are chosen so raw (12 bits) * scale fits in 32
+  // bits for any Vdda from 1.7V to 3.6V.
+  static constexpr int kMillivoltShift = 16;
+  static constexpr int kTemperatureShift = 12;
+
+  int32_t vrefint_cal_;
+  int32_t ts_cal1_;
+  int32_t ts_cal2_;
+
+  int32_t vdda_mv_;
+  int32_t mv_scale_;
+  int32_t temp_scale_;
+  int32_t temp_offset_;
+};
+
+}; // namespace Ostrich
+
+#endif // __ADC_CALIBRATION_H__
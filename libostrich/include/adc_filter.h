@@ -0,0 +1,125 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ADC_FILTER_H__
+#define __ADC_FILTER_H__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "adc.h"
+
+namespace Ostrich {
+
+// Decimation filters for blocks of 12-bit ADC samples (eg. from TimedADC),
+// trading sample rate for resolution. Oversampling by 4^n gives n extra bits
+// of effective resolution, as long as there is enough noise to dither the
+// input.
+//
+// Input blocks can contain multiple interleaved channels (as produced by
+// ADCs in scan mode), in which case each channel is filtered separately, and
+// output is interleaved the same way. Blocks don't need to be multiples of
+// the decimation ratio - partial sums are carried over to the next block.
+//
+// BoxcarDecimator decimator(64, 15);
+// TimedADC<ADC1> adc(TIM6);
+// adc.AddChannel(3);
+// adc.Start(64000, buffer, 256, [&](const uint16_t* block, std::size_t len) {
+//   uint16_t out[4];
+//   std::size_t num_out = decimator.Process(block, len, out);
+//   adc.ReleaseBlock(block);
+//   ...
+// });
+
+constexpr int kADCFilterInputBits = 12;
+constexpr int kMaxCICStages = 4;
+
+// Fixed point shift for output scaling. This is enough precision for 1 LSB
+// accuracy with any gain that fits in 32 bits.
+constexpr int kADCFilterScaleShift = 48;
+
+// Sums ratio samples per output (a moving average, evaluated once every ratio
+// samples). Cheap, but with poor rejection of noise just above the output
+// Nyquist frequency.
+class BoxcarDecimator {
+ public:
+  // output_bits is from 8 to 16. Values are scaled so full scale input is
+  // full scale output.
+  BoxcarDecimator(uint32_t ratio, int output_bits, int num_channels = 1);
+
+  // Filter len input samples (which must be a multiple of the number of
+  // channels), and return the number of output samples written to out. out
+  // must have space for (len / ratio + 1) samples per channel.
+  std::size_t Process(const uint16_t* in, std::size_t len, uint16_t* out);
+
+  void Reset();
+
+ private:
+  uint16_t Scale(uint32_t sum) const {
+    return (static_cast<uint64_t>(sum) * scale_) >> kADCFilterScaleShift;
+  }
+
+  uint32_t ratio_;
+  int num_channels_;
+
+  // Output = (sum * scale_) >> kADCFilterScaleShift.
+  uint64_t scale_;
+
+  // Number of sequences summed so far for the current output.
+  uint32_t count_;
+  std::array<uint32_t, kMaxScanChannels> sums_;
+};
+
+// Cascaded integrator-comb decimator, with 1 to 4 stages. Each stage adds
+// another sinc response, for much better alias rejection than a boxcar (which
+// is a 1 stage CIC). Integrators wrap around, which is harmless as long as
+// the output fits in 32 bits (12 + stages * log2(ratio) <= 32).
+// The first (stages - 1) outputs after a reset are the filter settling.
+class CICDecimator {
+ public:
+  CICDecimator(uint32_t ratio, int stages, int output_bits,
+               int num_channels = 1);
+
+  // Same as BoxcarDecimator::Process().
+  std::size_t Process(const uint16_t* in, std::size_t len, uint16_t* out);
+
+  void Reset();
+
+ private:
+  uint16_t Scale(uint32_t value) const {
+    return (static_cast<uint64_t>(value) * scale_) >> kADCFilterScaleShift;
+  }
+
+  uint32_t ratio_;
+  int stages_;
+  int num_channels_;
+  uint64_t scale_;
+
+  // Number of sequences so far for the current output.
+  uint32_t count_;
+
+  std::array<std::array<uint32_t, kMaxCICStages>, kMaxScanChannels>
+      integrators_;
+  std::array<std::array<uint32_t, kMaxCICStages>, kMaxScanChannels> combs_;
+};
+
+}; // namespace Ostrich
+
+#endif // __ADC_FILTER_H__
@@ -0,0 +1,99 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BLOCK_DEVICE_H__
+#define __BLOCK_DEVICE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "ostrich.h"
+#include "util.h"
+
+namespace Ostrich {
+
+// Interface for anything that stores fixed size blocks (RAM disks, SD cards,
+// flash chips, etc). Users of the interface (eg. USBMassStorage) don't care
+// where the blocks live.
+// All functions may be called from interrupt context.
+class BlockDevice : public NonCopyable {
+ public:
+  static constexpr uint32_t kDefaultBlockSize = 512;
+
+  virtual ~BlockDevice() {}
+
+  virtual uint32_t BlockCount() const = 0;
+  virtual uint32_t BlockSize() const { return kDefaultBlockSize; }
+  virtual bool WriteProtected() const { return false; }
+
+  // Read/write count blocks starting at lba. Return false on failure
+  // (including out of range accesses).
+  virtual bool ReadBlocks(uint32_t lba, uint8_t* buf, uint32_t count) = 0;
+  virtual bool WriteBlocks(uint32_t lba, const uint8_t* buf,
+                           uint32_t count) = 0;
+
+ protected:
+  bool InRange(uint32_t lba, uint32_t count) const {
+    return lba < BlockCount() && count <= (BlockCount() - lba);
+  }
+};
+
+// A block device backed by a chunk of memory. This can be internal SRAM, or
+// external SDRAM (which must already be set up through the FMC). Memory is
+// owned by the caller, and must outlive the RamDisk.
+class RamDisk : public BlockDevice {
+ public:
+  RamDisk(uint8_t* memory, std::size_t size,
+          uint32_t block_size = kDefaultBlockSize)
+      : memory_(memory), block_size_(block_size),
+        block_count_(size / block_size) {}
+
+  uint32_t BlockCount() const override { return block_count_; }
+  uint32_t BlockSize() const override { return block_size_; }
+
+  bool ReadBlocks(uint32_t lba, uint8_t* buf, uint32_t count) override {
+    if (!InRange(lba, count)) {
+      return false;
+    }
+    std::memcpy(buf, memory_ + lba * block_size_, count * block_size_);
+    return true;
+  }
+
+  bool WriteBlocks(uint32_t lba, const uint8_t* buf, uint32_t count) override {
+    if (!InRange(lba, count)) {
+      return false;
+    }
+    std::memcpy(memory_ + lba * block_size_, buf, count * block_size_);
+    return true;
+  }
+
+  // Direct access for the application (eg. to write captures into the disk
+  // image).
+  uint8_t* Data() { return memory_; }
+
+ private:
+  uint8_t* memory_;
+  uint32_t block_size_;
+  uint32_t block_count_;
+};
+
+} // namespace Ostrich
+
+#endif // __BLOCK_DEVICE_H__
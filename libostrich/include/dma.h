@@ -0,0 +1,220 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DMA_H__
+#define __DMA_H__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "ostrich.h"
+#include "util.h"
+
+namespace Ostrich {
+
+constexpr int kNumDMAs = 2;
+constexpr int kNumDMAStreams = 8;
+
+// NDTR is 16 bits.
+constexpr std::size_t kDMAMaxTransfer = 65535;
+
+// A DMA request mapping - which stream on which controller, and which channel
+// select on that stream, a peripheral request is routed to.
+// See RM0410 tables "DMA1 request mapping" and "DMA2 request mapping".
+struct DMAChannel {
+  uint32_t dma;
+  uint8_t stream;
+  uint32_t channel;  // DMA_SxCR_CHSEL_*
+};
+
+// libopencm3 only defines DMA_SxCR_CHSEL_0 to 7, but CHSEL is 4 bits wide on
+// F76x/F77x, and some requests are only mapped to channel 8 and above.
+constexpr uint32_t kDMAChannel8 = 8 << DMA_SxCR_CHSEL_SHIFT;
+
+constexpr int DMAToIndex(uint32_t dma) {
+  switch (dma) {
+    case DMA1: return 0;
+    case DMA2: return 1;
+    default: return -1;
+  }
+}
+
+extern const std::array<std::array<uint8_t, kNumDMAStreams>, kNumDMAs>
+    kDMAStreamIRQs;
+
+// DMAManager handles DMA controller clock enable, stream allocations, and
+// stream interrupt dispatch.
+class DMAManager : public Singleton {
+ public:
+  static DMAManager& GetInstance() {
+    static DMAManager instance;
+    return instance;
+  }
+
+  using Callback = std::function<void()>;
+
+  // This is an RAII token representing a grant from DMAManager to the holder
+  // to use the stream. Helper functions configure the most common single
+  // buffer transfers. Everything else can be done through libopencm3 using
+  // Dma() and Stream().
+  class StreamAllocation : public NonCopyable {
+   public:
+    friend class DMAManager;
+
+    StreamAllocation(StreamAllocation&& other)
+        : channel_(other.channel_), valid_(other.valid_) {
+      other.valid_ = false;
+    }
+
+    StreamAllocation& operator=(StreamAllocation&& other) {
+      channel_ = other.channel_;
+      valid_ = other.valid_;
+      other.valid_ = false;
+      return *this;
+    }
+
+    ~StreamAllocation() {
+      // May be invalid if this StreamAllocation was std::move()d.
+      if (valid_) {
+        nvic_disable_irq(IRQ());
+        Disable();
+        DMAManager::GetInstance().DeallocateStream(channel_);
+      }
+    }
+
+    uint32_t Dma() const { return channel_.dma; }
+    uint8_t Stream() const { return channel_.stream; }
+    uint8_t IRQ() const {
+      return kDMAStreamIRQs[DMAToIndex(channel_.dma)][channel_.stream];
+    }
+
+    // Reset the stream and set it up for a transfer between a peripheral
+    // register and memory.
+    // direction is DMA_SxCR_DIR_PERIPHERAL_TO_MEM or DMA_SxCR_DIR_MEM_TO_PERIPHERAL.
+    // size is DMA_SxCR_[PM]SIZE_{8,16,32}BIT (applied to both sides).
+    void SetupPeripheralTransfer(volatile void* peripheral, void* memory,
+                                 uint16_t count, uint32_t direction,
+                                 uint32_t psize, uint32_t msize) {
+      auto dma = channel_.dma;
+      auto stream = channel_.stream;
+      dma_stream_reset(dma, stream);
+      dma_channel_select(dma, stream, channel_.channel);
+      dma_set_transfer_mode(dma, stream, direction);
+      dma_set_peripheral_address(dma, stream,
+                                 reinterpret_cast<uint32_t>(peripheral));
+      dma_set_memory_address(dma, stream, reinterpret_cast<uint32_t>(memory));
+      dma_set_number_of_data(dma, stream, count);
+      dma_set_peripheral_size(dma, stream, psize);
+      dma_set_memory_size(dma, stream, msize);
+      dma_enable_memory_increment_mode(dma, stream);
+      dma_disable_peripheral_increment_mode(dma, stream);
+    }
+
+    void Enable() { dma_enable_stream(channel_.dma, channel_.stream); }
+
+    void Disable() {
+      dma_disable_stream(channel_.dma, channel_.stream);
+      // The stream only stops after the current transfer finishes.
+      while (DMA_SCR(channel_.dma, channel_.stream) & DMA_SxCR_EN) {}
+    }
+
+    // Number of data items left in the current transfer.
+    uint16_t Remaining() const {
+      return dma_get_number_of_data(channel_.dma, channel_.stream);
+    }
+
+    void ClearInterruptFlags() {
+      dma_clear_interrupt_flags(channel_.dma, channel_.stream,
+                                DMA_TCIF | DMA_HTIF | DMA_TEIF | DMA_DMEIF |
+                                DMA_FEIF);
+    }
+
+    // Register the callback and enable the stream IRQ. The callback should
+    // check and clear the interrupt flags it's interested in.
+    void SetISRCallback(Callback callback) {
+      DMAManager::GetInstance().RegisterISRCallback(channel_, callback);
+      nvic_enable_irq(IRQ());
+    }
+
+    void ClearISRCallback() {
+      nvic_disable_irq(IRQ());
+      DMAManager::GetInstance().DeregisterISRCallback(channel_);
+    }
+
+   private:
+    // Only DMAManager may construct StreamAllocations.
+    explicit StreamAllocation(const DMAChannel& channel)
+        : channel_(channel), valid_(true) {}
+
+    DMAChannel channel_;
+    bool valid_;
+  };
+
+  friend class StreamAllocation;
+
+  // Allocate a stream and turn on the DMA controller clock if necessary.
+  // Returns an empty optional if the stream is already in use, so callers that
+  // can also work without DMA can fall back.
+  std::optional<StreamAllocation> TryAllocateStream(const DMAChannel& channel);
+
+  // Same as above, but reports an error if the stream is in use.
+  StreamAllocation AllocateStream(const DMAChannel& channel) {
+    auto allocation = TryAllocateStream(channel);
+    if (!allocation) {
+      HandleError("DMA stream already in use");
+      LockUp();
+    }
+    return std::move(*allocation);
+  }
+
+  void InvokeCallback(uint32_t dma, uint8_t stream) {
+    auto& callback = isr_callbacks_[DMAToIndex(dma)][stream];
+    if (callback) {
+      callback();
+    }
+  }
+
+ private:
+  DMAManager();
+
+  void DeallocateStream(const DMAChannel& channel);
+
+  void RegisterISRCallback(const DMAChannel& channel, Callback callback) {
+    isr_callbacks_[DMAToIndex(channel.dma)][channel.stream] = callback;
+  }
+
+  void DeregisterISRCallback(const DMAChannel& channel) {
+    isr_callbacks_[DMAToIndex(channel.dma)][channel.stream] = Callback();
+  }
+
+  // in_use_[dma] records whether each stream is in use, in a bitfield.
+  std::array<uint8_t, kNumDMAs> in_use_;
+  std::array<std::array<Callback, kNumDMAStreams>, kNumDMAs> isr_callbacks_;
+};
+
+}; // namespace Ostrich
+
+#endif // __DMA_H__
@@ -0,0 +1,161 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __EXTI_H__
+#define __EXTI_H__
+
+#include <array>
+#include <cstdint>
+#include <functional>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/exti.h>
+
+#include "gpio.h"
+#include "ostrich.h"
+#include "systick.h"
+#include "util.h"
+
+namespace Ostrich {
+
+// EXTI lines 0-15 are for GPIO pins (line n can be connected to pin n of any
+// one port).
+constexpr int kNumGPIOEXTILines = 16;
+
+// Lines 5-9 and 10-15 share interrupt vectors.
+constexpr uint8_t EXTILineIRQ(int line) {
+  switch (line) {
+    case 0: return NVIC_EXTI0_IRQ;
+    case 1: return NVIC_EXTI1_IRQ;
+    case 2: return NVIC_EXTI2_IRQ;
+    case 3: return NVIC_EXTI3_IRQ;
+    case 4: return NVIC_EXTI4_IRQ;
+    default: return line < 10 ? NVIC_EXTI9_5_IRQ : NVIC_EXTI15_10_IRQ;
+  }
+}
+
+// EXTIManager handles EXTI line allocations and interrupt dispatch.
+class EXTIManager : public Singleton {
+ public:
+  static EXTIManager& GetInstance() {
+    static EXTIManager instance;
+    return instance;
+  }
+
+  // Called from interrupt context with the GetTimeClocks() time at interrupt
+  // entry.
+  using Callback = std::function<void(uint64_t timestamp_clocks)>;
+
+  // Connect the line to the port, and call the callback on the selected
+  // edge(s). Only one port can use each line.
+  void AllocateLine(int line, uint32_t port, exti_trigger_type trigger,
+                    Callback callback);
+  void DeallocateLine(int line);
+
+  // Dispatch pending lines in [first_line, last_line].
+  void InvokeCallbacks(int first_line, int last_line);
+
+ private:
+  EXTIManager();
+
+  // Bitfield indexed by line.
+  uint16_t in_use_;
+
+  std::array<Callback, kNumGPIOEXTILines> callbacks_;
+};
+
+// InterruptPin calls a callback from interrupt context on edges of an input
+// pin, with the time of the edge and the pin level after it.
+//
+// Optional debouncing ignores edges for debounce_us after each reported edge,
+// so a bouncing contact only produces one event, reported as soon as the
+// first edge arrives (not after the bouncing stops). Note that this means a
+// very short pulse (shorter than debounce_us) only has its first edge
+// reported.
+//
+// InterruptPin<PIN_B12> data_ready(EXTI_TRIGGER_RISING,
+//     [&](bool level, uint64_t timestamp_clocks) { ... });
+template <GPIOPortPin kPortPin>
+class InterruptPin : public NonCopyable {
+ public:
+  using Callback = std::function<void(bool level, uint64_t timestamp_clocks)>;
+
+  static constexpr int kLine = __builtin_ctz(UnpackPin(kPortPin));
+
+  /* trigger is EXTI_TRIGGER_RISING, EXTI_TRIGGER_FALLING, or EXTI_TRIGGER_BOTH */
+  /* pupd is GPIO_PUPD_NONE, GPIO_PUPD_PULLUP, or GPIO_PUPD_PULLDOWN */
+  InterruptPin(exti_trigger_type trigger, Callback callback,
+               uint32_t pupd = GPIO_PUPD_NONE, uint32_t debounce_us = 0)
+      : allocation_(GPIOManager::GetInstance().AllocatePin(kPortPin)),
+        trigger_(trigger), callback_(callback),
+        debounce_clocks_(static_cast<uint64_t>(debounce_us) *
+                         (g_ahb_freq / 1000000)),
+        last_event_clocks_(0), have_event_(false) {
+    allocation_.SetInput(pupd);
+    EXTIManager::GetInstance().AllocateLine(
+        kLine, UnpackPort(kPortPin), trigger,
+        [this](uint64_t timestamp_clocks) { HandleEdge(timestamp_clocks); });
+  }
+
+  ~InterruptPin() {
+    EXTIManager::GetInstance().DeallocateLine(kLine);
+  }
+
+  bool value() const {
+    return ReadGPIOPin<kPortPin>();
+  }
+
+  operator bool() const {
+    return value();
+  }
+
+ private:
+  void HandleEdge(uint64_t timestamp_clocks) {
+    if (debounce_clocks_ != 0) {
+      if (have_event_ &&
+          (timestamp_clocks - last_event_clocks_) < debounce_clocks_) {
+        return;
+      }
+      last_event_clocks_ = timestamp_clocks;
+      have_event_ = true;
+    }
+
+    bool level;
+    switch (trigger_) {
+      case EXTI_TRIGGER_RISING: level = true; break;
+      case EXTI_TRIGGER_FALLING: level = false; break;
+      default: level = value(); break;
+    }
+
+    if (callback_) {
+      callback_(level, timestamp_clocks);
+    }
+  }
+
+  GPIOManager::PinAllocation allocation_;
+  exti_trigger_type trigger_;
+  Callback callback_;
+  uint64_t debounce_clocks_;
+  uint64_t last_event_clocks_;
+  bool have_event_;
+};
+
+}; // namespace Ostrich
+
+#endif // __EXTI_H__
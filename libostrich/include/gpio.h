@@ -26,6 +26,7 @@
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
 
+#include <cstddef>
 #include <cstdint>
 
 #include <array>
@@ -135,6 +136,10 @@ class GPIOManager : public Singleton {
     return PinAllocation(portpin);
   }
 
+  bool IsAllocated(GPIOPortPin portpin) const {
+    return in_use_[PortToIndex(UnpackPort(portpin))] & UnpackPin(portpin);
+  }
+
  private:
   GPIOManager();
 
@@ -222,6 +227,135 @@ class InputPin {
   GPIOManager::PinAllocation allocation_;
 };
 
+// PinGroup drives several pins on the same port (eg. a parallel bus) as one
+// value, with a single BSRR write, so all pins change at the same time. Bit i
+// of the value is the i-th pin in the list. Masks are computed at compile
+// time, and if the pins are consecutive and in ascending order, values are
+// just shifted into place.
+//
+// PinGroup<PIN_E0, PIN_E1, PIN_E2, PIN_E3, PIN_E4, PIN_E5, PIN_E6, PIN_E7> bus;
+// bus = 0xa5;
+template <GPIOPortPin... kPortPins>
+class PinGroup {
+ public:
+  static constexpr std::size_t kNumPins = sizeof...(kPortPins);
+  static_assert(kNumPins > 0 && kNumPins <= 16, "PinGroup needs 1-16 pins");
+
+  static constexpr std::array<GPIOPortPin, kNumPins> kPortPinList{
+      {kPortPins...}};
+  static constexpr uint32_t kPort = UnpackPort(kPortPinList[0]);
+  static constexpr uint16_t kMask = (UnpackPin(kPortPins) | ...);
+
+  /* pupd is GPIO_PUPD_NONE, GPIO_PUPD_PULLUP, or GPIO_PUPD_PULLDOWN */
+  /* output_type is GPIO_OTYPE_PP (push-pull) or GPIO_OTYPE_OD (open drain) */
+  /* output_speed is GPIO_OSPEED_*MHZ, where * = {2, 25, 50, 100} */
+  PinGroup(uint32_t pupd = GPIO_PUPD_NONE,
+           uint32_t output_type = GPIO_OTYPE_PP,
+           uint32_t output_speed = GPIO_OSPEED_25MHZ)
+      : allocations_{{GPIOManager::GetInstance().AllocatePin(kPortPins)...}} {
+    static_assert(((UnpackPort(kPortPins) == kPort) && ...),
+                  "PinGroup pins must be on the same port");
+    static_assert(PinsUnique(), "PinGroup pins must be unique");
+    gpio_set_output_options(kPort, output_type, output_speed, kMask);
+    SetOutput(pupd);
+  }
+
+  // Switch direction of all pins (eg. for a bidirectional bus).
+  void SetOutput(uint32_t pupd = GPIO_PUPD_NONE) {
+    gpio_mode_setup(kPort, GPIO_MODE_OUTPUT, pupd, kMask);
+  }
+
+  void SetInput(uint32_t pupd = GPIO_PUPD_NONE) {
+    gpio_mode_setup(kPort, GPIO_MODE_INPUT, pupd, kMask);
+  }
+
+  void Write(uint16_t value) { GPIO_BSRR(kPort) = BSRRWord(value); }
+
+  // The BSRR value that sets the group to value, leaving other pins on the
+  // port alone.
+  static uint32_t BSRRWord(uint16_t value) {
+    uint16_t set_bits = Spread(value);
+    return set_bits | (static_cast<uint32_t>(kMask & ~set_bits) << 16);
+  }
+
+  PinGroup& operator=(uint16_t value) {
+    Write(value);
+    return *this;
+  }
+
+  // Pin states (in input or output mode), from a single IDR read.
+  uint16_t Read() const { return Gather(GPIO_IDR(kPort)); }
+
+  operator uint16_t() const { return Read(); }
+
+ private:
+  static constexpr std::array<uint16_t, kNumPins> kPinBits{
+      {UnpackPin(kPortPins)...}};
+
+  static constexpr int BitIndex(uint16_t pin_bit) {
+    int index = 0;
+    while (pin_bit > 1) {
+      pin_bit >>= 1;
+      ++index;
+    }
+    return index;
+  }
+
+  static constexpr int kShift = BitIndex(kPinBits[0]);
+
+  static constexpr bool Contiguous() {
+    for (std::size_t i = 0; i < kNumPins; ++i) {
+      if (kPinBits[i] != (kPinBits[0] << i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static constexpr bool PinsUnique() {
+    uint16_t seen = 0;
+    for (auto pin_bit : kPinBits) {
+      if (seen & pin_bit) {
+        return false;
+      }
+      seen |= pin_bit;
+    }
+    return true;
+  }
+
+  // Value bits to port bits.
+  static uint16_t Spread(uint16_t value) {
+    if constexpr (Contiguous()) {
+      return (value << kShift) & kMask;
+    } else {
+      uint16_t port_bits = 0;
+      for (std::size_t i = 0; i < kNumPins; ++i) {
+        if (value & (1 << i)) {
+          port_bits |= kPinBits[i];
+        }
+      }
+      return port_bits;
+    }
+  }
+
+  // Port bits to value bits.
+  static uint16_t Gather(uint16_t port_bits) {
+    if constexpr (Contiguous()) {
+      return (port_bits & kMask) >> kShift;
+    } else {
+      uint16_t value = 0;
+      for (std::size_t i = 0; i < kNumPins; ++i) {
+        if (port_bits & kPinBits[i]) {
+          value |= 1 << i;
+        }
+      }
+      return value;
+    }
+  }
+
+  std::array<GPIOManager::PinAllocation, kNumPins> allocations_;
+};
+
 }; // namespace Ostrich
 
 #endif // __GPIO_H__
@@ -0,0 +1,146 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GPIO_PATTERN_H__
+#define __GPIO_PATTERN_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "dma.h"
+#include "gpio.h"
+#include "ostrich.h"
+#include "timer.h"
+#include "util.h"
+
+namespace Ostrich {
+
+// BSRRPatternGenerator writes words from memory into a GPIO port's BSRR, one
+// per update of a timer, using the timer's update DMA request. Once started,
+// output timing is entirely in hardware, so it's not affected by interrupts,
+// and doesn't use any CPU time (except for refilling buffers in streaming
+// mode).
+//
+// Only DMA2 can write to GPIO ports (DMA1's peripheral port is only connected
+// to APB1), so the timer must be TIM1 (DMA2 stream 5) or TIM8 (DMA2 stream 1).
+//
+// Most users want PatternOutput below, which also sets up the pins.
+class BSRRPatternGenerator : public NonCopyable {
+ public:
+  // Fill a block with the next words to output. Called from interrupt
+  // context while streaming.
+  using FillCallback = std::function<void(uint32_t* block, std::size_t len)>;
+  using DoneCallback = std::function<void()>;
+
+  BSRRPatternGenerator(uint32_t timer, uint32_t port);
+  ~BSRRPatternGenerator();
+
+  // Output words continuously at word_rate_hz, double buffered. buffer must
+  // hold 2 * block_len words. fill is called for both halves before starting,
+  // and then for each half after it has been output, while the other half is
+  // being output. Returns the actual word rate.
+  float Start(float word_rate_hz, uint32_t* buffer, std::size_t block_len,
+              FillCallback fill);
+
+  // Output len words once, then call done (from interrupt context). words must
+  // stay valid until then. Returns the actual word rate.
+  float PlayOnce(float word_rate_hz, const uint32_t* words, std::size_t len,
+                 DoneCallback done = DoneCallback());
+
+  void Stop();
+
+  bool Running() const { return running_; }
+
+  // Number of times a fill callback didn't finish before the output reached
+  // the block it was filling.
+  uint32_t Underruns() const { return underruns_; }
+
+ private:
+  static DMAChannel UpdateDMAForTimer(uint32_t timer);
+
+  float Setup(float word_rate_hz, const uint32_t* words, std::size_t len);
+  void HandleDMAInterrupt();
+
+  TimerManager::TimerAllocation timer_;
+  DMAManager::StreamAllocation dma_;
+  uint32_t port_;
+
+  uint32_t* buffer_;
+  std::size_t block_len_;
+  FillCallback fill_;
+  DoneCallback done_;
+  bool streaming_;
+
+  volatile bool running_;
+  volatile uint32_t underruns_;
+};
+
+// PatternOutput drives a group of pins on one port from a timed sequence of
+// values, eg. for WS2812 LEDs or custom synchronous protocols. Bit i of each
+// value is the i-th pin, as in PinGroup. Word() converts values to the BSRR
+// words the generator takes, and should be used to precompute patterns.
+//
+// PatternOutput<PIN_C6> led_data(TIM8);
+// uint32_t pattern[3] = {led_data.Word(1), led_data.Word(0), led_data.Word(0)};
+// led_data.PlayOnce(2400000, pattern, 3);
+template <GPIOPortPin... kPortPins>
+class PatternOutput {
+ public:
+  using Pins = PinGroup<kPortPins...>;
+
+  /* output_speed is GPIO_OSPEED_*MHZ, where * = {2, 25, 50, 100} */
+  explicit PatternOutput(uint32_t timer,
+                         uint32_t output_speed = GPIO_OSPEED_50MHZ)
+      : pins_(GPIO_PUPD_NONE, GPIO_OTYPE_PP, output_speed),
+        generator_(timer, Pins::kPort) {}
+
+  static uint32_t Word(uint16_t value) { return Pins::BSRRWord(value); }
+
+  float Start(float word_rate_hz, uint32_t* buffer, std::size_t block_len,
+              BSRRPatternGenerator::FillCallback fill) {
+    return generator_.Start(word_rate_hz, buffer, block_len, fill);
+  }
+
+  float PlayOnce(float word_rate_hz, const uint32_t* words, std::size_t len,
+                 BSRRPatternGenerator::DoneCallback done =
+                     BSRRPatternGenerator::DoneCallback()) {
+    return generator_.PlayOnce(word_rate_hz, words, len, done);
+  }
+
+  void Stop() { generator_.Stop(); }
+
+  bool Running() const { return generator_.Running(); }
+
+  uint32_t Underruns() const { return generator_.Underruns(); }
+
+  // Set the pins directly (while not running).
+  PatternOutput& operator=(uint16_t value) {
+    pins_ = value;
+    return *this;
+  }
+
+ private:
+  Pins pins_;
+  BSRRPatternGenerator generator_;
+};
+
+}; // namespace Ostrich
+
+#endif // __GPIO_PATTERN_H__
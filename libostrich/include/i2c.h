@@ -20,13 +20,17 @@
 #ifndef __I2C_H__
 #define __I2C_H__
 
+#include <algorithm>
 #include <functional>
+#include <optional>
 #include <vector>
 
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/i2c.h>
 
+#include "dma.h"
 #include "gpio.h"
+#include "i2c_timing.h"
 #include "ostrich.h"
 #include "systick.h"
 #include "util.h"
@@ -45,8 +49,12 @@ struct I2CInfo {
   rcc_periph_clken i2c_rcc;
   rcc_periph_rst i2c_rst;
   uint8_t irq;
+  uint8_t er_irq;
   const char* str_name;
 
+  DMAChannel rx_dma;
+  DMAChannel tx_dma;
+
   std::vector<PinOption> sda_options;
   std::vector<PinOption> scl_options;
 };
@@ -76,37 +84,41 @@ enum class I2CSpeed {
   Speed1MHz = 3
 };
 
-// Time delays for speed options are taken from RM0410, table -
-// "Examples of timings settings for fI2CCLK = 48 MHz"
-// On the F7 APB1 clock (=I2CCLK in our case) can can go 54 MHz, so the values
-// may be a bit off.
-// If the actual APB1 clock is lower, we use the I2CCLK prescalar to keep the
-// I2C clock more or less constant, but some of these parameters will be too
-// conservative because they depend on the unscaled clock, too. They should be
-// safe, though.
-struct I2CSpeedParams {
-  uint32_t presc_target;
-  uint8_t scll;
-  uint8_t sclh;
-  uint8_t sdadel;
-  uint8_t scldel;
+constexpr uint32_t kI2CSpeedHz[kNumI2CSpeeds] = {
+  10000, 100000, 400000, 1000000
 };
 
-constexpr std::array<I2CSpeedParams, kNumI2CSpeeds> kI2CSpeedSettings = {{
-  // 10 kHz
-  {4000000, 0xc7, 0xc3, 0x2, 0x4},
+// Enables Fast-mode Plus drive (SYSCFG_PMC) on all pins used by the I2C.
+void SetI2CFastModePlus(uint32_t i2c, bool enable);
 
-  // 100 kHz
-  {4000000, 0x13, 0xf, 0x2, 0x4},
+constexpr int64_t kTransferTimeoutMilliseconds = 100;
 
-  // 400 kHz
-  {8000000, 0x9, 0x3, 0x3, 0x3},
+// NBYTES is 8 bits. Longer transfers are done in chunks using RELOAD.
+constexpr std::size_t kI2CMaxNBytes = 255;
+
+// Phases at least this long are done with DMA (if a stream is available).
+// Shorter ones are cheaper to do from the interrupt handler than setting up a
+// DMA stream.
+constexpr std::size_t kI2CDMAThreshold = 4;
+
+enum class I2CError {
+  kNone,
+  kNACK,
+  kBusError,
+  kArbitrationLost,
+  kOverrun,
+  kTimeout,
+  kBusy
+};
 
-  // 1 MHz
-  {8000000, 0x3, 0x1, 0x0, 0x1},
-}};
+const char* I2CErrorString(I2CError error);
 
-constexpr int64_t kTransferTimeoutMilliseconds = 100;
+// A piece of a write. Segments are sent back to back as one write, with no
+// START or STOP in between.
+struct I2CSegment {
+  const uint8_t* data;
+  std::size_t len;
+};
 
 
 class I2CManager : public NonCopyable {
@@ -159,11 +171,30 @@ class I2CManager : public NonCopyable {
 template <uint32_t kI2C, GPIOPortPin kSDAPin, GPIOPortPin kSCLPin>
 class I2C : public NonCopyable {
  public:
-  I2C(I2CSpeed speed) 
+  static constexpr uint32_t kPeripheral = kI2C;
+
+  // Called from interrupt context when an asynchronous transaction finishes.
+  using CompletionCallback = std::function<void(bool success)>;
+
+  I2C(I2CSpeed speed,
+      const I2CTimingConfig& timing_config = kDefaultI2CTimingConfig)
+    : I2C(kI2CSpeedHz[static_cast<int>(speed)], timing_config) {}
+
+  // Arbitrary bus frequency, up to 1 MHz.
+  I2C(uint32_t bus_hz,
+      const I2CTimingConfig& timing_config = kDefaultI2CTimingConfig)
     : sda_allocation_(GPIOManager::GetInstance().AllocatePin(kSDAPin)),
       scl_allocation_(GPIOManager::GetInstance().AllocatePin(kSCLPin)),
       info_(GetI2CInfo(kI2C)),
-      speed_(speed) {
+      timing_config_(timing_config),
+      timing_(ComputeI2CTiming(g_apb1_freq, bus_hz, timing_config)),
+      rx_dma_(DMAManager::GetInstance().TryAllocateStream(info_.rx_dma)),
+      tx_dma_(DMAManager::GetInstance().TryAllocateStream(info_.tx_dma)),
+      phase_(Phase::kIdle), addr_(0), single_segment_{nullptr, 0},
+      segments_(nullptr), num_segments_(0), segment_index_(0),
+      segment_pos_(0), read_buf_(nullptr), read_len_(0), read_pos_(0),
+      nbytes_left_(0), dma_chunk_len_(0), error_(I2CError::kNone),
+      last_error_(I2CError::kNone) {
 
     I2CManager::GetInstance().AllocateI2C(kI2C);
 
@@ -185,6 +216,7 @@ class I2C : public NonCopyable {
 
     if (sda_af == -1) { HandleError("I2C SDA pin invalid"); }
     if (scl_af == -1) { HandleError("I2C SCL pin invalid"); }
+    if (!timing_.valid) { HandleError("I2C speed not achievable"); }
 
     sda_allocation_.SetOutputOptions(GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ);
     scl_allocation_.SetOutputOptions(GPIO_OTYPE_OD, GPIO_OSPEED_2MHZ);
@@ -195,40 +227,54 @@ class I2C : public NonCopyable {
     rcc_periph_clock_enable(info_.i2c_rcc);
 
     ResetAndSetup();
+
+    // This is done here and not in ResetAndSetup() because ResetAndSetup() can
+    // be called from the ISR, and we can't replace the callback while it's
+    // running.
+    I2CManager::GetInstance().RegisterISRCallback(
+      kI2C, [this]() { HandleInterrupt(); });
+    nvic_enable_irq(info_.irq);
+    nvic_enable_irq(info_.er_irq);
+
+    if (tx_dma_) {
+      tx_dma_->SetISRCallback([this]() { HandleTxDMAInterrupt(); });
+    }
+
+    if (rx_dma_) {
+      rx_dma_->SetISRCallback([this]() { HandleRxDMAInterrupt(); });
+    }
   }
 
   void ResetAndSetup() {
     rcc_periph_reset_pulse(info_.i2c_rst);
 
-    // Setup.
-    const auto& speed_settings = kI2CSpeedSettings[static_cast<int>(speed_)];
-
-    // Calculate prescalar based on APB1 clocks.
-    uint32_t prescalar_setting = 0;
-
-    while ((g_apb1_freq / (prescalar_setting + 1)) >
-           speed_settings.presc_target) {
-      ++prescalar_setting;
+    // Setup. Filters and timings can only be changed while the peripheral is
+    // disabled.
+    if (timing_config_.analog_filter) {
+      i2c_enable_analog_filter(kI2C);
+    } else {
+      i2c_disable_analog_filter(kI2C);
     }
+    i2c_set_digital_filter(kI2C, timing_config_.digital_filter);
 
-    i2c_set_prescaler(kI2C, prescalar_setting);
-    i2c_set_scl_low_period(kI2C, speed_settings.scll);
-    i2c_set_scl_high_period(kI2C, speed_settings.sclh);
-    i2c_set_data_setup_time(kI2C, speed_settings.scldel);
-    i2c_set_data_hold_time(kI2C, speed_settings.sdadel);
+    i2c_set_prescaler(kI2C, timing_.presc);
+    i2c_set_scl_low_period(kI2C, timing_.scll);
+    i2c_set_scl_high_period(kI2C, timing_.sclh);
+    i2c_set_data_setup_time(kI2C, timing_.scldel);
+    i2c_set_data_hold_time(kI2C, timing_.sdadel);
 
-    // TODO: Use interrupts.
-    // I2CManager::GetInstance().RegisterISRCallback(
-    //   kI2C, [this]() { });
-    // nvic_enable_irq(info_.irq);
+    SetI2CFastModePlus(kI2C, timing_.fast_mode_plus);
 
     // Enable the I2C peripheral.
     i2c_peripheral_enable(kI2C);
   }
 
   ~I2C() {
-    //nvic_disable_irq(info_.irq);
+    Abort();
+    nvic_disable_irq(info_.irq);
+    nvic_disable_irq(info_.er_irq);
     i2c_peripheral_disable(kI2C);
+    SetI2CFastModePlus(kI2C, false);
     rcc_periph_clock_disable(info_.i2c_rcc);
     I2CManager::GetInstance().DeregisterISRCallback(kI2C);
     I2CManager::GetInstance().DeallocateI2C(kI2C);
@@ -236,8 +282,13 @@ class I2C : public NonCopyable {
 
   // All addresses should be in 7-bit form.
   // All these functions return whether the transmission was successful
-  // (everything acked).
-  // Maximum transfer size is 256 bytes.
+  // (everything acked). They block until the transaction is done, but the
+  // transfer itself is interrupt/DMA-driven, and we sleep in the meantime.
+  // There is no limit on transfer size.
+  // These may also be called from an interrupt handler, in which case they
+  // poll the peripheral instead of sleeping. The timeout then only works if
+  // GetTimeClocks() keeps running, ie. with a timebase other than kSysTick,
+  // or from a handler with lower priority than SysTick.
   bool Send(uint8_t addr, const uint8_t* data, std::size_t len) {
     return SendReceive(addr, data, len);
   }
@@ -248,87 +299,506 @@ class I2C : public NonCopyable {
 
   // Write write_len bytes, then read read_len bytes, with a repeated start
   // between read and write.
-  // This function is adapted from i2c_transfer7() in libopencm3.
+  // If both lengths are 0, only the address is sent. This can be used to
+  // probe for devices.
   bool SendReceive(uint8_t addr, const uint8_t* write_data = nullptr,
                    std::size_t write_len = 0, uint8_t* read_buf = nullptr,
                    std::size_t read_len = 0) {
-    int64_t timeout = GetTimeMilliseconds() + kTransferTimeoutMilliseconds;
-    auto timed_out = [timeout]() -> bool {
-      return static_cast<int64_t>(GetTimeMilliseconds()) > timeout;
-    };
-
-    /*  waiting for busy is unnecessary. read the RM */
-    if (write_data) {
-      i2c_set_7bit_address(kI2C, addr);
-      i2c_set_write_transfer_dir(kI2C);
-      i2c_set_bytes_to_transfer(kI2C, write_len);
-      if (read_buf) {
-        i2c_disable_autoend(kI2C);
-      } else {
-        i2c_enable_autoend(kI2C);
+    I2CSegment segment{write_data, write_len};
+    return SendSegmentsReceive(addr, &segment, 1, read_buf, read_len);
+  }
+
+  // Write all segments back to back as one write (eg. a register address
+  // from one buffer, followed by the payload from another), then optionally
+  // read, with a repeated start in between.
+  bool SendSegmentsReceive(uint8_t addr, const I2CSegment* segments,
+                           std::size_t num_segments,
+                           uint8_t* read_buf = nullptr,
+                           std::size_t read_len = 0) {
+    volatile bool done = false;
+    volatile bool success = false;
+
+    bool started = SendSegmentsReceiveAsync(
+        addr, segments, num_segments, read_buf, read_len,
+        [&done, &success](bool s) {
+          success = s;
+          done = true;
+        });
+
+    if (!started) {
+      HandleError(I2CErrorString(last_error_));
+      return false;
+    }
+
+    // Our interrupts can't preempt an interrupt handler of the same or
+    // higher priority, so from handler mode we run the state machine
+    // ourselves instead of waiting for them.
+    bool polling = InInterruptContext();
+
+    Deadline deadline(
+        TransferTimeout(TotalLength(segments, num_segments) + read_len));
+    while (!done) {
+      if (deadline.Expired()) {
+        Abort();
+        break;
       }
-      i2c_send_start(kI2C);
-
-      for (std::size_t i = 0; i < write_len; ++i) {
-        // Wait till we are either cleared to transmit or we got NACKed.
-        while (!(i2c_transmit_int_status(kI2C))) {
-          if (i2c_nack(kI2C)) {
-            HandleError("I2C NACK received");
-            return false;
-          }
-
-          if (timed_out()) {
-            HandleError("I2C Timed out");
-            ResetAndSetup();
-            return false;
-          }
-        }
-
-        i2c_send_data(kI2C, write_data[i]);
+
+      if (polling) {
+        PollInterrupts();
+      } else {
+        // Either an I2C interrupt or systick will wake us up.
+        WaitForInterrupt();
       }
+    }
+
+    if (!success) {
+      HandleError(I2CErrorString(last_error_));
+    }
+
+    return success;
+  }
+
+  // Start a transaction and return immediately. callback is called from
+  // interrupt context when the transaction finishes. Buffers must stay valid
+  // until then.
+  // Returns false (without calling the callback) if the transaction cannot be
+  // started because another one is in progress.
+  // There is no timeout - use Abort() if the transaction takes longer than
+  // TransferTimeout().
+  bool SendReceiveAsync(uint8_t addr, const uint8_t* write_data,
+                        std::size_t write_len, uint8_t* read_buf,
+                        std::size_t read_len, CompletionCallback callback) {
+    ScopedLock lock(this);
+
+    if (phase_ != Phase::kIdle) {
+      last_error_ = I2CError::kBusy;
+      return false;
+    }
+
+    single_segment_ = I2CSegment{write_data, write_len};
+    Start(addr, &single_segment_, 1, read_buf, read_len, callback);
+    return true;
+  }
+
+  // Same as above, but the result is delivered through a future, which must
+  // stay alive until the transaction finishes (Future's destructor ensures
+  // that).
+  bool SendReceiveAsync(uint8_t addr, const uint8_t* write_data,
+                        std::size_t write_len, uint8_t* read_buf,
+                        std::size_t read_len, Future<bool>* result) {
+    return SendReceiveAsync(addr, write_data, write_len, read_buf, read_len,
+                            [result](bool success) {
+                              result->SetValue(success);
+                            });
+  }
 
-      /* not entirely sure this is really necessary.
-       * RM implies it will stall until it can write out the later bits
-       */
-      if (read_buf) {
-        while (!i2c_transfer_complete(kI2C) && (!timed_out())) {}
-        if (timed_out()) {
-          HandleError("I2C Timed out");
-          ResetAndSetup();
-          return false;
-        }
+  // The segment array must also stay valid until the transaction finishes.
+  bool SendSegmentsReceiveAsync(uint8_t addr, const I2CSegment* segments,
+                                std::size_t num_segments, uint8_t* read_buf,
+                                std::size_t read_len,
+                                CompletionCallback callback) {
+    ScopedLock lock(this);
+
+    if (phase_ != Phase::kIdle) {
+      last_error_ = I2CError::kBusy;
+      return false;
+    }
+
+    Start(addr, segments, num_segments, read_buf, read_len, callback);
+    return true;
+  }
+
+  bool SendSegmentsReceiveAsync(uint8_t addr, const I2CSegment* segments,
+                                std::size_t num_segments, uint8_t* read_buf,
+                                std::size_t read_len, Future<bool>* result) {
+    return SendSegmentsReceiveAsync(addr, segments, num_segments, read_buf,
+                                    read_len, [result](bool success) {
+                                      result->SetValue(success);
+                                    });
+  }
+
+  bool Busy() const { return phase_ != Phase::kIdle; }
+
+  // Expected SCL frequency with the computed timings.
+  uint32_t ActualSpeedHz() const { return timing_.actual_hz; }
+
+  // How long a transaction of total_len bytes (written and read) may take
+  // before it should be given up on. This allows about twice the time the
+  // bytes take on the bus (9 clocks each), plus a fixed margin for clock
+  // stretching.
+  Duration TransferTimeout(std::size_t total_len) const {
+    return Duration::Milliseconds(
+        kTransferTimeoutMilliseconds +
+        static_cast<uint64_t>(total_len) * 18 * 1000 /
+            std::max<uint32_t>(timing_.actual_hz, 1));
+  }
+
+  // Why the last transaction failed (or couldn't be started).
+  I2CError LastError() const { return last_error_; }
+
+  // Abandon the transaction in progress (if any), and reset the peripheral.
+  // The completion callback is called with failure.
+  void Abort() {
+    ScopedLock lock(this);
+    if (phase_ != Phase::kIdle) {
+      Finish(I2CError::kTimeout);
+    }
+  }
+
+ private:
+  enum class Phase {
+    kIdle,
+    kWrite,
+    kRead
+  };
+
+  // Keeps all interrupts that can touch the transaction state from running.
+  class ScopedLock {
+   public:
+    explicit ScopedLock(I2C* i2c)
+        : irq_lock_(i2c->info_.irq), er_irq_lock_(i2c->info_.er_irq) {
+      if (i2c->tx_dma_) {
+        tx_dma_lock_.emplace(i2c->tx_dma_->IRQ());
+      }
+      if (i2c->rx_dma_) {
+        rx_dma_lock_.emplace(i2c->rx_dma_->IRQ());
       }
     }
 
-    if (read_buf) {
-      i2c_set_7bit_address(kI2C, addr);
-      i2c_set_read_transfer_dir(kI2C);
-      i2c_set_bytes_to_transfer(kI2C, read_len);
+   private:
+    ScopedIRQLock irq_lock_;
+    ScopedIRQLock er_irq_lock_;
+    std::optional<ScopedIRQLock> tx_dma_lock_;
+    std::optional<ScopedIRQLock> rx_dma_lock_;
+  };
+
+  static constexpr uint32_t kCommonInterrupts =
+      I2C_CR1_NACKIE | I2C_CR1_STOPIE | I2C_CR1_TCIE | I2C_CR1_ERRIE;
+
+  static constexpr uint32_t kAllInterrupts =
+      kCommonInterrupts | I2C_CR1_TXIE | I2C_CR1_RXIE;
+
+  static std::size_t TotalLength(const I2CSegment* segments,
+                                 std::size_t num_segments) {
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < num_segments; ++i) {
+      total += segments[i].len;
+    }
+    return total;
+  }
+
+  // Called with our interrupts disabled.
+  void Start(uint8_t addr, const I2CSegment* segments,
+             std::size_t num_segments, uint8_t* read_buf,
+             std::size_t read_len, CompletionCallback callback) {
+    addr_ = addr;
+    segments_ = segments;
+    num_segments_ = num_segments;
+    read_buf_ = read_buf;
+    read_len_ = read_len;
+    error_ = I2CError::kNone;
+    callback_ = callback;
+
+    std::size_t write_len = TotalLength(segments, num_segments);
+    if (write_len > 0 || read_len_ == 0) {
+      StartWrite(write_len);
+    } else {
+      StartRead();
+    }
+  }
+
+  // Program the next (up to) 255 bytes of the current phase into NBYTES. If
+  // there are more, RELOAD makes the peripheral stop and wait for us (TCR)
+  // instead of ending the transfer.
+  void LoadNBytes() {
+    std::size_t n = std::min(nbytes_left_, kI2CMaxNBytes);
+    nbytes_left_ -= n;
+    i2c_set_bytes_to_transfer(kI2C, n);
+    if (nbytes_left_ > 0) {
+      i2c_enable_reload(kI2C);
+    } else {
+      i2c_disable_reload(kI2C);
+    }
+  }
 
-      i2c_send_start(kI2C);
-      /* important to do it afterwards to do a proper repeated start! */
+  void StartWrite(std::size_t write_len) {
+    phase_ = Phase::kWrite;
+    nbytes_left_ = write_len;
+    segment_index_ = 0;
+    segment_pos_ = 0;
+
+    i2c_set_7bit_address(kI2C, addr_);
+    i2c_set_write_transfer_dir(kI2C);
+    LoadNBytes();
+    if (read_len_ > 0) {
+      i2c_disable_autoend(kI2C);
+    } else {
       i2c_enable_autoend(kI2C);
+    }
+
+    i2c_enable_interrupt(kI2C, kCommonInterrupts);
+    StartWriteSegment();
+
+    i2c_send_start(kI2C);
+  }
 
-      for (std::size_t i = 0; i < read_len; i++) {
-        while (i2c_received_data(kI2C) == 0 && !timed_out()) {}
-        if (timed_out()) {
-          HandleError("I2C Timed out");
-          ResetAndSetup();
-          return false;
-        }
-        read_buf[i] = i2c_get_data(kI2C);
+  // Set up the transfer of the rest of the current segment (skipping empty
+  // ones), using DMA if it's long enough.
+  void StartWriteSegment() {
+    while (segment_index_ < num_segments_ &&
+           segment_pos_ == segments_[segment_index_].len) {
+      ++segment_index_;
+      segment_pos_ = 0;
+    }
+
+    if (segment_index_ == num_segments_) {
+      i2c_disable_interrupt(kI2C, I2C_CR1_TXIE);
+      i2c_disable_txdma(kI2C);
+      return;
+    }
+
+    const I2CSegment& segment = segments_[segment_index_];
+    std::size_t remaining = segment.len - segment_pos_;
+    if (tx_dma_ && remaining >= kI2CDMAThreshold) {
+      dma_chunk_len_ = std::min(remaining, kDMAMaxTransfer);
+      // DMA never writes to memory in this direction.
+      tx_dma_->SetupPeripheralTransfer(
+          &I2C_TXDR(kI2C), const_cast<uint8_t*>(segment.data + segment_pos_),
+          dma_chunk_len_, DMA_SxCR_DIR_MEM_TO_PERIPHERAL, DMA_SxCR_PSIZE_8BIT,
+          DMA_SxCR_MSIZE_8BIT);
+      dma_enable_transfer_complete_interrupt(tx_dma_->Dma(),
+                                             tx_dma_->Stream());
+      tx_dma_->Enable();
+      i2c_disable_interrupt(kI2C, I2C_CR1_TXIE);
+      i2c_enable_txdma(kI2C);
+    } else {
+      i2c_disable_txdma(kI2C);
+      i2c_enable_interrupt(kI2C, I2C_CR1_TXIE);
+    }
+  }
+
+  void StartRead() {
+    phase_ = Phase::kRead;
+    nbytes_left_ = read_len_;
+    read_pos_ = 0;
+
+    i2c_disable_interrupt(kI2C, I2C_CR1_TXIE);
+    i2c_disable_txdma(kI2C);
+
+    i2c_set_7bit_address(kI2C, addr_);
+    i2c_set_read_transfer_dir(kI2C);
+    LoadNBytes();
+
+    i2c_enable_interrupt(kI2C, kCommonInterrupts);
+    StartReadChunk();
+
+    i2c_send_start(kI2C);
+    /* important to do it afterwards to do a proper repeated start! */
+    i2c_enable_autoend(kI2C);
+  }
+
+  void StartReadChunk() {
+    std::size_t remaining = read_len_ - read_pos_;
+    if (rx_dma_ && remaining >= kI2CDMAThreshold) {
+      dma_chunk_len_ = std::min(remaining, kDMAMaxTransfer);
+      rx_dma_->SetupPeripheralTransfer(
+          &I2C_RXDR(kI2C), read_buf_ + read_pos_, dma_chunk_len_,
+          DMA_SxCR_DIR_PERIPHERAL_TO_MEM, DMA_SxCR_PSIZE_8BIT,
+          DMA_SxCR_MSIZE_8BIT);
+      dma_enable_transfer_complete_interrupt(rx_dma_->Dma(),
+                                             rx_dma_->Stream());
+      rx_dma_->Enable();
+      i2c_disable_interrupt(kI2C, I2C_CR1_RXIE);
+      i2c_enable_rxdma(kI2C);
+    } else {
+      i2c_disable_rxdma(kI2C);
+      i2c_enable_interrupt(kI2C, I2C_CR1_RXIE);
+    }
+  }
+
+  // Run the interrupt handlers for whatever flags are set, for when the
+  // interrupts themselves can't run.
+  void PollInterrupts() {
+    ScopedLock lock(this);
+    HandleInterrupt();
+    if (tx_dma_) {
+      HandleTxDMAInterrupt();
+    }
+    if (rx_dma_) {
+      HandleRxDMAInterrupt();
+    }
+  }
+
+  // Handles both event and error interrupts.
+  void HandleInterrupt() {
+    uint32_t isr = I2C_ISR(kI2C);
+    uint32_t cr1 = I2C_CR1(kI2C);
+
+    if (phase_ == Phase::kIdle) {
+      i2c_disable_interrupt(kI2C, kAllInterrupts);
+      return;
+    }
+
+    if (isr & (I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR)) {
+      I2CError error = I2CError::kBusError;
+      if (isr & I2C_ISR_ARLO) {
+        error = I2CError::kArbitrationLost;
+      } else if (isr & I2C_ISR_OVR) {
+        error = I2CError::kOverrun;
       }
+      I2C_ICR(kI2C) = I2C_ICR_BERRCF | I2C_ICR_ARLOCF | I2C_ICR_OVRCF;
+
+      // We don't know what state the bus is in anymore.
+      Finish(error);
+      return;
     }
 
-    return true;
+    if (isr & I2C_ISR_NACKF) {
+      I2C_ICR(kI2C) = I2C_ICR_NACKCF;
+      error_ = I2CError::kNACK;
+
+      // Without AUTOEND (or with RELOAD) we have to generate the STOP
+      // ourselves. The transaction finishes when it's sent.
+      if (!(I2C_CR2(kI2C) & I2C_CR2_AUTOEND) ||
+          (I2C_CR2(kI2C) & I2C_CR2_RELOAD)) {
+        i2c_send_stop(kI2C);
+      }
+    }
+
+    // TXIS and RXNE are also set when DMA is handling them.
+    if ((isr & I2C_ISR_TXIS) && (cr1 & I2C_CR1_TXIE) &&
+        segment_index_ < num_segments_) {
+      i2c_send_data(kI2C, segments_[segment_index_].data[segment_pos_++]);
+      if (segment_pos_ == segments_[segment_index_].len) {
+        StartWriteSegment();
+      }
+    }
+
+    if ((isr & I2C_ISR_RXNE) && (cr1 & I2C_CR1_RXIE)) {
+      uint8_t data = i2c_get_data(kI2C);
+      if (read_pos_ < read_len_) {
+        read_buf_[read_pos_++] = data;
+      }
+    }
+
+    // NBYTES ran out, but there's more in this phase.
+    if (isr & I2C_ISR_TCR) {
+      LoadNBytes();
+    }
+
+    // TC is only set without AUTOEND, which means there's a read phase.
+    if ((isr & I2C_ISR_TC) && phase_ == Phase::kWrite) {
+      StartRead();
+    }
+
+    if (isr & I2C_ISR_STOPF) {
+      I2C_ICR(kI2C) = I2C_ICR_STOPCF;
+      Finish(error_);
+    }
+  }
+
+  // DMA transfer complete. Move on to the next segment or chunk, if any.
+  void HandleTxDMAInterrupt() {
+    uint32_t dma = tx_dma_->Dma();
+    uint8_t stream = tx_dma_->Stream();
+    if (!dma_get_interrupt_flag(dma, stream, DMA_TCIF)) {
+      return;
+    }
+    tx_dma_->ClearInterruptFlags();
+
+    if (phase_ != Phase::kWrite) {
+      return;
+    }
+
+    segment_pos_ += dma_chunk_len_;
+    StartWriteSegment();
+  }
+
+  void HandleRxDMAInterrupt() {
+    uint32_t dma = rx_dma_->Dma();
+    uint8_t stream = rx_dma_->Stream();
+    if (!dma_get_interrupt_flag(dma, stream, DMA_TCIF)) {
+      return;
+    }
+    rx_dma_->ClearInterruptFlags();
+
+    if (phase_ != Phase::kRead) {
+      return;
+    }
+
+    read_pos_ += dma_chunk_len_;
+    if (read_pos_ < read_len_) {
+      StartReadChunk();
+    }
+  }
+
+  // Called with our interrupts disabled (or from the ISR).
+  void Finish(I2CError error) {
+    i2c_disable_interrupt(kI2C, kAllInterrupts);
+    i2c_disable_txdma(kI2C);
+    i2c_disable_rxdma(kI2C);
+    if (tx_dma_) {
+      tx_dma_->Disable();
+      tx_dma_->ClearInterruptFlags();
+    }
+    if (rx_dma_) {
+      rx_dma_->Disable();
+      rx_dma_->ClearInterruptFlags();
+    }
+
+    if (error != I2CError::kNone && error != I2CError::kNACK) {
+      ResetAndSetup();
+    }
+
+    last_error_ = error;
+    phase_ = Phase::kIdle;
+
+    // The callback may start another transaction.
+    CompletionCallback callback;
+    std::swap(callback, callback_);
+    if (callback) {
+      callback(error == I2CError::kNone);
+    }
   }
 
- private:
   GPIOManager::PinAllocation sda_allocation_;
   GPIOManager::PinAllocation scl_allocation_;
 
   const I2CInfo& info_;
-  I2CSpeed speed_;
+  I2CTimingConfig timing_config_;
+  I2CTiming timing_;
+
+  // Either may be empty if the stream is used by something else, in which case
+  // we do everything from the ISR.
+  std::optional<DMAManager::StreamAllocation> rx_dma_;
+  std::optional<DMAManager::StreamAllocation> tx_dma_;
+
+  // Current transaction.
+  volatile Phase phase_;
+  uint8_t addr_;
+
+  // Write phase. single_segment_ backs the non-segmented API.
+  I2CSegment single_segment_;
+  const I2CSegment* segments_;
+  std::size_t num_segments_;
+  std::size_t segment_index_;
+  std::size_t segment_pos_;
+
+  // Read phase.
+  uint8_t* read_buf_;
+  std::size_t read_len_;
+  std::size_t read_pos_;
+
+  // Bytes in the current phase not yet loaded into NBYTES.
+  std::size_t nbytes_left_;
+
+  // Length of the DMA transfer in progress.
+  std::size_t dma_chunk_len_;
+
+  I2CError error_;
+  CompletionCallback callback_;
+
+  volatile I2CError last_error_;
 };
 
 }; // namespace Ostrich
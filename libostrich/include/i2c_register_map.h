@@ -0,0 +1,338 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __I2C_REGISTER_MAP_H__
+#define __I2C_REGISTER_MAP_H__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "i2c.h"
+#include "util.h"
+
+namespace Ostrich {
+
+enum class RegisterEndian {
+  kLittle,
+  kBig
+};
+
+// Compile-time description of one device register.
+// kAddress is the register address sent on the bus, and registers are assumed
+// to be byte-addressed with auto-increment (as in most sensors), so a burst
+// starting at kAddress continues into kAddress + kWidth.
+// Volatile registers (status, measurement results, etc) are never cached, and
+// writes to them go out immediately.
+template <uint8_t kAddress, uint8_t kWidth = 1,
+          RegisterEndian kEndian = RegisterEndian::kBig,
+          bool kVolatile = false>
+struct I2CRegister {
+  static_assert(kWidth >= 1 && kWidth <= 4, "Registers must be 1-4 bytes");
+
+  static constexpr uint8_t kAddr = kAddress;
+  static constexpr uint8_t kBytes = kWidth;
+  static constexpr RegisterEndian kByteOrder = kEndian;
+  static constexpr bool kIsVolatile = kVolatile;
+};
+
+// I2CRegisterMap keeps a shadow copy of a device's non-volatile registers.
+// Reads of cached registers don't touch the bus, Write() and Modify() only
+// update the shadow copy, and Flush() writes all dirty registers out,
+// coalescing dirty registers at contiguous addresses into single bursts.
+//
+// Registers must be listed in ascending address order, and must not overlap:
+//
+// using CtrlMeas = I2CRegister<0xf4>;
+// using Config = I2CRegister<0xf5>;
+// using PressureMSB = I2CRegister<0xf7, 1, RegisterEndian::kBig, true>;
+// I2CRegisterMap<decltype(i2c), CtrlMeas, Config, PressureMSB> regs(&i2c, 0x76);
+// regs.Modify<CtrlMeas>(0x03, 0x01);
+// regs.Write<Config>(0xa0);
+// regs.Flush();  // Both registers in one 2 byte burst.
+template <typename Bus, typename... Registers>
+class I2CRegisterMap : public NonCopyable {
+ public:
+  static constexpr std::size_t kNumRegisters = sizeof...(Registers);
+
+  static_assert(kNumRegisters > 0, "Register map needs registers");
+  static_assert(kNumRegisters <= 32, "Too many registers");
+
+  I2CRegisterMap(Bus* bus, uint8_t device_addr)
+      : bus_(bus), device_addr_(device_addr), valid_(0), dirty_(0),
+        shadow_() {
+    static_assert(Sorted(), "Registers must be in ascending address order, "
+                            "and must not overlap");
+  }
+
+  template <typename Reg>
+  bool IsCached() const {
+    return valid_ & RegisterBit<Reg>();
+  }
+
+  // Read a register, from the shadow copy if possible. Returns false on bus
+  // error.
+  template <typename Reg>
+  bool Read(uint32_t* value) {
+    constexpr std::size_t kOffset = Offset<Reg>();
+
+    if (!IsCached<Reg>()) {
+      if (!bus_->SendReceive(device_addr_, &Reg::kAddr, 1, &shadow_[kOffset],
+                             Reg::kBytes)) {
+        return false;
+      }
+
+      if (!Reg::kIsVolatile) {
+        valid_ |= RegisterBit<Reg>();
+      }
+    }
+
+    *value = Decode<Reg>(&shadow_[kOffset]);
+    return true;
+  }
+
+  // Update the shadow copy. The write happens on the next Flush(), unless the
+  // register is volatile, in which case it's written immediately.
+  template <typename Reg>
+  bool Write(uint32_t value) {
+    constexpr std::size_t kOffset = Offset<Reg>();
+    Encode<Reg>(value, &shadow_[kOffset]);
+
+    if (Reg::kIsVolatile) {
+      I2CSegment segments[2] = {
+        {&Reg::kAddr, 1},
+        {&shadow_[kOffset], Reg::kBytes}
+      };
+      return bus_->SendSegmentsReceive(device_addr_, segments, 2);
+    }
+
+    valid_ |= RegisterBit<Reg>();
+    dirty_ |= RegisterBit<Reg>();
+    return true;
+  }
+
+  // Read-modify-write. The read comes from the shadow copy if possible.
+  template <typename Reg>
+  bool Modify(uint32_t clear_mask, uint32_t set_mask) {
+    uint32_t value;
+    if (!Read<Reg>(&value)) {
+      return false;
+    }
+
+    return Write<Reg>((value & ~clear_mask) | set_mask);
+  }
+
+  // Write out all dirty registers. Registers at contiguous addresses are
+  // written in one burst. Returns false on bus error, in which case the
+  // registers that failed stay dirty.
+  bool Flush() {
+    bool success = true;
+    std::size_t i = 0;
+    while (i < kNumRegisters) {
+      if (!(dirty_ & (1u << i))) {
+        ++i;
+        continue;
+      }
+
+      std::size_t run_end = i + 1;
+      while (run_end < kNumRegisters && (dirty_ & (1u << run_end)) &&
+             Contiguous(run_end - 1, run_end)) {
+        ++run_end;
+      }
+
+      if (WriteRun(i, run_end)) {
+        for (std::size_t j = i; j < run_end; ++j) {
+          dirty_ &= ~(1u << j);
+        }
+      } else {
+        success = false;
+      }
+
+      i = run_end;
+    }
+
+    return success;
+  }
+
+  // Populate the shadow copy of all non-volatile registers (eg. at startup),
+  // reading contiguous registers in single bursts. Dirty registers are not
+  // overwritten.
+  bool Load() {
+    bool success = true;
+    std::size_t i = 0;
+    while (i < kNumRegisters) {
+      if (kInfos[i].is_volatile) {
+        ++i;
+        continue;
+      }
+
+      std::size_t run_end = i + 1;
+      while (run_end < kNumRegisters && !kInfos[run_end].is_volatile &&
+             Contiguous(run_end - 1, run_end)) {
+        ++run_end;
+      }
+
+      if (!ReadRun(i, run_end)) {
+        success = false;
+      }
+
+      i = run_end;
+    }
+
+    return success;
+  }
+
+  // Forget cached values (eg. after the device is reset). Pending writes are
+  // dropped.
+  void Invalidate() {
+    valid_ = 0;
+    dirty_ = 0;
+  }
+
+  bool Dirty() const { return dirty_ != 0; }
+
+ private:
+  struct RegisterInfo {
+    uint8_t addr;
+    uint8_t bytes;
+    bool is_volatile;
+  };
+
+  static constexpr std::array<RegisterInfo, kNumRegisters> kInfos = {{
+    {Registers::kAddr, Registers::kBytes, Registers::kIsVolatile}...
+  }};
+
+  static constexpr bool Sorted() {
+    for (std::size_t i = 1; i < kNumRegisters; ++i) {
+      if (kInfos[i].addr < kInfos[i - 1].addr + kInfos[i - 1].bytes) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static constexpr uint8_t kBaseAddr = kInfos[0].addr;
+
+  // The shadow copy spans the whole address range (in device byte order), so
+  // contiguous registers are also contiguous in the shadow, and bursts can be
+  // sent straight from it.
+  static constexpr std::size_t kShadowSize =
+      kInfos[kNumRegisters - 1].addr + kInfos[kNumRegisters - 1].bytes -
+      kBaseAddr;
+
+  template <typename Reg>
+  static constexpr std::size_t Index() {
+    constexpr bool kMatches[] = {std::is_same<Reg, Registers>::value...};
+    for (std::size_t i = 0; i < kNumRegisters; ++i) {
+      if (kMatches[i]) {
+        return i;
+      }
+    }
+    return kNumRegisters;
+  }
+
+  template <typename Reg>
+  static constexpr uint32_t RegisterBit() {
+    static_assert(Index<Reg>() < kNumRegisters, "Register not in this map");
+    return 1u << Index<Reg>();
+  }
+
+  template <typename Reg>
+  static constexpr std::size_t Offset() {
+    return Reg::kAddr - kBaseAddr;
+  }
+
+  static constexpr bool Contiguous(std::size_t a, std::size_t b) {
+    return kInfos[a].addr + kInfos[a].bytes == kInfos[b].addr;
+  }
+
+  template <typename Reg>
+  static uint32_t Decode(const uint8_t* bytes) {
+    uint32_t value = 0;
+    for (std::size_t i = 0; i < Reg::kBytes; ++i) {
+      std::size_t byte = Reg::kByteOrder == RegisterEndian::kBig ?
+                         i : (Reg::kBytes - 1 - i);
+      value = (value << 8) | bytes[byte];
+    }
+    return value;
+  }
+
+  template <typename Reg>
+  static void Encode(uint32_t value, uint8_t* bytes) {
+    for (std::size_t i = 0; i < Reg::kBytes; ++i) {
+      std::size_t byte = Reg::kByteOrder == RegisterEndian::kBig ?
+                         (Reg::kBytes - 1 - i) : i;
+      bytes[byte] = value & 0xff;
+      value >>= 8;
+    }
+  }
+
+  // Registers [first, last).
+  bool WriteRun(std::size_t first, std::size_t last) {
+    const RegisterInfo& start = kInfos[first];
+    const RegisterInfo& end = kInfos[last - 1];
+    I2CSegment segments[2] = {
+      {&start.addr, 1},
+      {&shadow_[start.addr - kBaseAddr],
+       static_cast<std::size_t>(end.addr + end.bytes - start.addr)}
+    };
+    return bus_->SendSegmentsReceive(device_addr_, segments, 2);
+  }
+
+  bool ReadRun(std::size_t first, std::size_t last) {
+    const RegisterInfo& start = kInfos[first];
+    const RegisterInfo& end = kInfos[last - 1];
+    std::size_t len = end.addr + end.bytes - start.addr;
+
+    // Read into a temporary buffer so we don't overwrite dirty registers.
+    std::array<uint8_t, kShadowSize> buf;
+    if (!bus_->SendReceive(device_addr_, &start.addr, 1, buf.data(), len)) {
+      return false;
+    }
+
+    for (std::size_t i = first; i < last; ++i) {
+      if (dirty_ & (1u << i)) {
+        continue;
+      }
+
+      std::size_t src = kInfos[i].addr - start.addr;
+      std::size_t dst = kInfos[i].addr - kBaseAddr;
+      for (std::size_t j = 0; j < kInfos[i].bytes; ++j) {
+        shadow_[dst + j] = buf[src + j];
+      }
+      valid_ |= 1u << i;
+    }
+
+    return true;
+  }
+
+  Bus* bus_;
+  uint8_t device_addr_;
+
+  // Bitfields indexed by register.
+  uint32_t valid_;
+  uint32_t dirty_;
+
+  std::array<uint8_t, kShadowSize> shadow_;
+};
+
+}; // namespace Ostrich
+
+#endif // __I2C_REGISTER_MAP_H__
@@ -0,0 +1,484 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __I2C_SCHEDULER_H__
+#define __I2C_SCHEDULER_H__
+
+#include <array>
+#include <cstdint>
+#include <functional>
+
+#include "i2c.h"
+#include "ostrich.h"
+#include "systick.h"
+#include "util.h"
+
+namespace Ostrich {
+
+// Maximum number of distinct device addresses we keep statistics for on each
+// bus. Transactions to further addresses still work, but aren't counted.
+constexpr int kI2CSchedulerMaxDevices = 16;
+
+constexpr uint64_t kNoDeadline = UINT64_MAX;
+
+struct I2CDeviceStats {
+  uint8_t addr;
+  uint32_t transactions;
+  uint32_t failures;
+
+  // Transactions dropped because they couldn't be started before their
+  // deadline.
+  uint32_t expired;
+
+  uint32_t bytes;
+
+  // Time the bus spent on this device's transactions. Divide by
+  // elapsed_clocks for bus utilization.
+  uint64_t busy_clocks;
+
+  // Transactions that were aborted because they took longer than
+  // I2C::TransferTimeout() (eg. a slave holding SCL low). These are also
+  // counted in failures.
+  uint32_t timeouts;
+
+  // Time between Submit() and the start of the transaction.
+  uint64_t total_queue_clocks;
+  uint32_t max_queue_clocks;
+
+  // Clocks since statistics were last reset.
+  uint64_t elapsed_clocks;
+};
+
+// One transaction on the bus, owned by the caller (usually a device driver).
+// The transaction and its buffers must stay alive until it's done.
+class I2CTransaction : public NonCopyable {
+ public:
+  enum class Status {
+    kIdle,
+    kQueued,
+    kInProgress,
+    kSucceeded,
+    kFailed,
+    kExpired
+  };
+
+  // Called when the transaction finishes or expires. This is usually in
+  // interrupt context, but can also be from Submit() or Poll() if the
+  // transaction expires before it's started.
+  using Callback = std::function<void(I2CTransaction* transaction)>;
+
+  I2CTransaction(uint8_t addr, const uint8_t* write_data,
+                 std::size_t write_len, uint8_t* read_buf = nullptr,
+                 std::size_t read_len = 0, Callback callback = Callback())
+      : addr_(addr), write_data_(write_data), write_len_(write_len),
+        read_buf_(read_buf), read_len_(read_len), callback_(callback),
+        priority_(0), deadline_clocks_(kNoDeadline), status_(Status::kIdle),
+        next_(nullptr), queued_clocks_(0) {}
+
+  Status GetStatus() const { return status_; }
+
+  bool Done() const {
+    Status status = status_;
+    return status != Status::kQueued && status != Status::kInProgress;
+  }
+
+  bool Succeeded() const { return status_ == Status::kSucceeded; }
+
+  // The write buffer can be changed between submissions (eg. to write a
+  // different register value).
+  void SetWriteData(const uint8_t* write_data, std::size_t write_len) {
+    write_data_ = write_data;
+    write_len_ = write_len;
+  }
+
+ private:
+  template <typename Bus> friend class I2CScheduler;
+
+  uint8_t addr_;
+  const uint8_t* write_data_;
+  std::size_t write_len_;
+  uint8_t* read_buf_;
+  std::size_t read_len_;
+  Callback callback_;
+
+  // Set by the scheduler on Submit().
+  uint8_t priority_;
+  uint64_t deadline_clocks_;
+
+  volatile Status status_;
+  I2CTransaction* next_;
+  uint64_t queued_clocks_;
+};
+
+// A transaction that is submitted automatically every period. Each release
+// must be started before the next one is due, otherwise it's dropped as
+// expired. A release that comes while the previous one is still queued or in
+// progress is skipped and counted as an overrun.
+class I2CPeriodicJob : public NonCopyable {
+ public:
+  I2CPeriodicJob(uint8_t addr, const uint8_t* write_data,
+                 std::size_t write_len, uint8_t* read_buf,
+                 std::size_t read_len, uint32_t period_us,
+                 uint8_t priority = 0,
+                 I2CTransaction::Callback callback = I2CTransaction::Callback())
+      : transaction_(addr, write_data, write_len, read_buf, read_len,
+                     callback),
+        period_clocks_(static_cast<uint64_t>(period_us) * g_ahb_freq / 1000000),
+        priority_(priority), next_release_clocks_(0), overruns_(0),
+        next_(nullptr) {}
+
+  const I2CTransaction& Transaction() const { return transaction_; }
+  uint32_t Overruns() const { return overruns_; }
+
+ private:
+  template <typename Bus> friend class I2CScheduler;
+
+  I2CTransaction transaction_;
+  uint64_t period_clocks_;
+  uint8_t priority_;
+  uint64_t next_release_clocks_;
+  uint32_t overruns_;
+  I2CPeriodicJob* next_;
+};
+
+// I2CScheduler queues transactions from any number of device drivers on one
+// bus, and runs them back to back from the I2C interrupt, so there's no
+// software round trip between transactions.
+//
+// Queued transactions run highest priority first, then earliest deadline
+// first, then in submission order. A transaction that is still queued when
+// its deadline passes is dropped.
+//
+// While a scheduler is running, the bus shouldn't be used directly.
+//
+// Periodic jobs are released whenever a transaction finishes, and when Poll()
+// is called. Call Poll() from the main loop so jobs are released on time when
+// the bus is otherwise idle. Poll() also aborts a transaction that has taken
+// longer than I2C::TransferTimeout(), so a stuck bus doesn't hold up the
+// queue forever.
+template <typename Bus>
+class I2CScheduler : public NonCopyable {
+ public:
+  explicit I2CScheduler(Bus* bus)
+      : bus_(bus), info_(GetI2CInfo(Bus::kPeripheral)), queue_head_(nullptr),
+        current_(nullptr), current_start_clocks_(0),
+        current_timeout_clocks_(0), jobs_head_(nullptr),
+        num_device_stats_(0), stats_reset_clocks_(GetTimeClocks()) {}
+
+  ~I2CScheduler() {
+    // Don't let the in-flight transaction call back into us.
+    {
+      ScopedIRQLock irq_lock(info_.irq);
+      ScopedIRQLock er_irq_lock(info_.er_irq);
+      queue_head_ = nullptr;
+      jobs_head_ = nullptr;
+    }
+
+    while (current_) {
+      {
+        ScopedIRQLock irq_lock(info_.irq);
+        ScopedIRQLock er_irq_lock(info_.er_irq);
+        if (AbortIfTimedOut()) {
+          break;
+        }
+      }
+      WaitForInterrupt();
+    }
+  }
+
+  // Queue a transaction. deadline_clocks is in GetTimeClocks() time.
+  // Returns false if the transaction is already queued or in progress.
+  bool Submit(I2CTransaction* transaction, uint8_t priority = 0,
+              uint64_t deadline_clocks = kNoDeadline) {
+    ScopedIRQLock irq_lock(info_.irq);
+    ScopedIRQLock er_irq_lock(info_.er_irq);
+
+    if (!transaction->Done()) {
+      return false;
+    }
+
+    transaction->priority_ = priority;
+    transaction->deadline_clocks_ = deadline_clocks;
+    Enqueue(transaction, GetTimeClocks());
+    StartNext();
+    return true;
+  }
+
+  // Remove a transaction from the queue. Returns false if it's not queued
+  // (already finished, or in progress).
+  bool Cancel(I2CTransaction* transaction) {
+    ScopedIRQLock irq_lock(info_.irq);
+    ScopedIRQLock er_irq_lock(info_.er_irq);
+
+    for (I2CTransaction** link = &queue_head_; *link;
+         link = &((*link)->next_)) {
+      if (*link == transaction) {
+        *link = transaction->next_;
+        transaction->next_ = nullptr;
+        transaction->status_ = I2CTransaction::Status::kIdle;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // The first release is immediate.
+  void AddPeriodicJob(I2CPeriodicJob* job) {
+    ScopedIRQLock irq_lock(info_.irq);
+    ScopedIRQLock er_irq_lock(info_.er_irq);
+    job->next_release_clocks_ = GetTimeClocks();
+    job->next_ = jobs_head_;
+    jobs_head_ = job;
+    ReleasePeriodicJobs();
+    StartNext();
+  }
+
+  // The job's transaction may still be in progress after this returns.
+  void RemovePeriodicJob(I2CPeriodicJob* job) {
+    ScopedIRQLock irq_lock(info_.irq);
+    ScopedIRQLock er_irq_lock(info_.er_irq);
+    for (I2CPeriodicJob** link = &jobs_head_; *link; link = &((*link)->next_)) {
+      if (*link == job) {
+        *link = job->next_;
+        job->next_ = nullptr;
+        break;
+      }
+    }
+    Cancel(&job->transaction_);
+  }
+
+  void Poll() {
+    ScopedIRQLock irq_lock(info_.irq);
+    ScopedIRQLock er_irq_lock(info_.er_irq);
+    AbortIfTimedOut();
+    ReleasePeriodicJobs();
+    StartNext();
+  }
+
+  bool Idle() const { return current_ == nullptr && queue_head_ == nullptr; }
+
+  // Returns stats with transactions == 0 if we haven't seen the address.
+  I2CDeviceStats GetDeviceStats(uint8_t addr) {
+    ScopedIRQLock irq_lock(info_.irq);
+    ScopedIRQLock er_irq_lock(info_.er_irq);
+    I2CDeviceStats ret = {};
+    ret.addr = addr;
+    for (int i = 0; i < num_device_stats_; ++i) {
+      if (device_stats_[i].addr == addr) {
+        ret = device_stats_[i];
+        break;
+      }
+    }
+    ret.elapsed_clocks = GetTimeClocks() - stats_reset_clocks_;
+    return ret;
+  }
+
+  void ResetStats() {
+    ScopedIRQLock irq_lock(info_.irq);
+    ScopedIRQLock er_irq_lock(info_.er_irq);
+    num_device_stats_ = 0;
+    stats_reset_clocks_ = GetTimeClocks();
+  }
+
+ private:
+  // Insert in (priority desc, deadline asc, FIFO) order.
+  void Enqueue(I2CTransaction* transaction, uint64_t now) {
+    transaction->status_ = I2CTransaction::Status::kQueued;
+    transaction->queued_clocks_ = now;
+
+    I2CTransaction** link = &queue_head_;
+    while (*link && !RunsBefore(transaction, *link)) {
+      link = &((*link)->next_);
+    }
+    transaction->next_ = *link;
+    *link = transaction;
+  }
+
+  static bool RunsBefore(const I2CTransaction* a, const I2CTransaction* b) {
+    if (a->priority_ != b->priority_) {
+      return a->priority_ > b->priority_;
+    }
+    return a->deadline_clocks_ < b->deadline_clocks_;
+  }
+
+  void ReleasePeriodicJobs() {
+    uint64_t now = GetTimeClocks();
+    for (I2CPeriodicJob* job = jobs_head_; job; job = job->next_) {
+      if (now < job->next_release_clocks_) {
+        continue;
+      }
+
+      if (!job->transaction_.Done()) {
+        ++job->overruns_;
+      } else {
+        job->transaction_.priority_ = job->priority_;
+        job->transaction_.deadline_clocks_ =
+            job->next_release_clocks_ + job->period_clocks_;
+        Enqueue(&job->transaction_, now);
+      }
+
+      // If we fell more than a period behind, skip the missed releases rather
+      // than bursting to catch up.
+      job->next_release_clocks_ += job->period_clocks_;
+      if (job->next_release_clocks_ <= now) {
+        job->next_release_clocks_ = now + job->period_clocks_;
+      }
+    }
+  }
+
+  // Called with I2C interrupts disabled, or from the I2C ISR.
+  void StartNext() {
+    while (!current_ && queue_head_) {
+      I2CTransaction* transaction = queue_head_;
+      queue_head_ = transaction->next_;
+      transaction->next_ = nullptr;
+
+      uint64_t now = GetTimeClocks();
+      I2CDeviceStats* stats = FindOrAllocateStats(transaction->addr_);
+
+      if (now > transaction->deadline_clocks_) {
+        if (stats) {
+          ++stats->expired;
+        }
+        Complete(transaction, I2CTransaction::Status::kExpired);
+        continue;
+      }
+
+      if (stats) {
+        uint64_t queue_clocks = now - transaction->queued_clocks_;
+        stats->total_queue_clocks += queue_clocks;
+        if (queue_clocks > stats->max_queue_clocks) {
+          stats->max_queue_clocks = queue_clocks;
+        }
+      }
+
+      current_ = transaction;
+      current_start_clocks_ = now;
+      current_timeout_clocks_ =
+          bus_->TransferTimeout(transaction->write_len_ +
+                                transaction->read_len_).InClocks();
+      transaction->status_ = I2CTransaction::Status::kInProgress;
+
+      bool started = bus_->SendReceiveAsync(
+          transaction->addr_, transaction->write_data_,
+          transaction->write_len_, transaction->read_buf_,
+          transaction->read_len_,
+          [this](bool success) { OnBusComplete(success); });
+
+      if (!started) {
+        current_ = nullptr;
+        if (stats) {
+          ++stats->failures;
+        }
+        Complete(transaction, I2CTransaction::Status::kFailed);
+      }
+    }
+  }
+
+  // From the I2C ISR.
+  void OnBusComplete(bool success) {
+    I2CTransaction* transaction = current_;
+    current_ = nullptr;
+
+    if (!transaction) {
+      return;
+    }
+
+    uint64_t now = GetTimeClocks();
+    I2CDeviceStats* stats = FindOrAllocateStats(transaction->addr_);
+    if (stats) {
+      ++stats->transactions;
+      if (!success) {
+        ++stats->failures;
+      }
+      stats->bytes += transaction->write_len_ + transaction->read_len_;
+      stats->busy_clocks += now - current_start_clocks_;
+    }
+
+    Complete(transaction, success ? I2CTransaction::Status::kSucceeded
+                                  : I2CTransaction::Status::kFailed);
+
+    ReleasePeriodicJobs();
+    StartNext();
+  }
+
+  // Called with I2C interrupts disabled. The bus calls OnBusComplete() with
+  // failure from Abort(), which completes the transaction and starts the next
+  // one. Returns whether we aborted.
+  bool AbortIfTimedOut() {
+    I2CTransaction* transaction = current_;
+    if (!transaction ||
+        GetTimeClocks() - current_start_clocks_ <= current_timeout_clocks_) {
+      return false;
+    }
+
+    I2CDeviceStats* stats = FindOrAllocateStats(transaction->addr_);
+    if (stats) {
+      ++stats->timeouts;
+    }
+
+    bus_->Abort();
+    return true;
+  }
+
+  void Complete(I2CTransaction* transaction, I2CTransaction::Status status) {
+    transaction->status_ = status;
+
+    // The callback may resubmit the transaction.
+    if (transaction->callback_) {
+      transaction->callback_(transaction);
+    }
+  }
+
+  I2CDeviceStats* FindOrAllocateStats(uint8_t addr) {
+    for (int i = 0; i < num_device_stats_; ++i) {
+      if (device_stats_[i].addr == addr) {
+        return &device_stats_[i];
+      }
+    }
+
+    if (num_device_stats_ == kI2CSchedulerMaxDevices) {
+      return nullptr;
+    }
+
+    I2CDeviceStats* stats = &device_stats_[num_device_stats_++];
+    *stats = I2CDeviceStats{};
+    stats->addr = addr;
+    return stats;
+  }
+
+  Bus* bus_;
+  const I2CInfo& info_;
+
+  I2CTransaction* queue_head_;
+  I2CTransaction* volatile current_;
+  uint64_t current_start_clocks_;
+  uint64_t current_timeout_clocks_;
+
+  I2CPeriodicJob* jobs_head_;
+
+  std::array<I2CDeviceStats, kI2CSchedulerMaxDevices> device_stats_;
+  int num_device_stats_;
+  uint64_t stats_reset_clocks_;
+};
+
+}; // namespace Ostrich
+
+#endif // __I2C_SCHEDULER_H__
@@ -0,0 +1,69 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __I2C_TIMING_H__
+#define __I2C_TIMING_H__
+
+#include <cstdint>
+
+namespace Ostrich {
+
+// I2C TIMINGR calculation. This doesn't touch hardware, so it's separate from
+// i2c.h.
+
+// Bus characteristics that affect timing. Rise time depends on bus
+// capacitance and pull-up strength, so it's board-specific. Measure it (30% to
+// 70% of VDD) if running close to the limits.
+struct I2CTimingConfig {
+  uint32_t rise_time_ns;
+  uint32_t fall_time_ns;
+  bool analog_filter;
+
+  // Digital noise filter length in I2CCLK periods (0 - 15).
+  uint8_t digital_filter;
+};
+
+constexpr I2CTimingConfig kDefaultI2CTimingConfig = {100, 10, true, 0};
+
+// TIMINGR fields (see RM0410 "I2C timings").
+struct I2CTiming {
+  bool valid;
+  uint8_t presc;
+  uint8_t scll;
+  uint8_t sclh;
+  uint8_t sdadel;
+  uint8_t scldel;
+
+  // Expected SCL frequency, given the rise and fall times.
+  uint32_t actual_hz;
+
+  // Fast-mode Plus drive is required above 400 kHz.
+  bool fast_mode_plus;
+};
+
+// Find timings that meet the I2C spec (UM10204 table 10) for the mode bus_hz
+// falls into, with an SCL frequency as close to bus_hz as possible without
+// going over. Returns valid = false if there's no solution (eg. I2CCLK too
+// slow).
+I2CTiming ComputeI2CTiming(uint32_t i2cclk_hz, uint32_t bus_hz,
+                           const I2CTimingConfig& config);
+
+}; // namespace Ostrich
+
+#endif // __I2C_TIMING_H__
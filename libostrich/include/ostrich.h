@@ -26,6 +26,7 @@
 #include <functional>
 
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
 
 namespace Ostrich {
@@ -37,6 +38,27 @@ extern uint32_t g_apb2_freq;
 extern uint32_t g_systick_period;
 extern uint32_t g_vdd_mv;
 
+// Source of GetTimeClocks() and friends.
+enum class Timebase {
+  // SysTick reload count plus current value. Needs the SysTick interrupt, and
+  // has systick_period_clocks granularity in the reload count.
+  kSysTick,
+
+  // DWT cycle counter (CYCCNT), extended to 64 bits in software. Single AHB
+  // clock resolution with no interrupt, but time must be read at least once
+  // every 2^32 clocks (~19.9s at 216MHz) for the extension to see every
+  // wrap. The SysTick interrupt does that if it's enabled.
+  kCycleCounter,
+
+  // TIM2 (low word) chained into TIM5 (high word), for a 64-bit hardware
+  // counter with no interrupt or read rate requirement. Resolution is one
+  // timer clock (2 AHB clocks at 216MHz). Uses TIM2 and TIM5.
+  kChainedTimers
+};
+
+extern Timebase g_timebase;
+extern bool g_sleeping_delays;
+
 extern volatile uint32_t g_systick_reloads_high;
 extern volatile uint32_t g_systick_reloads_low;
 
@@ -59,9 +81,17 @@ struct BoardConfig {
   // How often we do housekeeping in AHB (usually the same as CPU) clock cycles.
   // Reasonable values are in the hundreds, so the CPU doesn't spend excessive
   // amount of time servicing systick interrupts. This also determines step
-  // size of the time functions.
+  // size of the time functions in the kSysTick timebase. Other timebases
+  // don't need SysTick, and it's turned off if this is 0.
   uint64_t systick_period_clocks;
 
+  Timebase timebase = Timebase::kSysTick;
+
+  // Delays from the main loop sleep on TIM7 (see systick.h). This reserves
+  // TIM7 at startup. Set to false to leave TIM7 to the application, and spin
+  // in delays instead.
+  bool sleeping_delays = true;
+
   // Power supply voltage in 100mV increments. This is used to determine
   // settings that are voltage-dependent, eg. ADC clock pre-scaler.
   uint32_t vdd_voltage_mV;
@@ -100,6 +130,23 @@ class ScopedIRQLock {
   bool was_enabled_;
 };
 
+// Masks all interrupts on construction, and restores the previous state on
+// destruction. For very short critical sections shared with exceptions that
+// don't have an NVIC IRQ (eg. SysTick), or with any interrupt.
+class ScopedInterruptMask {
+ public:
+  ScopedInterruptMask() : old_mask_(cm_mask_interrupts(1)) {}
+
+  ~ScopedInterruptMask() {
+    cm_mask_interrupts(old_mask_);
+  }
+
+  ScopedInterruptMask(const ScopedInterruptMask&) = delete;
+  ScopedInterruptMask& operator=(const ScopedInterruptMask&) = delete;
+ private:
+  uint32_t old_mask_;
+};
+
 inline void HandleError(const std::string& msg) {
   if (g_error_handler) {
     g_error_handler(msg);
@@ -21,6 +21,9 @@
 #define __SYSTICK_H__
 
 #include <cstdint>
+#include <functional>
+
+#include "ostrich.h"
 
 namespace Ostrich {
 
@@ -29,10 +32,244 @@ uint64_t GetTimeClocks();
 uint64_t GetTimeMilliseconds();
 uint64_t GetTimeMicroseconds();
 
-// Busy waiting functions for short delays.
+// Delays. From the main loop, these sleep (wfi) on TIM7 for all but the last
+// microsecond or so, which is spun off with a calibrated loop. From interrupt
+// context they spin.
+//
+// InitSystick() allocates TIM7 for this, so it's not available to the
+// application unless BoardConfig::sleeping_delays is false, in which case
+// delays always spin.
 void DelayMilliseconds(uint64_t milliseconds);
 void DelayMicroseconds(uint64_t microseconds);
 
+// Housekeeping callbacks called from the SysTick interrupt every
+// systick_period_clocks, in the order they were added. These must be quick.
+// SysTick must be enabled (systick_period_clocks != 0).
+constexpr int kMaxSysTickCallbacks = 4;
+using SysTickCallback = std::function<void()>;
+void AddSysTickCallback(SysTickCallback callback);
+
+// Idle callbacks say whether there is work pending for the main loop (eg. data
+// in a stream). They are called with interrupts masked, so must be quick.
+constexpr int kMaxIdleCallbacks = 8;
+using IdleCallback = std::function<bool()>;
+void AddIdleCallback(IdleCallback callback);
+
+// Sleep until the next interrupt, unless an idle callback has work pending.
+// Call at the end of the main loop. Data that arrives (through an interrupt)
+// while the callbacks are being checked still wakes us up.
+void Idle();
+
+// Divides 64-bit values by a 32-bit divisor that is only known at run time,
+// using multiplies and shifts instead of a (slow, library call) 64-bit
+// division. Exact for all dividends. See Granlund and Montgomery, "Division
+// by Invariant Integers using Multiplication".
+class ConstantDivider {
+ public:
+  ConstantDivider() : magic_(0), divisor_(1), shift_(0), power_of_2_(true) {}
+
+  explicit ConstantDivider(uint32_t divisor)
+      : magic_(0), divisor_(divisor), shift_(0), power_of_2_(false) {
+    if (divisor == 0) {
+      HandleError("Division by 0");
+      divisor_ = 1;
+    }
+
+    // shift_ = ceil(log2(divisor)).
+    while ((static_cast<uint64_t>(1) << shift_) < divisor_) {
+      ++shift_;
+    }
+
+    if ((static_cast<uint64_t>(1) << shift_) == divisor_) {
+      power_of_2_ = true;
+      return;
+    }
+
+    // magic_ = floor(2^64 * (2^shift_ - divisor) / divisor) + 1. The numerator
+    // doesn't fit in 64 bits, so we do long division in 32-bit digits. This
+    // is the only place we divide.
+    uint64_t r = (static_cast<uint64_t>(1) << shift_) - divisor_;
+    uint64_t q_high = (r << 32) / divisor_;
+    uint64_t q_low = (((r << 32) % divisor_) << 32) / divisor_;
+    magic_ = ((q_high << 32) | q_low) + 1;
+  }
+
+  uint64_t Divide(uint64_t n) const {
+    if (power_of_2_) {
+      return n >> shift_;
+    }
+
+    uint64_t t = MultiplyHigh(magic_, n);
+    return (t + ((n - t) >> 1)) >> (shift_ - 1);
+  }
+
+  uint32_t Divisor() const { return divisor_; }
+
+ private:
+  // High 64 bits of the 128-bit product. We don't have __int128 on ARM.
+  static uint64_t MultiplyHigh(uint64_t a, uint64_t b) {
+    uint64_t a_low = a & 0xffffffff;
+    uint64_t a_high = a >> 32;
+    uint64_t b_low = b & 0xffffffff;
+    uint64_t b_high = b >> 32;
+
+    uint64_t low_low = a_low * b_low;
+    uint64_t high_low = a_high * b_low;
+    uint64_t low_high = a_low * b_high;
+    uint64_t high_high = a_high * b_high;
+
+    // Can't overflow: low_high <= (2^32 - 1)^2, and the other two terms are
+    // < 2^32.
+    uint64_t middle = (low_low >> 32) + (high_low & 0xffffffff) + low_high;
+    return high_high + (high_low >> 32) + (middle >> 32);
+  }
+
+  uint64_t magic_;
+  uint32_t divisor_;
+  uint8_t shift_;
+  bool power_of_2_;
+};
+
+// Converts between AHB clocks and units of 1/units_per_second seconds, both
+// ways rounding down, without dividing. Results are exact (the same as
+// clocks * units_per_second / clock_hz computed with enough bits not to
+// overflow).
+class ClockUnitConverter {
+ public:
+  ClockUnitConverter() : clocks_per_step_(), units_per_step_() {}
+
+  ClockUnitConverter(uint32_t clock_hz, uint32_t units_per_second) {
+    // Reduce the ratio, so that for the usual whole MHz clocks, one direction
+    // is a single divide and the other is a single multiply.
+    uint32_t a = clock_hz;
+    uint32_t b = units_per_second;
+    while (b != 0) {
+      uint32_t t = a % b;
+      a = b;
+      b = t;
+    }
+
+    clocks_per_step_ = ConstantDivider(clock_hz / a);
+    units_per_step_ = ConstantDivider(units_per_second / a);
+  }
+
+  uint64_t ClocksToUnits(uint64_t clocks) const {
+    return Scale(clocks, clocks_per_step_, units_per_step_.Divisor());
+  }
+
+  uint64_t UnitsToClocks(uint64_t units) const {
+    return Scale(units, units_per_step_, clocks_per_step_.Divisor());
+  }
+
+ private:
+  // floor(x * multiplier / divider.Divisor()), splitting x into whole steps
+  // and the remainder so nothing overflows.
+  static uint64_t Scale(uint64_t x, const ConstantDivider& divider,
+                        uint32_t multiplier) {
+    uint64_t steps = divider.Divide(x);
+    if (multiplier == 1) {
+      return steps;
+    }
+
+    uint64_t remainder = x - steps * divider.Divisor();
+    return steps * multiplier + divider.Divide(remainder * multiplier);
+  }
+
+  ConstantDivider clocks_per_step_;
+  ConstantDivider units_per_step_;
+};
+
+// Unit conversions for GetTimeClocks() time, set up by InitSystick().
+uint64_t ClocksToMilliseconds(uint64_t clocks);
+uint64_t ClocksToMicroseconds(uint64_t clocks);
+uint64_t MillisecondsToClocks(uint64_t milliseconds);
+uint64_t MicrosecondsToClocks(uint64_t microseconds);
+
+// A length of time, kept in AHB clocks so that comparing against
+// GetTimeClocks() never needs conversions.
+class Duration {
+ public:
+  constexpr Duration() : clocks_(0) {}
+
+  static constexpr Duration Clocks(uint64_t clocks) {
+    return Duration(clocks);
+  }
+
+  static Duration Microseconds(uint64_t microseconds) {
+    return Duration(MicrosecondsToClocks(microseconds));
+  }
+
+  static Duration Milliseconds(uint64_t milliseconds) {
+    return Duration(MillisecondsToClocks(milliseconds));
+  }
+
+  constexpr uint64_t InClocks() const { return clocks_; }
+  uint64_t InMicroseconds() const { return ClocksToMicroseconds(clocks_); }
+  uint64_t InMilliseconds() const { return ClocksToMilliseconds(clocks_); }
+
+  constexpr Duration operator+(Duration other) const {
+    return Duration(clocks_ + other.clocks_);
+  }
+
+  Duration& operator+=(Duration other) {
+    clocks_ += other.clocks_;
+    return *this;
+  }
+
+  constexpr bool operator<(Duration other) const {
+    return clocks_ < other.clocks_;
+  }
+
+  constexpr bool operator>(Duration other) const {
+    return clocks_ > other.clocks_;
+  }
+
+ private:
+  constexpr explicit Duration(uint64_t clocks) : clocks_(clocks) {}
+
+  uint64_t clocks_;
+};
+
+// A point in GetTimeClocks() time, for timeouts.
+//
+// Deadline deadline(Duration::Milliseconds(100));
+// while (!done) {
+//   if (deadline.Expired()) { ... }
+// }
+class Deadline {
+ public:
+  explicit Deadline(Duration from_now)
+      : clocks_(GetTimeClocks() + from_now.InClocks()) {}
+
+  static Deadline AtClocks(uint64_t clocks) {
+    Deadline deadline;
+    deadline.clocks_ = clocks;
+    return deadline;
+  }
+
+  static Deadline Never() { return AtClocks(UINT64_MAX); }
+
+  bool Expired() const { return GetTimeClocks() >= clocks_; }
+
+  // 0 if expired.
+  Duration Remaining() const {
+    uint64_t now = GetTimeClocks();
+    return Duration::Clocks(now >= clocks_ ? 0 : (clocks_ - now));
+  }
+
+  void Extend(Duration duration) { clocks_ += duration.InClocks(); }
+
+  uint64_t InClocks() const { return clocks_; }
+
+ private:
+  Deadline() : clocks_(0) {}
+
+  uint64_t clocks_;
+};
+
+// See DelayMilliseconds().
+void DelayUntil(const Deadline& deadline);
+
 }; // namespace Ostrich
 
 #endif // __SYSTICK_H__
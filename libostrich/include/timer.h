@@ -0,0 +1,177 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <array>
+#include <cstdint>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+
+#include "ostrich.h"
+#include "util.h"
+
+namespace Ostrich {
+
+constexpr int kNumTimers = 14;
+
+struct TimerInfo {
+  uint32_t timer;
+  rcc_periph_clken rcc;
+  rcc_periph_rst rst;
+
+  // Update interrupt. Some of these are shared between two timers.
+  uint8_t irq;
+
+  // Which APB the timer is on (1 or 2).
+  uint8_t apb;
+
+  // TIM2 and TIM5 have 32-bit counters. Everything else is 16-bit.
+  bool is_32bit;
+
+  const char* str_name;
+};
+
+constexpr std::array<TimerInfo, kNumTimers> kTimerInfos{{
+  {TIM1, RCC_TIM1, RST_TIM1, NVIC_TIM1_UP_TIM10_IRQ, 2, false, "TIM1"},
+  {TIM2, RCC_TIM2, RST_TIM2, NVIC_TIM2_IRQ, 1, true, "TIM2"},
+  {TIM3, RCC_TIM3, RST_TIM3, NVIC_TIM3_IRQ, 1, false, "TIM3"},
+  {TIM4, RCC_TIM4, RST_TIM4, NVIC_TIM4_IRQ, 1, false, "TIM4"},
+  {TIM5, RCC_TIM5, RST_TIM5, NVIC_TIM5_IRQ, 1, true, "TIM5"},
+  {TIM6, RCC_TIM6, RST_TIM6, NVIC_TIM6_DAC_IRQ, 1, false, "TIM6"},
+  {TIM7, RCC_TIM7, RST_TIM7, NVIC_TIM7_IRQ, 1, false, "TIM7"},
+  {TIM8, RCC_TIM8, RST_TIM8, NVIC_TIM8_UP_TIM13_IRQ, 2, false, "TIM8"},
+  {TIM9, RCC_TIM9, RST_TIM9, NVIC_TIM1_BRK_TIM9_IRQ, 2, false, "TIM9"},
+  {TIM10, RCC_TIM10, RST_TIM10, NVIC_TIM1_UP_TIM10_IRQ, 2, false, "TIM10"},
+  {TIM11, RCC_TIM11, RST_TIM11, NVIC_TIM1_TRG_COM_TIM11_IRQ, 2, false,
+   "TIM11"},
+  {TIM12, RCC_TIM12, RST_TIM12, NVIC_TIM8_BRK_TIM12_IRQ, 1, false, "TIM12"},
+  {TIM13, RCC_TIM13, RST_TIM13, NVIC_TIM8_UP_TIM13_IRQ, 1, false, "TIM13"},
+  {TIM14, RCC_TIM14, RST_TIM14, NVIC_TIM8_TRG_COM_TIM14_IRQ, 1, false,
+   "TIM14"}
+}};
+
+constexpr int TimerToIndex(uint32_t timer) {
+  switch (timer) {
+    case TIM1: return 0;
+    case TIM2: return 1;
+    case TIM3: return 2;
+    case TIM4: return 3;
+    case TIM5: return 4;
+    case TIM6: return 5;
+    case TIM7: return 6;
+    case TIM8: return 7;
+    case TIM9: return 8;
+    case TIM10: return 9;
+    case TIM11: return 10;
+    case TIM12: return 11;
+    case TIM13: return 12;
+    case TIM14: return 13;
+    default: return -1;
+  }
+}
+
+constexpr const TimerInfo& GetTimerInfo(uint32_t timer) {
+  return kTimerInfos[TimerToIndex(timer)];
+}
+
+// TimerManager handles timer clock enable and allocations.
+class TimerManager : public Singleton {
+ public:
+  static TimerManager& GetInstance() {
+    static TimerManager instance;
+    return instance;
+  }
+
+  // This is an RAII token representing a grant from TimerManager to the holder
+  // to use the timer. Helper functions cover using the timer as a periodic
+  // event source. Everything else can be done through libopencm3 using
+  // Timer().
+  class TimerAllocation : public NonCopyable {
+   public:
+    friend class TimerManager;
+
+    TimerAllocation(TimerAllocation&& other)
+        : timer_(other.timer_), valid_(other.valid_) {
+      other.valid_ = false;
+    }
+
+    TimerAllocation& operator=(TimerAllocation&& other) {
+      timer_ = other.timer_;
+      valid_ = other.valid_;
+      other.valid_ = false;
+      return *this;
+    }
+
+    ~TimerAllocation() {
+      // May be invalid if this TimerAllocation was std::move()d.
+      if (valid_) {
+        Stop();
+        TimerManager::GetInstance().DeallocateTimer(timer_);
+      }
+    }
+
+    uint32_t Timer() const { return timer_; }
+    const TimerInfo& Info() const { return GetTimerInfo(timer_); }
+
+    // Set prescaler and auto-reload for the closest achievable update rate,
+    // and return the actual rate. The timer must be stopped.
+    float SetUpdateFrequency(float frequency_hz);
+
+    // Output a trigger (TRGO) on every update event, eg. to start ADC or DAC
+    // conversions.
+    void SetTriggerOnUpdate() {
+      timer_set_master_mode(timer_, TIM_CR2_MMS_UPDATE);
+    }
+
+    void Start() { timer_enable_counter(timer_); }
+    void Stop() { timer_disable_counter(timer_); }
+
+   private:
+    // Only TimerManager may construct TimerAllocations.
+    explicit TimerAllocation(uint32_t timer) : timer_(timer), valid_(true) {}
+
+    uint32_t timer_;
+    bool valid_;
+  };
+
+  friend class TimerAllocation;
+
+  // Allocate a timer, turn on its clock, and reset it to default settings.
+  TimerAllocation AllocateTimer(uint32_t timer);
+
+  // Input clock of the timer. Timers run at twice the APB clock if the APB
+  // prescaler is not 1 (this assumes RCC_DCKCFGR1.TIMPRE is left at reset).
+  static uint32_t TimerClock(uint32_t timer);
+
+ private:
+  TimerManager();
+
+  void DeallocateTimer(uint32_t timer);
+
+  // Bitfield indexed by timer index.
+  uint16_t in_use_;
+};
+
+}; // namespace Ostrich
+
+#endif // __TIMER_H__
@@ -0,0 +1,174 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <array>
+#include <cstdint>
+#include <functional>
+
+#include "ostrich.h"
+#include "systick.h"
+#include "util.h"
+
+namespace Ostrich {
+
+// Software timers, counted in SysTick periods (ticks). Timers live in a
+// hierarchical timing wheel: kWheelLevels levels of kWheelSlots slots, where
+// each slot of level n covers kWheelSlots^n ticks. A timer goes into the
+// level its expiry is in range of, and moves down a level when the wheel
+// turns to its slot (at most kWheelLevels - 1 times over its life). Insert,
+// cancel, and expire are all O(1), and timers are intrusive, so there is no
+// allocation and no limit on the number of timers.
+//
+// Level 0 covers 64 ticks, and the whole wheel 2^24 ticks (4.6 hours at 1ms).
+// Timers further out than that go in the last slot, and are put back in when
+// it comes around.
+constexpr int kWheelSlotBits = 6;
+constexpr int kWheelSlots = 1 << kWheelSlotBits;
+constexpr int kWheelLevels = 4;
+
+class TimerWheel;
+
+// A one-shot or periodic timer. The callback is called either from the SysTick
+// interrupt (kInterrupt, must be quick), or from TimerWheel::RunDeferred() in
+// the main loop (kDeferred). A periodic kDeferred timer that fires again
+// before the main loop gets to it only runs once.
+//
+// Timers fire on a tick at least the requested time after starting, and less
+// than two SysTick periods late. Periodic timers don't drift after that.
+//
+// SoftwareTimer flush_timer([&]() { usb_serial.Flush(); });
+// flush_timer.StartPeriodic(Duration::Milliseconds(10));
+// while (true) {
+//   TimerWheel::GetInstance().RunDeferred();
+//   ...
+// }
+class SoftwareTimer : public NonCopyable {
+ public:
+  enum class Context {
+    kInterrupt,
+    kDeferred
+  };
+
+  using Callback = std::function<void()>;
+
+  explicit SoftwareTimer(Callback callback,
+                         Context context = Context::kDeferred);
+
+  // Cancels the timer.
+  ~SoftwareTimer();
+
+  // (Re)start the timer. These may be called from any context, including the
+  // timer's own callback.
+  void StartOneShot(Duration delay);
+  void StartPeriodic(Duration period);
+
+  // Stop the timer, and drop it if it has fired but is still waiting for
+  // RunDeferred().
+  void Cancel();
+
+  // Whether the timer is scheduled to fire.
+  bool Active() const { return pprev_ != nullptr; }
+
+ private:
+  friend class TimerWheel;
+
+  Callback callback_;
+  Context context_;
+
+  // Wheel slot (or expired list) linkage. pprev_ points at whatever points at
+  // us, so we can unlink in O(1) without knowing which list we are in.
+  // nullptr if not scheduled.
+  SoftwareTimer* next_;
+  SoftwareTimer** pprev_;
+
+  // Deferred queue linkage, same scheme.
+  SoftwareTimer* next_deferred_;
+  SoftwareTimer** pprev_deferred_;
+
+  uint64_t expiry_tick_;
+
+  // 0 for one-shot.
+  uint64_t period_ticks_;
+};
+
+// TimerWheel advances the wheel on every SysTick, and runs deferred callbacks.
+class TimerWheel : public Singleton {
+ public:
+  static TimerWheel& GetInstance() {
+    static TimerWheel instance;
+    return instance;
+  }
+
+  // Call periodically from the main loop to run callbacks of kDeferred timers
+  // that have fired.
+  void RunDeferred();
+
+  // Whether RunDeferred() has work to do.
+  bool DeferredPending() const {
+    CompilerBarrier();
+    return deferred_head_ != nullptr;
+  }
+
+  // Number of SysTick periods in duration, rounded up.
+  uint64_t DurationToTicks(Duration duration) const;
+
+  uint64_t CurrentTick() const { return current_tick_; }
+
+ private:
+  friend class SoftwareTimer;
+
+  TimerWheel();
+
+  void Schedule(SoftwareTimer* timer, uint64_t delay_ticks,
+                uint64_t period_ticks);
+  void Cancel(SoftwareTimer* timer);
+
+  // Called from the SysTick interrupt.
+  void Tick();
+
+  // Move timers in a slot to lower levels.
+  void Cascade(int level, int slot);
+
+  // These must be called with interrupts masked.
+  void Insert(SoftwareTimer* timer);
+  void Expire(SoftwareTimer* timer);
+
+  static void Link(SoftwareTimer** head, SoftwareTimer* timer);
+  static void Unlink(SoftwareTimer* timer);
+  void LinkDeferred(SoftwareTimer* timer);
+  void UnlinkDeferred(SoftwareTimer* timer);
+
+  std::array<std::array<SoftwareTimer*, kWheelSlots>, kWheelLevels> slots_;
+
+  // Last tick processed. Timers expiring at or before this have fired.
+  volatile uint64_t current_tick_;
+
+  // FIFO of fired kDeferred timers.
+  SoftwareTimer* deferred_head_;
+  SoftwareTimer** deferred_tail_;
+
+  ConstantDivider systick_period_;
+};
+
+}; // namespace Ostrich
+
+#endif // __TIMER_WHEEL_H__
@@ -0,0 +1,197 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USB_ADC_STREAM_H__
+#define __USB_ADC_STREAM_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include <libopencm3/usb/usbd.h>
+
+#include "gpio.h"
+#include "util.h"
+
+namespace Ostrich {
+
+// Frame header magic. Both 16-bit halves have bits above 12 set, so (since
+// frames are always 16-bit aligned in the stream) it can never appear in
+// sample data, and the host can resynchronize by looking for it.
+constexpr uint32_t kADCStreamMagic = 0xADC0FFEE;
+
+// Vendor requests (bmRequestType 0x41) to start and stop streaming. Blocks
+// produced while the host is not listening are dropped (but still counted in
+// sequence numbers).
+constexpr uint8_t kADCStreamRequestStart = 0x10;
+constexpr uint8_t kADCStreamRequestStop = 0x11;
+
+// Wire format of the frame header (little endian). Each frame is a header
+// followed by num_samples 16-bit samples, interleaved in sequence order if
+// there are multiple channels. See scripts/adc_stream.py.
+struct ADCStreamHeader {
+  uint32_t magic;
+
+  // Incremented for every block the ADC produces, so the host can detect
+  // dropped blocks.
+  uint32_t sequence;
+
+  // GetTimeMicroseconds() (truncated) when the last sample of the block was
+  // converted.
+  uint32_t timestamp_us;
+
+  uint32_t sample_rate_hz;
+  uint16_t num_samples;
+  uint8_t num_channels;
+  uint8_t reserved;
+} __attribute__((packed));
+
+// USBADCStream streams blocks from a TimedADC to the host through a vendor
+// specific bulk IN endpoint, for continuous capture at up to the FullSpeed
+// bulk limit (about 1MB/s, or 500k samples/s).
+//
+// Samples are written into the endpoint FIFO straight from the DMA buffer,
+// and the block is given back to the ADC as soon as the last packet is
+// written. Only the first packet of each frame (header and the first few
+// samples) is assembled separately.
+//
+// If the host doesn't collect a block before the ADC finishes the next one,
+// the ADC starts overwriting it, so we abandon the rest of it and start
+// sending the new block. The host sees a short frame and a sequence gap.
+//
+// USBADCStream stream;
+// TimedADC<ADC1> adc(TIM6);
+// adc.AddChannel(3);
+// uint16_t buffer[2 * 512];
+// stream.Start(&adc, 200000, buffer, 512);
+class USBADCStream {
+ public:
+  // Maximum bulk packet size in FullSpeed mode.
+  static constexpr std::size_t kPacketSize = 64;
+
+  struct Stats {
+    // Frames completely written to the endpoint.
+    uint32_t frames_sent;
+
+    // Blocks dropped because the host was not streaming.
+    uint32_t frames_dropped;
+
+    // Frames abandoned part way because the ADC caught up.
+    uint32_t frames_truncated;
+  };
+
+  using ReleaseCallback = std::function<void(const uint16_t* block)>;
+
+  // The default PIDs here are testing PIDs (http://pid.codes/1209/0001/).
+  // Make sure to change them before redistributing or selling any device!
+  USBADCStream(uint16_t vid = 0x1209, uint16_t pid = 0x0001,
+               uint16_t current_ma = 100, const char* manufacturer = "Ostrich",
+               const char* product = "ADC-Stream");
+  ~USBADCStream();
+
+  USBADCStream(const USBADCStream&) = delete;
+  USBADCStream& operator=(const USBADCStream&) = delete;
+
+  // Start the ADC (which must have its channels added already), and stream
+  // its blocks. buffer must hold 2 * block_len samples. Returns the actual
+  // sample rate.
+  template <typename ADC>
+  float Start(ADC* adc, float sample_rate_hz, uint16_t* buffer,
+              std::size_t block_len) {
+    SetSource([adc](const uint16_t* block) { adc->ReleaseBlock(block); },
+              adc->NumChannels());
+    sample_rate_hz_ = sample_rate_hz;
+    float actual_rate = adc->Start(
+        sample_rate_hz, buffer, block_len,
+        [this](const uint16_t* block, std::size_t len) {
+          QueueBlock(block, len);
+        });
+    sample_rate_hz_ = actual_rate;
+    return actual_rate;
+  }
+
+  // Lower level interface for other sources. Set how blocks are given back,
+  // then call QueueBlock() (usually from interrupt context) with each block.
+  void SetSource(ReleaseCallback release, uint8_t num_channels);
+  void QueueBlock(const uint16_t* block, std::size_t len);
+
+  // Whether the host has asked for samples.
+  bool Streaming() const { return streaming_; }
+
+  Stats GetStats() const;
+
+  void Poll() { usbd_poll(usbd_dev_); }
+
+ private:
+  static void SetConfigCallback(usbd_device* usbd_dev, uint16_t wValue);
+  static void DataTxCallback(usbd_device* usbd_dev, uint8_t endpoint);
+  static usbd_request_return_codes ControlRequestCallback(
+      usbd_device* usbd_dev, usb_setup_data* req, uint8_t** buf, uint16_t* len,
+      void (**complete)(usbd_device* usbd_dev, usb_setup_data* req));
+
+  // Write the next packet of the current frame if the endpoint is free.
+  // Called with the OTG FS interrupt disabled, or from it.
+  void SendNextPacket();
+
+  // Give the current block back to the source.
+  void FinishBlock();
+
+  usb_device_descriptor GetDeviceDescriptor(uint16_t vid, uint16_t pid);
+  usb_config_descriptor GetConfigDescriptor(uint32_t max_current_ma);
+  usb_interface_descriptor GetDataInterface();
+
+  GPIOManager::PinAllocation pin_allocation_dm_;
+  GPIOManager::PinAllocation pin_allocation_dp_;
+
+  usbd_device* usbd_dev_;
+  usb_device_descriptor dev_descriptor_;
+  usb_interface_descriptor data_interface_;
+  usb_endpoint_descriptor data_endpoints_[1];
+  usb_interface interfaces_[1];
+  usb_config_descriptor config_descriptor_;
+  const char* usb_strings_[3];
+  uint8_t control_buffer_[128];
+  char unique_id_[13];
+
+  ReleaseCallback release_;
+  uint8_t num_channels_;
+  float sample_rate_hz_;
+
+  volatile bool streaming_;
+
+  // Whether a packet is waiting in the endpoint to be collected.
+  volatile bool endpoint_busy_;
+
+  uint32_t sequence_;
+
+  // Block being sent, and how far we are into it (in bytes).
+  const uint16_t* block_;
+  std::size_t block_bytes_;
+  std::size_t block_pos_;
+
+  // First packet of the current frame, if it's not sent yet.
+  uint8_t first_packet_[kPacketSize];
+  std::size_t first_packet_len_;
+
+  Stats stats_;
+};
+
+} // namespace Ostrich
+
+#endif // __USB_ADC_STREAM_H__
@@ -0,0 +1,335 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USB_AUDIO_H__
+#define __USB_AUDIO_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#include <libopencm3/usb/usbd.h>
+
+#include "gpio.h"
+#include "util.h"
+
+namespace Ostrich {
+
+// Lock-free ring of 16-bit PCM samples for one producer (usually an ADC
+// conversion complete interrupt or DMA callback) and one consumer (the USB
+// SOF interrupt). kSize must be a power of 2.
+template <std::size_t kSize>
+class SampleRing {
+ public:
+  static_assert((kSize & (kSize - 1)) == 0, "kSize must be a power of 2");
+
+  SampleRing() : push_pos_(0), pop_pos_(0) {}
+
+  // Returns the number of samples actually pushed. Samples that don't fit are
+  // dropped. Only whole frames of frame_size samples (eg. one per channel) are
+  // pushed, so the consumer never sees channels out of step.
+  std::size_t Push(const int16_t* samples, std::size_t n,
+                   std::size_t frame_size = 1) {
+    std::size_t to_push = n < Space() ? n : Space();
+    to_push -= to_push % frame_size;
+
+    // Don't let the copy start before we've read pop_pos_ (the slots may
+    // still be in use), or finish after we publish push_pos_.
+    CompilerBarrier();
+    std::size_t pos = push_pos_;
+    for (std::size_t i = 0; i < to_push; ++i) {
+      buf_[(pos + i) & (kSize - 1)] = samples[i];
+    }
+    CompilerBarrier();
+    push_pos_ = pos + to_push;
+    return to_push;
+  }
+
+  // Returns the number of samples actually popped.
+  std::size_t Pop(int16_t* samples, std::size_t n) {
+    std::size_t to_pop = n < Available() ? n : Available();
+
+    // Same as Push(), the other way around.
+    CompilerBarrier();
+    std::size_t pos = pop_pos_;
+    for (std::size_t i = 0; i < to_pop; ++i) {
+      samples[i] = buf_[(pos + i) & (kSize - 1)];
+    }
+    CompilerBarrier();
+    pop_pos_ = pos + to_pop;
+    return to_pop;
+  }
+
+  // Positions are free-running, so the difference is always correct even
+  // after they wrap around.
+  std::size_t Available() const { return push_pos_ - pop_pos_; }
+  std::size_t Space() const { return kSize - Available(); }
+  std::size_t Capacity() const { return kSize; }
+
+ private:
+  int16_t buf_[kSize];
+  volatile std::size_t push_pos_;
+  volatile std::size_t pop_pos_;
+};
+
+// USB Audio Class 1.0 input function (a "microphone" from the host's point of
+// view). Samples pushed into the ring are streamed to the host through an
+// asynchronous isochronous IN endpoint, one packet per 1ms frame, so standard
+// host tools (eg. ALSA's arecord) can capture them at a guaranteed rate.
+//
+// Since we are an asynchronous source, we are the clock master. The number of
+// sample frames sent in each USB frame is the nominal rate / 1000 (with
+// fractional accumulation), adjusted by one frame either way to keep the ring
+// half full. That way the host tracks the actual rate of the ADC pipeline
+// rather than our idea of what it should be.
+class USBAudioInput {
+ public:
+  static constexpr std::size_t kRingSize = 4096;
+
+  // Maximum isochronous packet size in FullSpeed mode.
+  static constexpr std::size_t kMaxPacketSize = 1023;
+
+  // The OTG FS core has 1.25KB of FIFO RAM. libopencm3 gives 128 words to the
+  // shared RX FIFO and 16 words to the EP0 IN FIFO, which leaves this for the
+  // streaming endpoint's TX FIFO. This is the real limit on the packet size.
+  static constexpr std::size_t kTxFIFOSize = 1280 - 128 * 4 - 16 * 4;
+
+  // PushADCSamples() converts this many samples at a time, on the stack. It
+  // must hold at least one frame, so this is also the channel limit.
+  static constexpr std::size_t kADCChunkSize = 64;
+
+  struct Stats {
+    // Number of USB frames (SOFs) seen while streaming.
+    uint32_t sof_count;
+
+    // Sample frames (one sample per channel) sent to the host.
+    uint32_t frames_sent;
+
+    // Sample frames sent in the most recent complete 1000 SOF window. This is
+    // the rate the host is actually seeing.
+    uint32_t measured_sample_rate;
+
+    // Number of packets sent with one more/fewer frame than nominal to correct
+    // ring fill level.
+    uint32_t rate_increases;
+    uint32_t rate_decreases;
+
+    // Packets that were short because the ring didn't have enough data.
+    uint32_t underruns;
+
+    // Samples dropped by PushSamples() because the ring was full.
+    uint32_t overrun_samples;
+
+    // Packets we could not queue because the previous packet had not been
+    // collected by the host.
+    uint32_t missed_frames;
+
+    // Current ring fill level in sample frames, and the level we are trying to
+    // maintain.
+    uint32_t fill_level;
+    uint32_t target_fill_level;
+  };
+
+  // The default PIDs here are testing PIDs (http://pid.codes/1209/0001/).
+  // Make sure to change them before redistributing or selling any device!
+  // A packet ((sample_rate / 1000 + 1) * num_channels * 2 bytes) must fit in
+  // kTxFIFOSize, eg. up to 7 channels at 48kHz.
+  USBAudioInput(uint32_t sample_rate, uint8_t num_channels = 1,
+                uint16_t vid = 0x1209, uint16_t pid = 0x0001,
+                uint16_t current_ma = 100,
+                const char* manufacturer = "Ostrich",
+                const char* product = "Audio-Input");
+  ~USBAudioInput();
+
+  USBAudioInput(const USBAudioInput&) = delete;
+  USBAudioInput& operator=(const USBAudioInput&) = delete;
+
+  // Push interleaved samples (num_channels per frame). May be called from
+  // interrupt context. Returns number of samples accepted, which is always
+  // whole frames. Samples that don't fit (including a trailing partial frame)
+  // are dropped.
+  std::size_t PushSamples(const int16_t* samples, std::size_t len);
+
+  // Same as above, but converts unsigned 12-bit ADC readings to signed 16-bit
+  // PCM (mid-scale maps to 0).
+  std::size_t PushADCSamples(const uint16_t* samples, std::size_t len);
+
+  // Whether the host has selected the streaming alternate setting (ie. a
+  // capture is running).
+  bool Streaming() const { return streaming_; }
+
+  uint32_t SampleRate() const { return sample_rate_; }
+  uint8_t NumChannels() const { return num_channels_; }
+
+  // Ring fill level in sample frames.
+  std::size_t FillLevel() const {
+    return sample_ring_.Available() / num_channels_;
+  }
+
+  Stats GetStats() const;
+
+  void Poll() { usbd_poll(usbd_dev_); }
+
+ private:
+  // Audio Class 1.0 descriptors (USB Device Class Definition for Audio Devices
+  // 1.0, section 4). libopencm3 doesn't have all of these, so we define the
+  // layouts here.
+  struct ACHeaderDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint16_t bcdADC;
+    uint16_t wTotalLength;
+    uint8_t bInCollection;
+    uint8_t baInterfaceNr;
+  } __attribute__((packed));
+
+  struct InputTerminalDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bTerminalID;
+    uint16_t wTerminalType;
+    uint8_t bAssocTerminal;
+    uint8_t bNrChannels;
+    uint16_t wChannelConfig;
+    uint8_t iChannelNames;
+    uint8_t iTerminal;
+  } __attribute__((packed));
+
+  struct OutputTerminalDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bTerminalID;
+    uint16_t wTerminalType;
+    uint8_t bAssocTerminal;
+    uint8_t bSourceID;
+    uint8_t iTerminal;
+  } __attribute__((packed));
+
+  struct ASGeneralDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bTerminalLink;
+    uint8_t bDelay;
+    uint16_t wFormatTag;
+  } __attribute__((packed));
+
+  struct FormatTypeIDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bFormatType;
+    uint8_t bNrChannels;
+    uint8_t bSubframeSize;
+    uint8_t bBitResolution;
+    uint8_t bSamFreqType;
+    uint8_t tSamFreq[3];
+  } __attribute__((packed));
+
+  struct ISOEndpointDescriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bmAttributes;
+    uint8_t bLockDelayUnits;
+    uint16_t wLockDelay;
+  } __attribute__((packed));
+
+  struct AudioControlDescriptors {
+    ACHeaderDescriptor header;
+    InputTerminalDescriptor input_terminal;
+    OutputTerminalDescriptor output_terminal;
+  } __attribute__((packed));
+
+  struct AudioStreamingDescriptors {
+    ASGeneralDescriptor general;
+    FormatTypeIDescriptor format;
+  } __attribute__((packed));
+
+  static void SetConfigCallback(usbd_device* usbd_dev, uint16_t wValue);
+  static void SetAltsettingCallback(usbd_device* usbd_dev, uint16_t wIndex,
+                                    uint16_t wValue);
+  static void SOFCallback();
+  static usbd_request_return_codes ControlRequestCallback(
+      usbd_device* usbd_dev, usb_setup_data* req, uint8_t** buf, uint16_t* len,
+      void (**complete)(usbd_device* usbd_dev, usb_setup_data* req));
+
+  // Called every SOF to queue the packet for the next frame.
+  void SendPacket();
+
+  std::size_t MaxPacketSize() const {
+    return (sample_rate_ / 1000 + 1) * num_channels_ * sizeof(int16_t);
+  }
+
+  // TX FIFO space for one packet. The FIFO is allocated in 32-bit words, and
+  // libopencm3 rounds the size we give it down.
+  std::size_t FIFOPacketSize() const { return (MaxPacketSize() + 3) & ~3u; }
+
+  usb_device_descriptor GetDeviceDescriptor(uint16_t vid, uint16_t pid);
+  usb_config_descriptor GetConfigDescriptor(uint32_t max_current_ma);
+  usb_interface_descriptor GetControlInterface();
+  void SetupStreamingInterfaces();
+  AudioControlDescriptors GetAudioControlDescriptors();
+  AudioStreamingDescriptors GetAudioStreamingDescriptors();
+  ISOEndpointDescriptor GetISOEndpointDescriptor();
+
+  const uint32_t sample_rate_;
+  const uint8_t num_channels_;
+
+  GPIOManager::PinAllocation pin_allocation_dm_;
+  GPIOManager::PinAllocation pin_allocation_dp_;
+
+  usbd_device* usbd_dev_;
+  usb_device_descriptor dev_descriptor_;
+  AudioControlDescriptors ac_descriptors_;
+  AudioStreamingDescriptors as_descriptors_;
+  ISOEndpointDescriptor iso_endpoint_descriptor_;
+  usb_interface_descriptor control_interface_;
+  usb_interface_descriptor streaming_interfaces_[2];
+  usb_endpoint_descriptor streaming_endpoints_[1];
+  usb_interface interfaces_[2];
+  uint8_t streaming_altsetting_;
+  usb_config_descriptor config_descriptor_;
+  const char* usb_strings_[3];
+  uint8_t control_buffer_[128];
+  char unique_id_[13];
+
+  SampleRing<kRingSize> sample_ring_;
+
+  // Packet being assembled for the next frame.
+  int16_t packet_buf_[kMaxPacketSize / sizeof(int16_t)];
+
+  volatile bool streaming_;
+
+  // Fractional sample frames per USB frame, in 1/1000 units.
+  uint32_t frac_accumulator_;
+
+  // SOF count at the start of the current measurement window, and frames sent
+  // in it.
+  uint32_t window_sofs_;
+  uint32_t window_frames_;
+
+  Stats stats_;
+};
+
+} // namespace Ostrich
+
+#endif // __USB_AUDIO_H__
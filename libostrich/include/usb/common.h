@@ -0,0 +1,184 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USB_COMMON_H__
+#define __USB_COMMON_H__
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/usb/usbd.h>
+
+#include "ostrich.h"
+#include "util.h"
+
+namespace Ostrich {
+
+template <typename T>
+void ZeroInit(T* obj) {
+  static_assert(std::is_pod<T>::value, "Can only zero init POD types");
+  std::memset(obj, 0, sizeof(T));
+}
+
+// OTG FS has 6 IN and 6 OUT endpoints (including endpoint 0).
+constexpr int kNumUSBEndpoints = 6;
+
+// Vendor requests (bmRequestType 0xc0 for get, 0x40 for reset) that expose
+// USBStats to host tools. See USBManager::RegisterStatsVendorRequest().
+constexpr uint8_t kUSBVendorRequestGetStats = 0x01;
+constexpr uint8_t kUSBVendorRequestResetStats = 0x02;
+
+// Counters for one endpoint number (both directions). "In" and "out" are from
+// the host's point of view, as in the USB spec.
+struct USBEndpointStats {
+  uint32_t packets_in;
+  uint32_t bytes_in;
+  uint32_t packets_out;
+  uint32_t bytes_out;
+
+  // Number of times we NAKed the OUT endpoint because we had nowhere to put
+  // more data.
+  uint32_t nak_assertions;
+
+  // Total time (in AHB clocks) spent waiting for the IN endpoint to become
+  // free so we could write more data.
+  uint64_t blocked_clocks;
+
+  // Longest time (in AHB clocks) received data sat in a buffer before the
+  // application read it.
+  uint32_t max_read_latency_clocks;
+} __attribute__((packed));
+
+// This is also the wire format of the get stats vendor request (little
+// endian).
+struct USBStats {
+  uint32_t ahb_freq;
+  uint32_t sof_count;
+  USBEndpointStats endpoints[kNumUSBEndpoints];
+} __attribute__((packed));
+
+// There is only one OTG FS core, so only one USB device function (USBSerial,
+// USBAudioInput, etc) can exist at a time. USBManager enforces that, and
+// dispatches the OTG FS interrupt to whichever one is active.
+class USBManager : public Singleton {
+ public:
+  static USBManager& GetInstance() {
+    static USBManager instance;
+    return instance;
+  }
+
+  using Callback = std::function<void()>;
+
+  void AllocateUSB(Callback isr_callback) {
+    if (in_use_) {
+      HandleError("Only one USB service can be instantiated at a time.");
+    }
+
+    in_use_ = true;
+    isr_callback_ = isr_callback;
+  }
+
+  void DeallocateUSB() {
+    isr_callback_ = Callback();
+    in_use_ = false;
+  }
+
+  void InvokeCallback() {
+    if (isr_callback_) {
+      isr_callback_();
+    }
+  }
+
+  // Statistics. The Record* functions are called by USB functions, from
+  // either interrupt context or with the OTG FS interrupt disabled.
+  void RecordPacketIn(uint8_t ep, std::size_t len) {
+    USBEndpointStats& ep_stats = stats_.endpoints[ep & 0x7f];
+    ++ep_stats.packets_in;
+    ep_stats.bytes_in += len;
+  }
+
+  void RecordPacketOut(uint8_t ep, std::size_t len) {
+    USBEndpointStats& ep_stats = stats_.endpoints[ep & 0x7f];
+    ++ep_stats.packets_out;
+    ep_stats.bytes_out += len;
+  }
+
+  void RecordNAK(uint8_t ep) {
+    ++stats_.endpoints[ep & 0x7f].nak_assertions;
+  }
+
+  void RecordBlocked(uint8_t ep, uint64_t clocks) {
+    stats_.endpoints[ep & 0x7f].blocked_clocks += clocks;
+  }
+
+  void RecordReadLatency(uint8_t ep, uint64_t clocks) {
+    USBEndpointStats& ep_stats = stats_.endpoints[ep & 0x7f];
+
+    // Saturate rather than wrap (2^32 clocks is ~20s at 216MHz), so a long
+    // stall doesn't show up as a short one.
+    uint32_t clamped = clocks > UINT32_MAX ? UINT32_MAX : clocks;
+    if (clamped > ep_stats.max_read_latency_clocks) {
+      ep_stats.max_read_latency_clocks = clamped;
+    }
+  }
+
+  void RecordSOF() { ++stats_.sof_count; }
+
+  USBStats GetStats() {
+    ScopedIRQLock irq_lock(NVIC_OTG_FS_IRQ);
+    USBStats stats = stats_;
+    stats.ahb_freq = g_ahb_freq;
+    return stats;
+  }
+
+  void ResetStats() {
+    ScopedIRQLock irq_lock(NVIC_OTG_FS_IRQ);
+    ZeroInit(&stats_);
+  }
+
+  // Counting SOFs means taking an interrupt every millisecond, so it's only
+  // done on request. Functions that already handle SOF (eg. USBAudioInput)
+  // count them regardless.
+  void EnableSOFCounting(usbd_device* usbd_dev);
+
+  // Handle the get/reset stats vendor requests on this device. Must be called
+  // from the set config callback (libopencm3 clears control callbacks on set
+  // config).
+  static void RegisterStatsVendorRequest(usbd_device* usbd_dev);
+
+ private:
+  USBManager() : in_use_(false) {
+    ZeroInit(&stats_);
+  }
+
+  static usbd_request_return_codes StatsRequestCallback(
+      usbd_device* usbd_dev, usb_setup_data* req, uint8_t** buf, uint16_t* len,
+      void (**complete)(usbd_device* usbd_dev, usb_setup_data* req));
+
+  bool in_use_;
+  Callback isr_callback_;
+  USBStats stats_;
+};
+
+} // namespace Ostrich
+
+#endif // __USB_COMMON_H__
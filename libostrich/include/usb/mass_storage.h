@@ -0,0 +1,184 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USB_MASS_STORAGE_H__
+#define __USB_MASS_STORAGE_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#include <libopencm3/usb/usbd.h>
+
+#include "block_device.h"
+#include "gpio.h"
+#include "util.h"
+
+namespace Ostrich {
+
+// USB Mass Storage Class function (SCSI transparent command set over
+// Bulk-Only Transport) exposing a BlockDevice to the host.
+//
+// Sectors are double buffered. While one 512 byte sector is going out over the
+// bulk endpoint one packet at a time, the next one is already read from the
+// block device into the other buffer, so the host never waits on the block
+// device between sectors. Writes are received into one buffer while the
+// previous sector is committed from the other.
+class USBMassStorage {
+ public:
+  static constexpr std::size_t kSectorSize = 512;
+
+  // The default PIDs here are testing PIDs (http://pid.codes/1209/0001/).
+  // Make sure to change them before redistributing or selling any device!
+  USBMassStorage(BlockDevice* device, uint16_t vid = 0x1209,
+                 uint16_t pid = 0x0001, uint16_t current_ma = 100,
+                 const char* manufacturer = "Ostrich",
+                 const char* product = "Mass-Storage");
+  ~USBMassStorage();
+
+  USBMassStorage(const USBMassStorage&) = delete;
+  USBMassStorage& operator=(const USBMassStorage&) = delete;
+
+  // Whether the host has ejected the medium (START STOP UNIT). The
+  // application can use this as a signal that it's safe to modify the disk.
+  // While ejected, we report the medium as not present, until the host loads
+  // it again.
+  bool Ejected() const { return ejected_; }
+
+  void Poll() { usbd_poll(usbd_dev_); }
+
+ private:
+  // Bulk-Only Transport command/status wrappers (USB MSC BOT 1.0, 5.1, 5.2).
+  struct CommandBlockWrapper {
+    uint32_t dCBWSignature;
+    uint32_t dCBWTag;
+    uint32_t dCBWDataTransferLength;
+    uint8_t bmCBWFlags;
+    uint8_t bCBWLUN;
+    uint8_t bCBWCBLength;
+    uint8_t CBWCB[16];
+  } __attribute__((packed));
+
+  struct CommandStatusWrapper {
+    uint32_t dCSWSignature;
+    uint32_t dCSWTag;
+    uint32_t dCSWDataResidue;
+    uint8_t bCSWStatus;
+  } __attribute__((packed));
+
+  enum class State {
+    kCommand,
+    kDataIn,
+    kDataOut,
+
+    // Bulk-IN is stalled to end a short data phase, and the CSW goes out once
+    // the host clears the halt.
+    kStatusAfterHalt,
+    kStatus
+  };
+
+  static void SetConfigCallback(usbd_device* usbd_dev, uint16_t wValue);
+  static void DataRxCallback(usbd_device* usbd_dev, uint8_t endpoint);
+  static void DataTxCallback(usbd_device* usbd_dev, uint8_t endpoint);
+  static usbd_request_return_codes ControlRequestCallback(
+      usbd_device* usbd_dev, usb_setup_data* req, uint8_t** buf, uint16_t* len,
+      void (**complete)(usbd_device* usbd_dev, usb_setup_data* req));
+  static usbd_request_return_codes EndpointRequestCallback(
+      usbd_device* usbd_dev, usb_setup_data* req, uint8_t** buf, uint16_t* len,
+      void (**complete)(usbd_device* usbd_dev, usb_setup_data* req));
+  static void InHaltClearedCallback(usbd_device* usbd_dev,
+                                    usb_setup_data* req);
+
+  void HandleCommand(const CommandBlockWrapper& cbw);
+  void HandleDataOut(const uint8_t* data, std::size_t len);
+  void HandleTxComplete();
+
+  // Start sending a small response (from response_buf_ or inquiry_data_).
+  void SendResponse(const uint8_t* data, std::size_t len);
+
+  // Start a READ(10) data phase.
+  void StartRead(uint32_t lba, uint32_t num_blocks);
+
+  // Read the next sector (if any) into the buffer not being transmitted.
+  bool PrefetchSector();
+
+  void SendNextPacket();
+
+  // Finish an IN data phase. If we sent less than the host expected, stall
+  // bulk-IN first (BOT 6.7.2, cases Hi > Dn and Hi > Di), so the host doesn't
+  // take the CSW for data.
+  void EndDataIn();
+  void SendStatus();
+  void Reset();
+
+  void SetSense(uint8_t key, uint8_t asc, uint8_t ascq = 0);
+  void FailCommand(uint8_t key, uint8_t asc);
+
+  usb_device_descriptor GetDeviceDescriptor(uint16_t vid, uint16_t pid);
+  usb_config_descriptor GetConfigDescriptor(uint32_t max_current_ma);
+  usb_interface_descriptor GetInterface();
+
+  BlockDevice* device_;
+
+  GPIOManager::PinAllocation pin_allocation_dm_;
+  GPIOManager::PinAllocation pin_allocation_dp_;
+
+  usbd_device* usbd_dev_;
+  usb_device_descriptor dev_descriptor_;
+  usb_config_descriptor config_descriptor_;
+  usb_interface interfaces_[1];
+  usb_interface_descriptor interface_;
+  usb_endpoint_descriptor endpoints_[2];
+  const char* usb_strings_[3];
+  uint8_t control_buffer_[128];
+  char unique_id_[13];
+
+  State state_;
+  CommandStatusWrapper csw_;
+
+  // Remaining bytes the host expects in the data phase.
+  uint32_t host_expected_len_;
+
+  // Data currently being transmitted.
+  const uint8_t* tx_ptr_;
+  std::size_t tx_remaining_;
+
+  uint8_t sector_bufs_[2][kSectorSize];
+  int active_buf_;
+  bool next_buf_ready_;
+
+  // Block range of the current READ(10)/WRITE(10). For reads, next_lba_ is the
+  // next block to be fetched from the device. For writes, it's the next block
+  // to be committed.
+  uint32_t next_lba_;
+  uint32_t blocks_remaining_;
+  std::size_t rx_offset_;
+
+  uint8_t response_buf_[18];
+  uint8_t inquiry_data_[36];
+
+  uint8_t sense_key_;
+  uint8_t sense_asc_;
+  uint8_t sense_ascq_;
+
+  volatile bool ejected_;
+};
+
+} // namespace Ostrich
+
+#endif // __USB_MASS_STORAGE_H__
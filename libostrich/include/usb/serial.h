@@ -31,6 +31,8 @@
 
 #include "buffered_stream.h"
 #include "gpio.h"
+#include "systick.h"
+#include "usb/common.h"
 #include "util.h"
 
 namespace Ostrich {
@@ -55,6 +57,14 @@ class USBSerial : public BufferedInputStream<512>,
 
   uint32_t BaudRate() const { return baud_rate_; }
 
+  // Start counting SOFs, and optionally answer the stats vendor requests (see
+  // usb/common.h) so a host script can sample them. Endpoint counters are
+  // always kept. The vendor request is registered when the host configures
+  // the device, so this should be called before the host connects.
+  void EnableStatistics(bool vendor_request = true);
+
+  USBStats GetStats() const { return USBManager::GetInstance().GetStats(); }
+
  protected:
   void OutputImpl(const char* data, std::size_t len) override;
 
@@ -62,6 +72,8 @@ class USBSerial : public BufferedInputStream<512>,
   std::size_t OptimalWriteBlockSize() const override { return 64; }
 
   void InputDataRead() override {
+    RecordPacketsRead();
+
     if (endpoint_nak_) {
       if (ReceiveBufferSpace() >= 64) {
         endpoint_nak_ = false;
@@ -90,6 +102,10 @@ class USBSerial : public BufferedInputStream<512>,
   usb_interface_descriptor GetDataInterface();
   CDCFunctionalDescriptors GetCDCFunctionalDescriptors();
 
+  // Record the read latency of every received packet that has been read
+  // completely.
+  void RecordPacketsRead();
+
   GPIOManager::PinAllocation pin_allocation_dm_;
   GPIOManager::PinAllocation pin_allocation_dp_;
 
@@ -113,6 +129,28 @@ class USBSerial : public BufferedInputStream<512>,
   volatile bool endpoint_nak_;
 
   volatile uint32_t baud_rate_;
+
+  bool stats_vendor_request_;
+
+  // Packets in the receive buffer, oldest first, for read latency stats. A
+  // packet has been read once the read position (rx_bytes_ minus the data
+  // still in the buffer) reaches its end. The buffer holds at most 512 / 64
+  // full packets. If short packets fill up the ring, the newest entry is
+  // extended instead, so those bytes are timed from the earlier arrival.
+  // DataRxCallback() adds packets from the USB interrupt, and everything else
+  // must hold ScopedIRQLock(NVIC_OTG_FS_IRQ).
+  struct RxPacket {
+    // Value of rx_bytes_ after the packet was added.
+    uint32_t end;
+    uint64_t arrival_clocks;
+  };
+  static constexpr std::size_t kMaxRxPackets = 512 / 64;
+  RxPacket rx_packets_[kMaxRxPackets];
+  std::size_t rx_packets_head_;
+  std::size_t num_rx_packets_;
+
+  // Total bytes added to the receive buffer (wraps around).
+  uint32_t rx_bytes_;
 };
 
 } // namespace Ostrich
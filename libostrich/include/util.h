@@ -30,6 +30,19 @@ inline void WaitForInterrupt() {
   __asm__("wfi");
 }
 
+// Whether we are in an exception handler (IPSR != 0) rather than thread mode.
+inline bool InInterruptContext() {
+  uint32_t ipsr;
+  __asm__ volatile("mrs %0, ipsr" : "=r"(ipsr));
+  return ipsr != 0;
+}
+
+// Prevent the compiler from moving memory accesses across this point. This is
+// sufficient for synchronizing with ISRs on a single core.
+inline void CompilerBarrier() {
+  __asm__ volatile("" ::: "memory");
+}
+
 class Singleton {
  protected:
 	Singleton() {}
@@ -61,23 +74,29 @@ class NonCopyable {
 template <typename T>
 class Future : public NonCopyable {
  public:
-  Future() : value_received_(false) {}
+  Future() : value_(), value_received_(false) {}
 
   void SetValue(const T& value) {
-    value = value;
+    value_ = value;
+    CompilerBarrier();
     value_received_ = true;
   }
 
   void SetValue(T&& value) {
     value_ = std::move(value);
+    CompilerBarrier();
     value_received_ = true;
   }
 
+  // Whether the value has arrived (GetValue() won't block).
+  bool Ready() const { return value_received_; }
+
   T&& GetValue() {
     while (!value_received_) {
       WaitForInterrupt();
     }
 
+    CompilerBarrier();
     return std::move(value_);
   }
 
@@ -90,7 +109,10 @@ class Future : public NonCopyable {
   }
 
  private:
-  volatile T value_;
+  // value_ is only accessed on one side of value_received_ at a time, with a
+  // barrier in between, so it doesn't need to be volatile (which would also
+  // make it impossible to move out of).
+  T value_;
   volatile bool value_received_;
 };
 
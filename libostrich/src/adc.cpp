@@ -18,17 +18,30 @@
  */
 
 #include "adc.h"
+
+#include <algorithm>
+
 #include "gpio.h"
 
+extern "C" {
+void adc_isr() {
+  Ostrich::ADCManager::GetInstance().InvokeCallbacks();
+}
+}
+
 namespace Ostrich {
 
-ADCManager::ADCManager() {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Weffc++"
+ADCManager::ADCManager()
+    : num_isr_callbacks_(0), vbatt_on_(false), vref_vsense_on_(false) {
   for (int i = 0; i < kNumADCs; ++i) {
-    in_use_[i] = false;
+    in_use_[i] = 0;
   }
 
   SetADCPreDivider();
 }
+#pragma GCC diagnostic pop
 
 void ADCManager::SetADCPreDivider() {
   // We have 4 dividers to choose from - 2, 4, 6, 8.
@@ -58,32 +71,38 @@ void ADCManager::SetADCPreDivider() {
   }
 }
 
-template <uint32_t kADC>
-SingleConversionADC<kADC>::SingleConversionADC()
-    : adc_info_(GetInfo(kADC)), vbatt_on_(false), vref_vsense_on_(false) {
-  adc_power_off(kADC);
-  adc_disable_scan_mode(kADC);
-  adc_set_single_conversion_mode(kADC);
-  adc_enable_eoc_interrupt(kADC);
-
-  // Set sampling time to min by default.
-  adc_set_sample_time_on_all_channels(kADC, ADC_SMPR_SMP_3CYC);
-
-  adc_power_on(kADC);
+void ADCManager::SetMultiMode(uint32_t multi, uint32_t dma_mode,
+                              uint32_t delay) {
+  uint32_t ccr = ADC_CCR;
+  ccr &= ~(ADC_CCR_MULTI_MASK | ADC_CCR_DMA_MASK | ADC_CCR_DDS |
+           ADC_CCR_DELAY_MASK);
+  ccr |= multi | dma_mode | delay;
+  ADC_CCR = ccr;
 }
 
-template <uint32_t kADC>
-SingleConversionADC<kADC>::~SingleConversionADC() {
+void ADCManager::SetSamplingTime(uint32_t adc, uint32_t channel,
+                                 uint64_t sampling_time_ns) {
+  uint64_t cycle_time_ns = 1000000000ULL / adc_clock_;
+  for (const auto& option : kSamplingTimes) {
+    if (cycle_time_ns * option.cycles >= sampling_time_ns) {
+      adc_set_sample_time(adc, channel, option.setting);
+      return;
+    }
+  }
+
+  // Set longest time if we got to the end (using higher sampling time would
+  // require changing ADCPre, which affects all ADCs).
+  adc_set_sample_time(adc, channel, kSamplingTimes.back().setting);
 }
 
-template <uint32_t kADC>
-typename SingleConversionADC<kADC>::ChannelAllocation
-SingleConversionADC<kADC>::SetupChannel(int channel, bool is_vbatt) {
-  const ChannelInfo& ci = kADCChannelInfos[GetIndex(kADC)][channel];
+ADCManager::ChannelAllocation ADCManager::SetupChannel(uint32_t adc,
+                                                       int channel,
+                                                       bool is_vbatt) {
+  const ChannelInfo& ci = kADCChannelInfos[GetIndex(adc)][channel];
   ChannelAllocation allocation;
   if (ci.channel_type == ChannelType::kGPIO) {
-    *allocation.pin_allocation =
-        GPIOManager::GetInstance().AllocatePin(ci.port_pin);
+    allocation.pin_allocation.emplace(
+        GPIOManager::GetInstance().AllocatePin(ci.port_pin));
     allocation.pin_allocation->SetAnalog();
   } else if (ci.channel_type == ChannelType::kVrefint) {
     if (!vref_vsense_on_) {
@@ -93,11 +112,10 @@ SingleConversionADC<kADC>::SetupChannel(int channel, bool is_vbatt) {
       vbatt_on_ = false;
 
       // 10us startup time.
-      auto end_time = GetTimeMicroseconds() + 10;
-      while (GetTimeMicroseconds() < end_time) {}
+      DelayMicroseconds(10);
 
       // 10us sampling time.
-      SetSamplingTime(channel, 10000);
+      SetSamplingTime(adc, channel, 10000);
     }
   } else if (ci.channel_type == ChannelType::kTempVbatt) {
     if (is_vbatt) {
@@ -108,11 +126,10 @@ SingleConversionADC<kADC>::SetupChannel(int channel, bool is_vbatt) {
         vbatt_on_ = true;
 
         // 10us startup time.
-        auto end_time = GetTimeMicroseconds() + 10;
-        while (GetTimeMicroseconds() < end_time) {}
+        DelayMicroseconds(10);
 
         // 10us sampling time.
-        SetSamplingTime(channel, 10000);
+        SetSamplingTime(adc, channel, 10000);
       }
     } else {
       if (!vref_vsense_on_) {
@@ -122,11 +139,10 @@ SingleConversionADC<kADC>::SetupChannel(int channel, bool is_vbatt) {
         vbatt_on_ = false;
 
         // 10us startup time.
-        auto end_time = GetTimeMicroseconds() + 10;
-        while (GetTimeMicroseconds() < end_time) {}
+        DelayMicroseconds(10);
 
         // 10us sampling time.
-        SetSamplingTime(channel, 10000);
+        SetSamplingTime(adc, channel, 10000);
       }
     }
   }
@@ -134,25 +150,1109 @@ SingleConversionADC<kADC>::SetupChannel(int channel, bool is_vbatt) {
   return allocation;
 }
 
+void ADCManager::SetCallback(uint32_t adc, int slot_index, Callback callback) {
+  nvic_disable_irq(NVIC_ADC_IRQ);
+
+  auto& slot = isr_callbacks_[GetIndex(adc)][slot_index];
+  if (!slot) {
+    ++num_isr_callbacks_;
+  }
+  slot = callback;
+
+  nvic_enable_irq(NVIC_ADC_IRQ);
+}
+
+void ADCManager::ClearCallback(uint32_t adc, int slot_index) {
+  nvic_disable_irq(NVIC_ADC_IRQ);
+
+  auto& slot = isr_callbacks_[GetIndex(adc)][slot_index];
+  if (slot) {
+    slot = Callback();
+    --num_isr_callbacks_;
+  }
+
+  // Leave the interrupt off if nobody is listening.
+  if (num_isr_callbacks_ > 0) {
+    nvic_enable_irq(NVIC_ADC_IRQ);
+  }
+}
+
+void ADCManager::InvokeCallbacks() {
+  for (auto& adc_callbacks : isr_callbacks_) {
+    for (auto& callback : adc_callbacks) {
+      if (callback) {
+        callback();
+      }
+    }
+  }
+}
+
 template <uint32_t kADC>
-void SingleConversionADC<kADC>::SetSamplingTime(
-    uint32_t channel, uint64_t sampling_time_ns) {
-  uint64_t cycle_time_ns =
-      1000000000ULL / ADCManager::GetInstance().ADCClock();
-  for (const auto& option : kSamplingTimes) {
-    if (cycle_time_ns * option.cycles >= sampling_time_ns) {
-      adc_set_sample_time(kADC, channel, option.setting);
+void ADCBase<kADC>::EnableWatchdog(int channel, uint16_t low, uint16_t high,
+                                   WatchdogCallback callback) {
+  adc_disable_awd_interrupt(kADC);
+
+  if (channel == kWatchdogAllChannels) {
+    adc_enable_analog_watchdog_on_all_channels(kADC);
+  } else {
+    adc_enable_analog_watchdog_on_selected_channel(kADC, channel);
+  }
+
+  adc_set_watchdog_low_threshold(kADC, low);
+  adc_set_watchdog_high_threshold(kADC, high);
+  adc_enable_analog_watchdog_regular(kADC);
+  adc_enable_analog_watchdog_injected(kADC);
+
+  ADCManager::GetInstance().SetWatchdogCallback(kADC, [callback]() {
+    if (!adc_awd(kADC)) {
       return;
     }
+
+    // Flags are cleared by writing 0, and writing 1 has no effect.
+    ADC_SR(kADC) = ~ADC_SR_AWD;
+    adc_disable_awd_interrupt(kADC);
+
+    if (callback) {
+      callback();
+    }
+  });
+
+  ADC_SR(kADC) = ~ADC_SR_AWD;
+  adc_enable_awd_interrupt(kADC);
+  watchdog_enabled_ = true;
+}
+
+template <uint32_t kADC>
+void ADCBase<kADC>::EnableWatchdogVolts(int channel, float low, float high,
+                                        uint16_t vrefint_raw,
+                                        WatchdogCallback callback) {
+  // raw = V / Vdda * 4095, and Vdda = 3.3V * VREFINT_CAL / vrefint_raw.
+  float counts_per_volt = static_cast<float>(kADCFullScale - 1) * vrefint_raw /
+                          (kVrefintCalVdda * VrefintCal());
+  auto to_raw = [counts_per_volt](float volts) {
+    float raw = volts * counts_per_volt + 0.5f;
+    if (raw < 0.0f) {
+      return static_cast<uint16_t>(0);
+    } else if (raw > (kADCFullScale - 1)) {
+      return static_cast<uint16_t>(kADCFullScale - 1);
+    }
+    return static_cast<uint16_t>(raw);
+  };
+
+  EnableWatchdog(channel, to_raw(low), to_raw(high), callback);
+}
+
+template <uint32_t kADC>
+void ADCBase<kADC>::DisableWatchdog() {
+  if (!watchdog_enabled_) {
+    return;
   }
 
-  // Set longest time if we got to the end (using higher sampling time would
-  // require changing ADCPre, which affects all ADCs).
-  adc_set_sample_time(kADC, channel, kSamplingTimes.back().setting);
+  adc_disable_awd_interrupt(kADC);
+  adc_disable_analog_watchdog_regular(kADC);
+  adc_disable_analog_watchdog_injected(kADC);
+  ADCManager::GetInstance().ClearWatchdogCallback(kADC);
+  watchdog_enabled_ = false;
+}
+
+template <uint32_t kADC>
+SingleConversionADC<kADC>::SingleConversionADC()
+    : pending_read_(nullptr), pending_scan_(nullptr) {
+  // If an InjectedADC already owns the injected group, it has set up SCAN,
+  // power, and the sampling times of its channels, and may be converting, so
+  // leave all of that alone.
+  bool injected_in_use =
+      ADCManager::GetInstance().GroupAllocated(kADC, ADCGroup::kInjected);
+
+  if (!injected_in_use) {
+    adc_power_off(kADC);
+    adc_disable_scan_mode(kADC);
+  }
+
+  adc_set_single_conversion_mode(kADC);
+  adc_enable_eoc_interrupt(kADC);
+
+  if (!injected_in_use) {
+    // Set sampling time to min by default.
+    adc_set_sample_time_on_all_channels(kADC, ADC_SMPR_SMP_3CYC);
+  }
+
+  ADCManager::GetInstance().SetISRCallback(kADC, ADCGroup::kRegular,
+                                           [this]() { HandleInterrupt(); });
+
+  if (!injected_in_use) {
+    adc_power_on(kADC);
+  }
+}
+
+template <uint32_t kADC>
+SingleConversionADC<kADC>::~SingleConversionADC() {
+  adc_disable_eoc_interrupt(kADC);
+  ADCManager::GetInstance().ClearISRCallback(kADC, ADCGroup::kRegular);
+  if (dma_) {
+    dma_->ClearISRCallback();
+  }
+}
+
+template <uint32_t kADC>
+bool SingleConversionADC<kADC>::StartRead(uint8_t channel,
+                                          Future<uint16_t>* result) {
+  ScopedIRQLock lock(NVIC_ADC_IRQ);
+
+  if (pending_read_ || pending_scan_) {
+    HandleError(std::string(GetInfo(kADC).str_name) + " busy");
+    return false;
+  }
+
+  pending_read_ = result;
+  adc_set_regular_sequence(kADC, 1, &channel);
+  adc_start_conversion_regular(kADC);
+  return true;
+}
+
+template <uint32_t kADC>
+void SingleConversionADC<kADC>::HandleInterrupt() {
+  if (!adc_eoc(kADC)) {
+    return;
+  }
+
+  // Reading the result also clears EOC.
+  uint16_t value = adc_read_regular(kADC);
+
+  Future<uint16_t>* result = pending_read_;
+  pending_read_ = nullptr;
+  if (result) {
+    result->SetValue(value);
+  }
+}
+
+template <uint32_t kADC>
+bool SingleConversionADC<kADC>::ReadChannels(
+    std::initializer_list<uint8_t> channels, uint16_t* results) {
+  if (channels.size() == 0 || channels.size() > kMaxScanChannels) {
+    HandleError("Invalid number of channels to read");
+    return false;
+  }
+
+  if (!dma_) {
+    dma_ = DMAManager::GetInstance().TryAllocateStream(GetInfo(kADC).dma);
+    if (dma_) {
+      dma_->SetISRCallback([this]() {
+        if (!dma_get_interrupt_flag(dma_->Dma(), dma_->Stream(), DMA_TCIF)) {
+          return;
+        }
+        dma_clear_interrupt_flags(dma_->Dma(), dma_->Stream(), DMA_TCIF);
+
+        Future<bool>* result = pending_scan_;
+        pending_scan_ = nullptr;
+        if (result) {
+          result->SetValue(true);
+        }
+      });
+    }
+  }
+
+  if (dma_) {
+    return ScanWithDMA(channels, results);
+  }
+
+  // No DMA. Do one conversion at a time.
+  for (uint8_t channel : channels) {
+    Future<uint16_t> result;
+    if (!StartRead(channel, &result)) {
+      return false;
+    }
+    *results++ = result.GetValue();
+  }
+
+  return true;
+}
+
+template <uint32_t kADC>
+bool SingleConversionADC<kADC>::ScanWithDMA(
+    std::initializer_list<uint8_t> channels, uint16_t* results) {
+  Future<bool> done;
+
+  {
+    ScopedIRQLock lock(NVIC_ADC_IRQ);
+
+    if (pending_read_ || pending_scan_) {
+      HandleError(std::string(GetInfo(kADC).str_name) + " busy");
+      return false;
+    }
+
+    pending_scan_ = &done;
+  }
+
+  uint8_t sequence[kMaxScanChannels];
+  std::copy(channels.begin(), channels.end(), sequence);
+
+  // The ADC is idle, so we can change the sequence without powering off. EOC
+  // is only set at the end of the scan (and cleared by the DMA read), but we
+  // don't want the single conversion handler to race with the DMA for it.
+  //
+  // SCAN also applies to the injected group, so an InjectedADC on the same ADC
+  // may have it set already, and needs it to stay that way.
+  bool was_scanning = ADC_CR1(kADC) & ADC_CR1_SCAN;
+  adc_disable_eoc_interrupt(kADC);
+  adc_enable_scan_mode(kADC);
+  adc_set_regular_sequence(kADC, channels.size(), sequence);
+
+  dma_->SetupPeripheralTransfer(&ADC_DR(kADC), results, channels.size(),
+                                DMA_SxCR_DIR_PERIPHERAL_TO_MEM,
+                                DMA_SxCR_PSIZE_16BIT, DMA_SxCR_MSIZE_16BIT);
+  dma_enable_transfer_complete_interrupt(dma_->Dma(), dma_->Stream());
+  dma_->Enable();
+
+  // Without DDS, the ADC stops requesting after this scan. DMA has to be
+  // turned off and on again before the next one anyway.
+  adc_enable_dma(kADC);
+  adc_start_conversion_regular(kADC);
+
+  done.GetValue();
+
+  adc_disable_dma(kADC);
+  if (!was_scanning) {
+    adc_disable_scan_mode(kADC);
+  }
+  adc_enable_eoc_interrupt(kADC);
+
+  return true;
+}
+
+template <uint32_t kADC>
+SequenceADC<kADC>::SequenceADC()
+    : dma_(DMAManager::GetInstance().AllocateStream(GetInfo(kADC).dma)),
+      num_channels_(0), running_(false) {
+  // AddChannel() sets the sampling times of our channels. Only reset the rest
+  // if no InjectedADC is using (and possibly converting on) this ADC.
+  if (!ADCManager::GetInstance().GroupAllocated(kADC, ADCGroup::kInjected)) {
+    adc_power_off(kADC);
+    adc_set_sample_time_on_all_channels(kADC, ADC_SMPR_SMP_3CYC);
+    adc_power_on(kADC);
+  }
+}
+
+template <uint32_t kADC>
+int SequenceADC<kADC>::AddChannel(uint8_t channel, uint64_t sampling_time_ns,
+                                  bool is_vbatt) {
+  if (running_) {
+    HandleError("Channels must be added before starting conversions");
+    return -1;
+  }
+
+  if (num_channels_ == kMaxScanChannels) {
+    HandleError("Too many channels in scan sequence");
+    return -1;
+  }
+
+  if (channel >= kNumChannels) {
+    HandleError("Invalid ADC channel");
+    return -1;
+  }
+
+  const ChannelInfo& ci = kADCChannelInfos[GetIndex(kADC)][channel];
+  if (ci.channel_type == ChannelType::kNC) {
+    HandleError(std::string("Channel not available on ") +
+                this->adc_info_.str_name);
+    return -1;
+  }
+
+  // Channels can be sampled more than once per scan, but only need to be set up
+  // once.
+  bool already_setup = false;
+  for (int i = 0; i < num_channels_; ++i) {
+    already_setup |= (channels_[i] == channel);
+  }
+
+  if (!already_setup) {
+    allocations_[num_channels_] = SetupChannel(channel, is_vbatt);
+  }
+
+  // Internal channels need at least 10us sampling time. SetupChannel() only
+  // sets that when the sensor is turned on, so we may have more than one
+  // internal channel to cover.
+  if (ci.channel_type != ChannelType::kGPIO && sampling_time_ns < 10000) {
+    sampling_time_ns = 10000;
+  }
+
+  if (sampling_time_ns > 0) {
+    SetSamplingTime(channel, sampling_time_ns);
+  }
+
+  channels_[num_channels_] = channel;
+  return num_channels_++;
+}
+
+template <uint32_t kADC>
+void SequenceADC<kADC>::ConfigureSequence() {
+  // Sequence and mode changes must be made while no conversion is ongoing,
+  // and powering off also resets the sequencer to the first position.
+  adc_power_off(kADC);
+
+  adc_enable_scan_mode(kADC);
+  adc_set_regular_sequence(kADC, num_channels_, channels_.data());
+
+  // One DMA request per conversion, and keep issuing requests after the first
+  // buffer's worth (otherwise the ADC stops requesting when NDTR wraps).
+  adc_enable_dma(kADC);
+  adc_set_dma_continue(kADC);
+}
+
+template <uint32_t kADC>
+void SequenceADC<kADC>::StopSequence() {
+  // Turning off the ADC aborts the conversion in progress.
+  adc_power_off(kADC);
+  dma_.Disable();
+  adc_disable_dma(kADC);
+  adc_clear_overrun_flag(kADC);
+  adc_power_on(kADC);
+}
+
+template <uint32_t kADC>
+ScanADC<kADC>::ScanADC() : buffer_() {}
+
+template <uint32_t kADC>
+ScanADC<kADC>::~ScanADC() {
+  Stop();
+}
+
+template <uint32_t kADC>
+void ScanADC<kADC>::Start() {
+  if (this->running_ || this->num_channels_ == 0) {
+    return;
+  }
+
+  this->ConfigureSequence();
+  adc_set_continuous_conversion_mode(kADC);
+
+  auto& dma = this->dma_;
+  dma.SetupPeripheralTransfer(&ADC_DR(kADC), const_cast<uint16_t*>(buffer_),
+                              this->num_channels_,
+                              DMA_SxCR_DIR_PERIPHERAL_TO_MEM,
+                              DMA_SxCR_PSIZE_16BIT, DMA_SxCR_MSIZE_16BIT);
+  dma_enable_circular_mode(dma.Dma(), dma.Stream());
+  dma.Enable();
+
+  adc_power_on(kADC);
+  adc_start_conversion_regular(kADC);
+
+  this->running_ = true;
+}
+
+template <uint32_t kADC>
+void ScanADC<kADC>::Stop() {
+  if (!this->running_) {
+    return;
+  }
+
+  this->StopSequence();
+  adc_set_single_conversion_mode(kADC);
+  this->running_ = false;
+}
+
+template <uint32_t kADC>
+TimedADC<kADC>::TimedADC(uint32_t timer)
+    : timer_(TimerManager::GetInstance().AllocateTimer(timer)),
+      buffer_(nullptr), block_len_(0), held_{false, false}, overruns_(0) {
+  if (RegularTriggerForTimer(timer) < 0) {
+    HandleError(std::string(GetTimerInfo(timer).str_name) +
+                " can't trigger ADC conversions");
+  }
+
+  this->dma_.SetISRCallback([this]() { HandleDMAInterrupt(); });
+}
+
+template <uint32_t kADC>
+TimedADC<kADC>::~TimedADC() {
+  Stop();
+  this->dma_.ClearISRCallback();
+}
+
+template <uint32_t kADC>
+float TimedADC<kADC>::Start(float sample_rate_hz, uint16_t* buffer,
+                            std::size_t block_len, BlockCallback callback) {
+  if (this->running_ || this->num_channels_ == 0) {
+    return 0.0f;
+  }
+
+  if (block_len == 0 || (block_len % this->num_channels_) != 0) {
+    HandleError("ADC block length must be a multiple of the sequence length");
+    return 0.0f;
+  }
+
+  if ((2 * block_len) > kDMAMaxTransfer) {
+    HandleError("ADC block length too long");
+    return 0.0f;
+  }
+
+  buffer_ = buffer;
+  block_len_ = block_len;
+  callback_ = callback;
+  held_[0] = false;
+  held_[1] = false;
+  overruns_ = 0;
+
+  this->ConfigureSequence();
+  adc_set_single_conversion_mode(kADC);
+
+  // Convert the whole sequence on every rising edge of the timer's TRGO.
+  uint32_t timer = timer_.Timer();
+  adc_enable_external_trigger_regular(
+      kADC, RegularTriggerForTimer(timer) << ADC_CR2_EXTSEL_SHIFT,
+      ADC_CR2_EXTEN_RISING_EDGE);
+
+  auto& dma = this->dma_;
+  dma.SetupPeripheralTransfer(&ADC_DR(kADC), buffer_, 2 * block_len_,
+                              DMA_SxCR_DIR_PERIPHERAL_TO_MEM,
+                              DMA_SxCR_PSIZE_16BIT, DMA_SxCR_MSIZE_16BIT);
+  dma_enable_circular_mode(dma.Dma(), dma.Stream());
+  dma_enable_half_transfer_interrupt(dma.Dma(), dma.Stream());
+  dma_enable_transfer_complete_interrupt(dma.Dma(), dma.Stream());
+  dma.Enable();
+
+  adc_power_on(kADC);
+
+  float actual_rate = timer_.SetUpdateFrequency(sample_rate_hz);
+  timer_.SetTriggerOnUpdate();
+
+  this->running_ = true;
+  timer_.Start();
+
+  return actual_rate;
+}
+
+template <uint32_t kADC>
+void TimedADC<kADC>::Stop() {
+  if (!this->running_) {
+    return;
+  }
+
+  timer_.Stop();
+  this->StopSequence();
+  adc_disable_external_trigger_regular(kADC);
+  this->running_ = false;
+}
+
+template <uint32_t kADC>
+void TimedADC<kADC>::ReleaseBlock(const uint16_t* block) {
+  held_[block == buffer_ ? 0 : 1] = false;
+}
+
+template <uint32_t kADC>
+void TimedADC<kADC>::HandleDMAInterrupt() {
+  auto& dma = this->dma_;
+  if (dma_get_interrupt_flag(dma.Dma(), dma.Stream(), DMA_HTIF)) {
+    dma_clear_interrupt_flags(dma.Dma(), dma.Stream(), DMA_HTIF);
+    BlockDone(0);
+  }
+
+  if (dma_get_interrupt_flag(dma.Dma(), dma.Stream(), DMA_TCIF)) {
+    dma_clear_interrupt_flags(dma.Dma(), dma.Stream(), DMA_TCIF);
+    BlockDone(1);
+  }
+}
+
+template <uint32_t kADC>
+void TimedADC<kADC>::BlockDone(int half) {
+  // DMA is now writing into the other half, so if the application still has
+  // it, the application is going to see it change under it.
+  if (held_[1 - half]) {
+    ++overruns_;
+    held_[1 - half] = false;
+  }
+
+  held_[half] = true;
+  if (callback_) {
+    callback_(buffer_ + half * block_len_, block_len_);
+  }
+}
+
+InterleavedADC::InterleavedADC(uint8_t channel, uint32_t delay_cycles)
+    : delay_cycles_(delay_cycles),
+      dma_(DMAManager::GetInstance().AllocateStream(GetInfo(ADC1).dma)),
+      buffer_(nullptr), len_(0), pre_trigger_(0), post_trigger_(0),
+      state_(State::kIdle), wrapped_(false), trigger_pos_(0), pre_valid_(0) {
+  AssertTrue(ADCManager::GetInstance().AllocateADC(ADC2), "ADC2 already in use");
+  AssertTrue(ADCManager::GetInstance().AllocateADC(ADC3), "ADC3 already in use");
+
+  if (channel >= kNumChannels ||
+      kADCChannelInfos[0][channel].channel_type != ChannelType::kGPIO ||
+      kADCChannelInfos[0][channel].port_pin !=
+          kADCChannelInfos[2][channel].port_pin) {
+    HandleError("Channel not available on all ADCs");
+  } else {
+    channel_allocation_ = SetupChannel(channel, /*is_vbatt=*/false);
+  }
+
+  if (delay_cycles_ < 5 || delay_cycles_ > 20) {
+    HandleError("Interleaved ADC delay must be 5 to 20 cycles");
+    delay_cycles_ = 5;
+  }
+
+  // We use the shortest sampling time to allow the shortest delay. Each ADC
+  // then takes 15 cycles per conversion, which must fit in 3 delays.
+  // Don't touch the sampling times of other channels an InjectedADC may have
+  // set up.
+  for (auto adc : {ADC1, ADC2, ADC3}) {
+    adc_power_off(adc);
+    if (ADCManager::GetInstance().GroupAllocated(adc, ADCGroup::kInjected)) {
+      adc_set_sample_time(adc, channel, ADC_SMPR_SMP_3CYC);
+    } else {
+      adc_set_sample_time_on_all_channels(adc, ADC_SMPR_SMP_3CYC);
+    }
+    adc_disable_scan_mode(adc);
+    adc_set_continuous_conversion_mode(adc);
+    adc_set_regular_sequence(adc, 1, &channel);
+  }
+
+  dma_.SetISRCallback([this]() { HandleDMAInterrupt(); });
+}
+
+InterleavedADC::~InterleavedADC() {
+  Abort();
+  dma_.ClearISRCallback();
+
+  for (auto adc : {ADC1, ADC2, ADC3}) {
+    adc_set_single_conversion_mode(adc);
+  }
+
+  ADCManager::GetInstance().SetMultiMode(ADC_CCR_MULTI_INDEPENDENT,
+                                         ADC_CCR_DMA_DISABLE,
+                                         ADC_CCR_DELAY_5ADCCLK);
+  ADCManager::GetInstance().DeallocateADC(ADC2);
+  ADCManager::GetInstance().DeallocateADC(ADC3);
+}
+
+void InterleavedADC::Arm(uint16_t* buffer, std::size_t len,
+                         std::size_t pre_trigger, std::size_t post_trigger,
+                         CaptureCallback callback) {
+  Abort();
+
+  if ((len % 2) != 0 || len > (2 * kDMAMaxTransfer) ||
+      (pre_trigger + post_trigger) > (len / 2)) {
+    HandleError("Invalid interleaved ADC capture length");
+    return;
+  }
+
+  buffer_ = buffer;
+  len_ = len;
+  pre_trigger_ = pre_trigger;
+  post_trigger_ = post_trigger;
+  callback_ = callback;
+  wrapped_ = false;
+  trigger_pos_ = 0;
+  pre_valid_ = 0;
+
+  // In DMA mode 2, each request transfers two samples packed into a word, in
+  // conversion order (ADC2:ADC1, ADC1:ADC3, ADC3:ADC2, ...), so in memory the
+  // samples come out in time order.
+  ADCManager::GetInstance().SetMultiMode(
+      ADC_CCR_MULTI_TRIPLE_INTERLEAVED, ADC_CCR_DMA_MODE_2 | ADC_CCR_DDS,
+      (delay_cycles_ - 5) << ADC_CCR_DELAY_SHIFT);
+
+  dma_.SetupPeripheralTransfer(&ADC_CDR, buffer_, len_ / 2,
+                               DMA_SxCR_DIR_PERIPHERAL_TO_MEM,
+                               DMA_SxCR_PSIZE_32BIT, DMA_SxCR_MSIZE_32BIT);
+  dma_enable_circular_mode(dma_.Dma(), dma_.Stream());
+  dma_enable_half_transfer_interrupt(dma_.Dma(), dma_.Stream());
+  dma_enable_transfer_complete_interrupt(dma_.Dma(), dma_.Stream());
+  dma_.Enable();
+
+  state_ = State::kArmed;
+
+  // ADC2 and ADC3 must be on before the master (ADC1) starts.
+  adc_power_on(ADC3);
+  adc_power_on(ADC2);
+  adc_power_on(ADC1);
+  adc_start_conversion_regular(ADC1);
+}
+
+void InterleavedADC::Trigger() {
+  ScopedIRQLock lock(dma_.IRQ());
+  if (state_ != State::kArmed) {
+    return;
+  }
+
+  trigger_pos_ = CurrentPosition();
+
+  if (wrapped_ || trigger_pos_ >= pre_trigger_) {
+    pre_valid_ = pre_trigger_;
+  } else {
+    pre_valid_ = trigger_pos_;
+  }
+
+  state_ = State::kTriggered;
+}
+
+void InterleavedADC::Abort() {
+  ScopedIRQLock lock(dma_.IRQ());
+  if (state_ == State::kArmed || state_ == State::kTriggered) {
+    StopSampling();
+  }
+  state_ = State::kIdle;
+}
+
+std::size_t InterleavedADC::CopyCapture(uint16_t* out) const {
+  if (state_ != State::kDone) {
+    return 0;
+  }
+
+  std::size_t num_samples = pre_valid_ + post_trigger_;
+  std::size_t pos = (trigger_pos_ + len_ - pre_valid_) % len_;
+  for (std::size_t i = 0; i < num_samples; ++i) {
+    out[i] = buffer_[pos];
+    pos = (pos + 1) == len_ ? 0 : (pos + 1);
+  }
+
+  return num_samples;
+}
+
+std::size_t InterleavedADC::CurrentPosition() const {
+  std::size_t pos = len_ - 2 * dma_.Remaining();
+  return pos == len_ ? 0 : pos;
+}
+
+void InterleavedADC::HandleDMAInterrupt() {
+  bool half = dma_get_interrupt_flag(dma_.Dma(), dma_.Stream(), DMA_HTIF);
+  bool full = dma_get_interrupt_flag(dma_.Dma(), dma_.Stream(), DMA_TCIF);
+  dma_clear_interrupt_flags(dma_.Dma(), dma_.Stream(), DMA_HTIF | DMA_TCIF);
+
+  if (full) {
+    wrapped_ = true;
+  }
+
+  if (!(half || full) || state_ != State::kTriggered) {
+    return;
+  }
+
+  std::size_t since_trigger = (CurrentPosition() + len_ - trigger_pos_) % len_;
+  if (since_trigger >= post_trigger_) {
+    StopSampling();
+    state_ = State::kDone;
+    if (callback_) {
+      callback_();
+    }
+  }
+}
+
+void InterleavedADC::StopSampling() {
+  for (auto adc : {ADC1, ADC2, ADC3}) {
+    adc_power_off(adc);
+  }
+
+  dma_.Disable();
+
+  for (auto adc : {ADC1, ADC2, ADC3}) {
+    adc_clear_overrun_flag(adc);
+  }
+}
+
+template <int kWidth>
+SimultaneousADC<kWidth>::SimultaneousADC(uint32_t timer)
+    : timer_(TimerManager::GetInstance().AllocateTimer(timer)),
+      dma_(DMAManager::GetInstance().AllocateStream(GetInfo(ADC1).dma)),
+      num_tuples_(0), num_pins_(0), buffer_(nullptr), len_(0),
+      running_(false), wraps_(0), read_count_(0), overruns_(0) {
+  AssertTrue(ADCManager::GetInstance().AllocateADC(ADC2), "ADC2 already in use");
+  if (kWidth == 3) {
+    AssertTrue(ADCManager::GetInstance().AllocateADC(ADC3),
+               "ADC3 already in use");
+  }
+
+  if (RegularTriggerForTimer(timer) < 0) {
+    HandleError(std::string(GetTimerInfo(timer).str_name) +
+                " can't trigger ADC conversions");
+  }
+
+  for (int i = 0; i < kWidth; ++i) {
+    uint32_t adc = kADCInfos[i].adc_base;
+    adc_power_off(adc);
+    // AddTuple() sets the sampling times of our channels, so leave the others
+    // alone if an InjectedADC is using them.
+    if (!ADCManager::GetInstance().GroupAllocated(adc, ADCGroup::kInjected)) {
+      adc_set_sample_time_on_all_channels(adc, ADC_SMPR_SMP_3CYC);
+    }
+    adc_enable_scan_mode(adc);
+    adc_set_single_conversion_mode(adc);
+  }
+
+  dma_.SetISRCallback([this]() {
+    if (dma_get_interrupt_flag(dma_.Dma(), dma_.Stream(), DMA_TCIF)) {
+      dma_clear_interrupt_flags(dma_.Dma(), dma_.Stream(), DMA_TCIF);
+      wraps_ = wraps_ + 1;
+    }
+  });
+}
+
+template <int kWidth>
+SimultaneousADC<kWidth>::~SimultaneousADC() {
+  Stop();
+  dma_.ClearISRCallback();
+
+  ADCManager::GetInstance().SetMultiMode(ADC_CCR_MULTI_INDEPENDENT,
+                                         ADC_CCR_DMA_DISABLE,
+                                         ADC_CCR_DELAY_5ADCCLK);
+  ADCManager::GetInstance().DeallocateADC(ADC2);
+  if (kWidth == 3) {
+    ADCManager::GetInstance().DeallocateADC(ADC3);
+  }
+}
+
+template <int kWidth>
+int SimultaneousADC<kWidth>::AddTuple(
+    const std::array<uint8_t, kWidth>& channels, uint64_t sampling_time_ns) {
+  if (running_) {
+    HandleError("Channels must be added before starting conversions");
+    return -1;
+  }
+
+  if (num_tuples_ == kMaxScanChannels) {
+    HandleError("Too many channels in scan sequence");
+    return -1;
+  }
+
+  for (int i = 0; i < kWidth; ++i) {
+    uint8_t channel = channels[i];
+    if (channel >= kNumChannels ||
+        kADCChannelInfos[i][channel].channel_type == ChannelType::kNC) {
+      HandleError(std::string("Channel not available on ") +
+                  kADCInfos[i].str_name);
+      return -1;
+    }
+
+    for (int j = 0; j < i; ++j) {
+      if (channels[j] == channel) {
+        HandleError("Simultaneous ADCs can't convert the same channel");
+        return -1;
+      }
+    }
+  }
+
+  for (int i = 0; i < kWidth; ++i) {
+    uint8_t channel = channels[i];
+    if (kADCChannelInfos[i][channel].channel_type == ChannelType::kGPIO) {
+      SetupPin(kADCInfos[i].adc_base, channel);
+    } else {
+      // Internal channels are only on ADC1, and need at least 10us.
+      allocations_[num_pins_++] = SetupChannel(channel, /*is_vbatt=*/false);
+      if (sampling_time_ns < 10000) {
+        sampling_time_ns = 10000;
+      }
+    }
+
+    sequences_[i][num_tuples_] = channel;
+  }
+
+  // The same sampling time on all ADCs, so conversions finish together.
+  for (int i = 0; i < kWidth; ++i) {
+    ADCManager::GetInstance().SetSamplingTime(kADCInfos[i].adc_base,
+                                              channels[i], sampling_time_ns);
+  }
+
+  return num_tuples_++;
 }
 
+template <int kWidth>
+void SimultaneousADC<kWidth>::SetupPin(uint32_t adc, uint8_t channel) {
+  GPIOPortPin pin = kADCChannelInfos[GetIndex(adc)][channel].port_pin;
+  for (int i = 0; i < num_pins_; ++i) {
+    if (pins_[i] == pin) {
+      return;
+    }
+  }
+
+  ChannelAllocation& allocation = allocations_[num_pins_];
+  allocation.pin_allocation.emplace(GPIOManager::GetInstance().AllocatePin(pin));
+  allocation.pin_allocation->SetAnalog();
+  pins_[num_pins_++] = pin;
+}
+
+template <int kWidth>
+float SimultaneousADC<kWidth>::Start(float sample_rate_hz, Tuple* buffer,
+                                     std::size_t len) {
+  if (running_ || num_tuples_ == 0) {
+    return 0.0f;
+  }
+
+  // Dual mode uses DMA mode 2 (ADC2:ADC1 in one word per request), and triple
+  // mode uses DMA mode 1 (one half-word per request, in ADC order). Both result
+  // in tuples laid out in ADC order in memory.
+  std::size_t transfers = kWidth == 2 ? len : (len * kWidth);
+  if (len == 0 || transfers > kDMAMaxTransfer) {
+    HandleError("Invalid simultaneous ADC buffer length");
+    return 0.0f;
+  }
+
+  buffer_ = buffer;
+  len_ = len;
+  wraps_ = 0;
+  read_count_ = 0;
+  overruns_ = 0;
+
+  for (int i = 0; i < kWidth; ++i) {
+    uint32_t adc = kADCInfos[i].adc_base;
+    adc_power_off(adc);
+    adc_set_regular_sequence(adc, num_tuples_, sequences_[i].data());
+  }
+
+  ADCManager::GetInstance().SetMultiMode(
+      kWidth == 2 ? ADC_CCR_MULTI_DUAL_REGULAR_SIMUL :
+                    ADC_CCR_MULTI_TRIPLE_REGULAR_SIMUL,
+      (kWidth == 2 ? ADC_CCR_DMA_MODE_2 : ADC_CCR_DMA_MODE_1) | ADC_CCR_DDS,
+      ADC_CCR_DELAY_5ADCCLK);
+
+  // Only the master is triggered. The slaves follow.
+  adc_enable_external_trigger_regular(
+      ADC1, RegularTriggerForTimer(timer_.Timer()) << ADC_CR2_EXTSEL_SHIFT,
+      ADC_CR2_EXTEN_RISING_EDGE);
+
+  if (kWidth == 2) {
+    dma_.SetupPeripheralTransfer(&ADC_CDR, buffer_, transfers,
+                                 DMA_SxCR_DIR_PERIPHERAL_TO_MEM,
+                                 DMA_SxCR_PSIZE_32BIT, DMA_SxCR_MSIZE_32BIT);
+  } else {
+    dma_.SetupPeripheralTransfer(&ADC_CDR, buffer_, transfers,
+                                 DMA_SxCR_DIR_PERIPHERAL_TO_MEM,
+                                 DMA_SxCR_PSIZE_16BIT, DMA_SxCR_MSIZE_16BIT);
+  }
+  dma_enable_circular_mode(dma_.Dma(), dma_.Stream());
+  dma_enable_transfer_complete_interrupt(dma_.Dma(), dma_.Stream());
+  dma_.Enable();
+
+  for (int i = kWidth - 1; i >= 0; --i) {
+    adc_power_on(kADCInfos[i].adc_base);
+  }
+
+  float actual_rate = timer_.SetUpdateFrequency(sample_rate_hz);
+  timer_.SetTriggerOnUpdate();
+
+  running_ = true;
+  timer_.Start();
+
+  return actual_rate;
+}
+
+template <int kWidth>
+void SimultaneousADC<kWidth>::Stop() {
+  if (!running_) {
+    return;
+  }
+
+  timer_.Stop();
+
+  for (int i = 0; i < kWidth; ++i) {
+    adc_power_off(kADCInfos[i].adc_base);
+  }
+
+  dma_.Disable();
+  adc_disable_external_trigger_regular(ADC1);
+
+  for (int i = 0; i < kWidth; ++i) {
+    adc_clear_overrun_flag(kADCInfos[i].adc_base);
+  }
+
+  running_ = false;
+}
+
+template <int kWidth>
+uint64_t SimultaneousADC<kWidth>::WriteCount() const {
+  uint32_t wraps;
+  std::size_t remaining;
+  do {
+    wraps = wraps_;
+    remaining = dma_.Remaining();
+  } while (wraps != wraps_);
+
+  // In triple mode, the tuple DMA is part way through isn't done.
+  std::size_t per_tuple = kWidth == 2 ? 1 : kWidth;
+  std::size_t pos = len_ - (remaining + per_tuple - 1) / per_tuple;
+  return static_cast<uint64_t>(wraps) * len_ + pos;
+}
+
+template <int kWidth>
+std::size_t SimultaneousADC<kWidth>::Available() {
+  if (!running_) {
+    return 0;
+  }
+
+  uint64_t write_count = WriteCount();
+
+  // The wrap-around interrupt may be pending (if we are called with it
+  // masked), in which case we see fewer tuples than we have.
+  if (write_count < read_count_) {
+    return 0;
+  }
+
+  return write_count - read_count_;
+}
+
+template <int kWidth>
+std::size_t SimultaneousADC<kWidth>::Read(Tuple* out, std::size_t max_tuples) {
+  std::size_t available = Available();
+
+  // Leave a sequence's worth of margin, so we aren't reading tuples DMA is
+  // about to overwrite.
+  std::size_t max_backlog = len_ > static_cast<std::size_t>(num_tuples_) ?
+                            (len_ - num_tuples_) : 1;
+  if (available > max_backlog) {
+    overruns_ += available - max_backlog;
+    read_count_ += available - max_backlog;
+    available = max_backlog;
+  }
+
+  std::size_t to_read = std::min<std::size_t>(available, max_tuples);
+  std::size_t pos = read_count_ % len_;
+  for (std::size_t i = 0; i < to_read; ++i) {
+    out[i] = buffer_[pos];
+    pos = (pos + 1) == len_ ? 0 : (pos + 1);
+  }
+
+  read_count_ += to_read;
+  return to_read;
+}
+
+template <int kWidth>
+typename SimultaneousADC<kWidth>::Tuple SimultaneousADC<kWidth>::Latest() {
+  uint64_t write_count = running_ ? WriteCount() : 0;
+  if (write_count == 0) {
+    return Tuple();
+  }
+
+  return buffer_[(write_count - 1) % len_];
+}
+
+template <uint32_t kADC>
+InjectedADC<kADC>::InjectedADC() : num_channels_(0), results_() {
+  AssertTrue(ADCManager::GetInstance().AllocateADC(kADC, ADCGroup::kInjected),
+             std::string(GetInfo(kADC).str_name) +
+             " injected group already in use");
+
+  // Convert the whole injected sequence per trigger.
+  adc_enable_scan_mode(kADC);
+  adc_enable_eoc_interrupt_injected(kADC);
+  ADCManager::GetInstance().SetISRCallback(kADC, ADCGroup::kInjected,
+                                           [this]() { HandleInterrupt(); });
+  adc_power_on(kADC);
+}
+
+template <uint32_t kADC>
+InjectedADC<kADC>::~InjectedADC() {
+  ClearHardwareTrigger();
+  adc_disable_eoc_interrupt_injected(kADC);
+  ADCManager::GetInstance().ClearISRCallback(kADC, ADCGroup::kInjected);
+  ADCManager::GetInstance().DeallocateADC(kADC, ADCGroup::kInjected);
+}
+
+template <uint32_t kADC>
+int InjectedADC<kADC>::AddChannel(uint8_t channel, uint64_t sampling_time_ns,
+                                  bool is_vbatt) {
+  if (num_channels_ == kMaxInjectedChannels) {
+    HandleError("Too many injected channels");
+    return -1;
+  }
+
+  if (channel >= kNumChannels ||
+      kADCChannelInfos[GetIndex(kADC)][channel].channel_type ==
+          ChannelType::kNC) {
+    HandleError(std::string("Channel not available on ") +
+                GetInfo(kADC).str_name);
+    return -1;
+  }
+
+  // The channel may already be set up by a regular group user, in which case
+  // we don't need to (and can't) allocate the pin again.
+  auto& manager = ADCManager::GetInstance();
+  const ChannelInfo& ci = kADCChannelInfos[GetIndex(kADC)][channel];
+  if (ci.channel_type != ChannelType::kGPIO ||
+      !GPIOManager::GetInstance().IsAllocated(ci.port_pin)) {
+    allocations_[num_channels_] = manager.SetupChannel(kADC, channel, is_vbatt);
+  }
+
+  if (ci.channel_type != ChannelType::kGPIO && sampling_time_ns < 10000) {
+    sampling_time_ns = 10000;
+  }
+
+  if (sampling_time_ns > 0) {
+    manager.SetSamplingTime(kADC, channel, sampling_time_ns);
+  }
+
+  channels_[num_channels_] = channel;
+  ++num_channels_;
+
+  adc_set_injected_sequence(kADC, num_channels_, channels_.data());
+
+  return num_channels_ - 1;
+}
+
+template <uint32_t kADC>
+void InjectedADC<kADC>::SetCallback(Callback callback) {
+  ScopedIRQLock lock(NVIC_ADC_IRQ);
+  callback_ = callback;
+}
+
+template <uint32_t kADC>
+void InjectedADC<kADC>::SetHardwareTrigger(InjectedTrigger trigger,
+                                           uint32_t edge) {
+  adc_enable_external_trigger_injected(
+      kADC, static_cast<uint32_t>(trigger) << ADC_CR2_JEXTSEL_SHIFT, edge);
+}
+
+template <uint32_t kADC>
+void InjectedADC<kADC>::ClearHardwareTrigger() {
+  adc_disable_external_trigger_injected(kADC);
+}
+
+template <uint32_t kADC>
+void InjectedADC<kADC>::TriggerSoftware() {
+  adc_start_conversion_injected(kADC);
+}
+
+template <uint32_t kADC>
+void InjectedADC<kADC>::HandleInterrupt() {
+  if (!adc_eoc_injected(kADC)) {
+    return;
+  }
+
+  // Flags are cleared by writing 0, and writing 1 has no effect.
+  ADC_SR(kADC) = ~(ADC_SR_JEOC | ADC_SR_JSTRT);
+
+  uint16_t results[kMaxInjectedChannels];
+  for (int i = 0; i < num_channels_; ++i) {
+    results[i] = adc_read_injected(kADC, i + 1);
+    results_[i] = results[i];
+  }
+
+  if (callback_) {
+    callback_(results, num_channels_);
+  }
+}
+
+template class ADCBase<ADC1>;
+template class ADCBase<ADC2>;
+template class ADCBase<ADC3>;
+
+template class SequenceADC<ADC1>;
+template class SequenceADC<ADC2>;
+template class SequenceADC<ADC3>;
+
 template class SingleConversionADC<ADC1>;
 template class SingleConversionADC<ADC2>;
 template class SingleConversionADC<ADC3>;
 
+template class ScanADC<ADC1>;
+template class ScanADC<ADC2>;
+template class ScanADC<ADC3>;
+
+template class TimedADC<ADC1>;
+template class TimedADC<ADC2>;
+template class TimedADC<ADC3>;
+
+template class SimultaneousADC<2>;
+template class SimultaneousADC<3>;
+
+template class InjectedADC<ADC1>;
+template class InjectedADC<ADC2>;
+template class InjectedADC<ADC3>;
+
 }; // namespace Ostrich
@@ -0,0 +1,220 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "adc_filter.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if __ARM_FEATURE_SIMD32
+#include <arm_acle.h>
+#endif
+
+#include "ostrich.h"
+
+namespace Ostrich {
+
+namespace {
+
+// Output = (sum * scale) >> kADCFilterScaleShift, where sum is at most full
+// scale input * gain, so this doesn't overflow for outputs up to 16 bits.
+uint64_t ComputeScale(uint64_t gain, int output_bits) {
+  return (1ULL << (kADCFilterScaleShift + output_bits - kADCFilterInputBits)) /
+         gain;
+}
+
+bool ValidOutputBits(int output_bits) {
+  return output_bits >= 8 && output_bits <= 16;
+}
+
+// Unaligned 32-bit load (fine on Cortex-M7 for LDR).
+inline uint32_t LoadPair(const uint16_t* p) {
+  uint32_t pair;
+  std::memcpy(&pair, p, sizeof(pair));
+  return pair;
+}
+
+// Sum of n samples.
+inline uint32_t SumSamples(const uint16_t* in, std::size_t n, uint32_t acc) {
+#if __ARM_FEATURE_SIMD32
+  // SMLAD multiplies both halfwords by 1 and adds them to the accumulator, so
+  // we get 2 samples per instruction. Samples are 12-bit, so treating them
+  // as signed is fine.
+  for (; n >= 4; n -= 4, in += 4) {
+    acc = __smlad(LoadPair(in), 0x00010001, acc);
+    acc = __smlad(LoadPair(in + 2), 0x00010001, acc);
+  }
+#endif
+  for (; n > 0; --n) {
+    acc += *in++;
+  }
+  return acc;
+}
+
+// Sums of n pairs of interleaved samples (2 channel sequences).
+inline void SumPairs(const uint16_t* in, std::size_t n, uint32_t* acc0,
+                     uint32_t* acc1) {
+#if __ARM_FEATURE_SIMD32
+  // UADD16 adds both channels in one instruction. 16 12-bit samples fit in a
+  // 16-bit lane, so we widen every 16 pairs.
+  while (n >= 16) {
+    uint32_t lanes = 0;
+    for (int i = 0; i < 16; ++i, in += 2) {
+      lanes = __uadd16(lanes, LoadPair(in));
+    }
+    *acc0 += lanes & 0xffff;
+    *acc1 += lanes >> 16;
+    n -= 16;
+  }
+#endif
+  for (; n > 0; --n, in += 2) {
+    *acc0 += in[0];
+    *acc1 += in[1];
+  }
+}
+
+} // namespace
+
+BoxcarDecimator::BoxcarDecimator(uint32_t ratio, int output_bits,
+                                 int num_channels)
+    : ratio_(ratio), num_channels_(num_channels), scale_(0), count_(0),
+      sums_() {
+  // Sums must fit in 32 bits.
+  if (ratio_ < 1 || ratio_ > (1u << (32 - kADCFilterInputBits)) ||
+      !ValidOutputBits(output_bits) || num_channels_ < 1 ||
+      num_channels_ > kMaxScanChannels) {
+    HandleError("Invalid boxcar decimator settings");
+    ratio_ = 1;
+    output_bits = kADCFilterInputBits;
+    num_channels_ = 1;
+  }
+
+  scale_ = ComputeScale(ratio_, output_bits);
+}
+
+std::size_t BoxcarDecimator::Process(const uint16_t* in, std::size_t len,
+                                     uint16_t* out) {
+  std::size_t num_out = 0;
+  std::size_t sequences = len / num_channels_;
+
+  while (sequences > 0) {
+    // Sum as much as we can towards the current output.
+    std::size_t n = std::min<std::size_t>(sequences, ratio_ - count_);
+
+    if (num_channels_ == 1) {
+      sums_[0] = SumSamples(in, n, sums_[0]);
+    } else if (num_channels_ == 2) {
+      SumPairs(in, n, &sums_[0], &sums_[1]);
+    } else {
+      const uint16_t* p = in;
+      for (std::size_t i = 0; i < n; ++i) {
+        for (int ch = 0; ch < num_channels_; ++ch) {
+          sums_[ch] += *p++;
+        }
+      }
+    }
+
+    in += n * num_channels_;
+    sequences -= n;
+    count_ += n;
+
+    if (count_ == ratio_) {
+      for (int ch = 0; ch < num_channels_; ++ch) {
+        out[num_out++] = Scale(sums_[ch]);
+        sums_[ch] = 0;
+      }
+      count_ = 0;
+    }
+  }
+
+  return num_out;
+}
+
+void BoxcarDecimator::Reset() {
+  count_ = 0;
+  sums_.fill(0);
+}
+
+CICDecimator::CICDecimator(uint32_t ratio, int stages, int output_bits,
+                           int num_channels)
+    : ratio_(ratio), stages_(stages), num_channels_(num_channels), scale_(0),
+      count_(0), integrators_(), combs_() {
+  // Output must fit in 32 bits.
+  constexpr uint64_t kMaxGain = 1ULL << (32 - kADCFilterInputBits);
+  uint64_t gain = 1;
+  for (int i = 0; i < stages_ && gain <= kMaxGain; ++i) {
+    gain *= ratio_;
+  }
+
+  if (ratio_ < 1 || stages_ < 1 || stages_ > kMaxCICStages ||
+      !ValidOutputBits(output_bits) || num_channels_ < 1 ||
+      num_channels_ > kMaxScanChannels || gain > kMaxGain) {
+    HandleError("Invalid CIC decimator settings");
+    ratio_ = 1;
+    stages_ = 1;
+    output_bits = kADCFilterInputBits;
+    num_channels_ = 1;
+    gain = 1;
+  }
+
+  scale_ = ComputeScale(gain, output_bits);
+}
+
+std::size_t CICDecimator::Process(const uint16_t* in, std::size_t len,
+                                  uint16_t* out) {
+  std::size_t num_out = 0;
+  std::size_t sequences = len / num_channels_;
+
+  for (std::size_t i = 0; i < sequences; ++i) {
+    for (int ch = 0; ch < num_channels_; ++ch) {
+      auto& integrators = integrators_[ch];
+      uint32_t value = *in++;
+      for (int s = 0; s < stages_; ++s) {
+        integrators[s] += value;
+        value = integrators[s];
+      }
+    }
+
+    if (++count_ == ratio_) {
+      count_ = 0;
+      for (int ch = 0; ch < num_channels_; ++ch) {
+        auto& combs = combs_[ch];
+        uint32_t value = integrators_[ch][stages_ - 1];
+        for (int s = 0; s < stages_; ++s) {
+          uint32_t delayed = combs[s];
+          combs[s] = value;
+          value -= delayed;
+        }
+        out[num_out++] = Scale(value);
+      }
+    }
+  }
+
+  return num_out;
+}
+
+void CICDecimator::Reset() {
+  count_ = 0;
+  for (int ch = 0; ch < kMaxScanChannels; ++ch) {
+    integrators_[ch].fill(0);
+    combs_[ch].fill(0);
+  }
+}
+
+}; // namespace Ostrich
@@ -0,0 +1,108 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dma.h"
+
+#define DMA_STREAM_ISR(dma_name, dma, stream) \
+  void dma_name##_stream##stream##_isr() { \
+    Ostrich::DMAManager::GetInstance().InvokeCallback(dma, stream); \
+  }
+
+extern "C" {
+
+DMA_STREAM_ISR(dma1, DMA1, 0)
+DMA_STREAM_ISR(dma1, DMA1, 1)
+DMA_STREAM_ISR(dma1, DMA1, 2)
+DMA_STREAM_ISR(dma1, DMA1, 3)
+DMA_STREAM_ISR(dma1, DMA1, 4)
+DMA_STREAM_ISR(dma1, DMA1, 5)
+DMA_STREAM_ISR(dma1, DMA1, 6)
+DMA_STREAM_ISR(dma1, DMA1, 7)
+
+DMA_STREAM_ISR(dma2, DMA2, 0)
+DMA_STREAM_ISR(dma2, DMA2, 1)
+DMA_STREAM_ISR(dma2, DMA2, 2)
+DMA_STREAM_ISR(dma2, DMA2, 3)
+DMA_STREAM_ISR(dma2, DMA2, 4)
+DMA_STREAM_ISR(dma2, DMA2, 5)
+DMA_STREAM_ISR(dma2, DMA2, 6)
+DMA_STREAM_ISR(dma2, DMA2, 7)
+
+}
+
+#undef DMA_STREAM_ISR
+
+namespace Ostrich {
+
+const std::array<std::array<uint8_t, kNumDMAStreams>, kNumDMAs>
+    kDMAStreamIRQs{{
+  {{NVIC_DMA1_STREAM0_IRQ, NVIC_DMA1_STREAM1_IRQ, NVIC_DMA1_STREAM2_IRQ,
+    NVIC_DMA1_STREAM3_IRQ, NVIC_DMA1_STREAM4_IRQ, NVIC_DMA1_STREAM5_IRQ,
+    NVIC_DMA1_STREAM6_IRQ, NVIC_DMA1_STREAM7_IRQ}},
+  {{NVIC_DMA2_STREAM0_IRQ, NVIC_DMA2_STREAM1_IRQ, NVIC_DMA2_STREAM2_IRQ,
+    NVIC_DMA2_STREAM3_IRQ, NVIC_DMA2_STREAM4_IRQ, NVIC_DMA2_STREAM5_IRQ,
+    NVIC_DMA2_STREAM6_IRQ, NVIC_DMA2_STREAM7_IRQ}},
+}};
+
+namespace {
+const std::array<rcc_periph_clken, kNumDMAs> kDMARCCs = {{RCC_DMA1, RCC_DMA2}};
+} // namespace
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Weffc++"
+DMAManager::DMAManager() {
+  for (auto& dma_in_use : in_use_) {
+    dma_in_use = 0x00;
+  }
+}
+#pragma GCC diagnostic pop
+
+std::optional<DMAManager::StreamAllocation> DMAManager::TryAllocateStream(
+    const DMAChannel& channel) {
+  auto dma_index = DMAToIndex(channel.dma);
+  uint8_t stream_bit = 1 << channel.stream;
+
+  if (in_use_[dma_index] & stream_bit) {
+    return std::nullopt;
+  }
+
+  // We need to turn clock on if we are the first stream to be allocated on
+  // this controller.
+  if (in_use_[dma_index] == 0x00) {
+    rcc_periph_clock_enable(kDMARCCs[dma_index]);
+  }
+
+  in_use_[dma_index] |= stream_bit;
+
+  return StreamAllocation(channel);
+}
+
+void DMAManager::DeallocateStream(const DMAChannel& channel) {
+  auto dma_index = DMAToIndex(channel.dma);
+
+  isr_callbacks_[dma_index][channel.stream] = Callback();
+  in_use_[dma_index] &= ~(1 << channel.stream);
+
+  // Turn the lights out if we are the last one.
+  if (in_use_[dma_index] == 0x00) {
+    rcc_periph_clock_disable(kDMARCCs[dma_index]);
+  }
+}
+
+}; // namespace Ostrich
@@ -0,0 +1,127 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "exti.h"
+
+#include <libopencm3/stm32/rcc.h>
+
+#define EXTI_ISR(name, first_line, last_line) \
+  void name##_isr() { \
+    Ostrich::EXTIManager::GetInstance().InvokeCallbacks(first_line, \
+                                                        last_line); \
+  }
+
+extern "C" {
+
+EXTI_ISR(exti0, 0, 0)
+EXTI_ISR(exti1, 1, 1)
+EXTI_ISR(exti2, 2, 2)
+EXTI_ISR(exti3, 3, 3)
+EXTI_ISR(exti4, 4, 4)
+EXTI_ISR(exti9_5, 5, 9)
+EXTI_ISR(exti15_10, 10, 15)
+
+}
+
+#undef EXTI_ISR
+
+namespace Ostrich {
+
+namespace {
+
+// Mask of lines sharing the line's interrupt vector.
+uint16_t LinesSharingIRQ(int line) {
+  if (line < 5) {
+    return 1 << line;
+  } else if (line < 10) {
+    return 0x03e0;
+  } else {
+    return 0xfc00;
+  }
+}
+
+} // namespace
+
+EXTIManager::EXTIManager() : in_use_(0), callbacks_() {}
+
+void EXTIManager::AllocateLine(int line, uint32_t port,
+                               exti_trigger_type trigger, Callback callback) {
+  uint16_t line_bit = 1 << line;
+  if (in_use_ & line_bit) {
+    HandleError("EXTI line " + std::to_string(line) + " already in use");
+    return;
+  }
+
+  if (in_use_ == 0) {
+    rcc_periph_clock_enable(RCC_SYSCFG);
+  }
+
+  uint8_t irq = EXTILineIRQ(line);
+  {
+    ScopedIRQLock lock(irq);
+    in_use_ |= line_bit;
+    callbacks_[line] = callback;
+  }
+
+  exti_select_source(line_bit, port);
+  exti_set_trigger(line_bit, trigger);
+
+  // Don't report an edge from before we were set up.
+  exti_reset_request(line_bit);
+  exti_enable_request(line_bit);
+  nvic_enable_irq(irq);
+}
+
+void EXTIManager::DeallocateLine(int line) {
+  uint16_t line_bit = 1 << line;
+  exti_disable_request(line_bit);
+  exti_reset_request(line_bit);
+
+  uint8_t irq = EXTILineIRQ(line);
+  nvic_disable_irq(irq);
+  in_use_ &= ~line_bit;
+  callbacks_[line] = Callback();
+
+  // Other lines may still be using a shared vector.
+  if (in_use_ & LinesSharingIRQ(line)) {
+    nvic_enable_irq(irq);
+  }
+
+  // SYSCFG stays clocked even when no lines are in use, because it's shared
+  // with other users (eg. the I2C Fast-mode Plus drive bits in SYSCFG_PMC).
+}
+
+void EXTIManager::InvokeCallbacks(int first_line, int last_line) {
+  // Take the timestamp first, so it's as close to the edge as possible.
+  uint64_t timestamp_clocks = GetTimeClocks();
+
+  for (int line = first_line; line <= last_line; ++line) {
+    uint16_t line_bit = 1 << line;
+    if (!exti_get_flag_status(line_bit)) {
+      continue;
+    }
+
+    exti_reset_request(line_bit);
+    if (callbacks_[line]) {
+      callbacks_[line](timestamp_clocks);
+    }
+  }
+}
+
+}; // namespace Ostrich
@@ -0,0 +1,171 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpio_pattern.h"
+
+namespace Ostrich {
+
+BSRRPatternGenerator::BSRRPatternGenerator(uint32_t timer, uint32_t port)
+    : timer_(TimerManager::GetInstance().AllocateTimer(timer)),
+      dma_(DMAManager::GetInstance().AllocateStream(UpdateDMAForTimer(timer))),
+      port_(port), buffer_(nullptr), block_len_(0), streaming_(false),
+      running_(false), underruns_(0) {
+  dma_.SetISRCallback([this]() { HandleDMAInterrupt(); });
+}
+
+BSRRPatternGenerator::~BSRRPatternGenerator() {
+  Stop();
+  dma_.ClearISRCallback();
+}
+
+/*static*/ DMAChannel BSRRPatternGenerator::UpdateDMAForTimer(uint32_t timer) {
+  switch (timer) {
+    case TIM1: return DMAChannel{DMA2, 5, DMA_SxCR_CHSEL_6};
+    case TIM8: return DMAChannel{DMA2, 1, DMA_SxCR_CHSEL_7};
+    default:
+      HandleError(std::string(GetTimerInfo(timer).str_name) +
+                  " update DMA can't write to GPIO");
+      LockUp();
+      return DMAChannel{DMA2, 0, 0};
+  }
+}
+
+float BSRRPatternGenerator::Start(float word_rate_hz, uint32_t* buffer,
+                                  std::size_t block_len, FillCallback fill) {
+  if (running_) {
+    return 0.0f;
+  }
+
+  if (block_len == 0 || (2 * block_len) > kDMAMaxTransfer) {
+    HandleError("Invalid pattern block length");
+    return 0.0f;
+  }
+
+  buffer_ = buffer;
+  block_len_ = block_len;
+  fill_ = fill;
+  streaming_ = true;
+
+  fill_(buffer_, block_len_);
+  fill_(buffer_ + block_len_, block_len_);
+
+  float actual_rate = Setup(word_rate_hz, buffer_, 2 * block_len_);
+  dma_enable_circular_mode(dma_.Dma(), dma_.Stream());
+  dma_enable_half_transfer_interrupt(dma_.Dma(), dma_.Stream());
+  dma_enable_transfer_complete_interrupt(dma_.Dma(), dma_.Stream());
+  dma_.Enable();
+
+  running_ = true;
+  timer_.Start();
+
+  return actual_rate;
+}
+
+float BSRRPatternGenerator::PlayOnce(float word_rate_hz, const uint32_t* words,
+                                     std::size_t len, DoneCallback done) {
+  if (running_) {
+    return 0.0f;
+  }
+
+  if (len == 0 || len > kDMAMaxTransfer) {
+    HandleError("Invalid pattern length");
+    return 0.0f;
+  }
+
+  done_ = done;
+  streaming_ = false;
+
+  float actual_rate = Setup(word_rate_hz, words, len);
+  dma_enable_transfer_complete_interrupt(dma_.Dma(), dma_.Stream());
+  dma_.Enable();
+
+  running_ = true;
+  timer_.Start();
+
+  return actual_rate;
+}
+
+float BSRRPatternGenerator::Setup(float word_rate_hz, const uint32_t* words,
+                                  std::size_t len) {
+  uint32_t timer = timer_.Timer();
+
+  // This generates an update event to load the prescaler, so it must be done
+  // before enabling update DMA requests.
+  float actual_rate = timer_.SetUpdateFrequency(word_rate_hz);
+
+  dma_.SetupPeripheralTransfer(&GPIO_BSRR(port_),
+                               const_cast<uint32_t*>(words), len,
+                               DMA_SxCR_DIR_MEM_TO_PERIPHERAL,
+                               DMA_SxCR_PSIZE_32BIT, DMA_SxCR_MSIZE_32BIT);
+  dma_.ClearInterruptFlags();
+
+  // The first word goes out on the first update, one period after starting.
+  TIM_DIER(timer) |= TIM_DIER_UDE;
+
+  return actual_rate;
+}
+
+void BSRRPatternGenerator::Stop() {
+  if (!running_) {
+    return;
+  }
+
+  timer_.Stop();
+  TIM_DIER(timer_.Timer()) &= ~TIM_DIER_UDE;
+  dma_.Disable();
+  dma_.ClearInterruptFlags();
+  running_ = false;
+}
+
+void BSRRPatternGenerator::HandleDMAInterrupt() {
+  uint32_t dma = dma_.Dma();
+  uint8_t stream = dma_.Stream();
+
+  if (!streaming_) {
+    if (dma_get_interrupt_flag(dma, stream, DMA_TCIF)) {
+      dma_clear_interrupt_flags(dma, stream, DMA_TCIF);
+      Stop();
+      if (done_) {
+        done_();
+      }
+    }
+    return;
+  }
+
+  // The half that just finished is free to refill, while the other half is
+  // output. If the other half also finishes while we are filling, we are too
+  // slow.
+  if (dma_get_interrupt_flag(dma, stream, DMA_HTIF)) {
+    dma_clear_interrupt_flags(dma, stream, DMA_HTIF);
+    fill_(buffer_, block_len_);
+    if (dma_get_interrupt_flag(dma, stream, DMA_TCIF)) {
+      ++underruns_;
+    }
+  }
+
+  if (dma_get_interrupt_flag(dma, stream, DMA_TCIF)) {
+    dma_clear_interrupt_flags(dma, stream, DMA_TCIF);
+    fill_(buffer_ + block_len_, block_len_);
+    if (dma_get_interrupt_flag(dma, stream, DMA_HTIF)) {
+      ++underruns_;
+    }
+  }
+}
+
+}; // namespace Ostrich
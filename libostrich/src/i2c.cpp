@@ -19,31 +19,105 @@
 
 #include "i2c.h"
 
+#include <algorithm>
 #include <string>
 
+#include <libopencm3/stm32/syscfg.h>
+
 #include "ostrich.h"
 
 extern "C" {
 
-// TODO: ISRs.
+void i2c1_ev_isr(void) {
+  Ostrich::I2CManager::GetInstance().InvokeCallback(I2C1);
+}
+
+void i2c1_er_isr(void) {
+  Ostrich::I2CManager::GetInstance().InvokeCallback(I2C1);
+}
+
+void i2c2_ev_isr(void) {
+  Ostrich::I2CManager::GetInstance().InvokeCallback(I2C2);
+}
+
+void i2c2_er_isr(void) {
+  Ostrich::I2CManager::GetInstance().InvokeCallback(I2C2);
+}
+
+void i2c3_ev_isr(void) {
+  Ostrich::I2CManager::GetInstance().InvokeCallback(I2C3);
+}
+
+void i2c3_er_isr(void) {
+  Ostrich::I2CManager::GetInstance().InvokeCallback(I2C3);
+}
+
+void i2c4_ev_isr(void) {
+  Ostrich::I2CManager::GetInstance().InvokeCallback(I2C4);
+}
+
+void i2c4_er_isr(void) {
+  Ostrich::I2CManager::GetInstance().InvokeCallback(I2C4);
+}
 
 }
 
 namespace Ostrich {
 
 std::array<const I2CInfo, kNumI2Cs> kI2CInfo{{
-{I2C1, RCC_I2C1, RST_I2C1, NVIC_I2C1_EV_IRQ, "I2C1",
+// DMA request mappings are from RM0410 table "DMA1 request mapping". Each I2C
+// has more than one option, and these are chosen to not overlap where
+// possible. I2C4 TX is only available on stream 6 channel 8, which is shared
+// with I2C1 TX - if both are in use, whichever is constructed second falls back
+// to interrupt-driven transfers.
+{I2C1, RCC_I2C1, RST_I2C1, NVIC_I2C1_EV_IRQ, NVIC_I2C1_ER_IRQ, "I2C1",
+    {DMA1, 0, DMA_SxCR_CHSEL_1}, {DMA1, 6, DMA_SxCR_CHSEL_1},
     {{PIN_B7, 4}, {PIN_B9, 4}},
     {{PIN_B6, 4}, {PIN_B8, 4}}},
-{I2C2, RCC_I2C2, RST_I2C2, NVIC_I2C2_EV_IRQ, "I2C2",
+{I2C2, RCC_I2C2, RST_I2C2, NVIC_I2C2_EV_IRQ, NVIC_I2C2_ER_IRQ, "I2C2",
+    {DMA1, 3, DMA_SxCR_CHSEL_7}, {DMA1, 7, DMA_SxCR_CHSEL_7},
     {{PIN_F0, 4}, {PIN_B11, 4}, {PIN_H5, 4}},
     {{PIN_F1, 4}, {PIN_B10, 4}, {PIN_H4, 4}}},
-{I2C3, RCC_I2C3, RST_I2C3, NVIC_I2C3_EV_IRQ, "I2C3",
+{I2C3, RCC_I2C3, RST_I2C3, NVIC_I2C3_EV_IRQ, NVIC_I2C3_ER_IRQ, "I2C3",
+    {DMA1, 2, DMA_SxCR_CHSEL_3}, {DMA1, 4, DMA_SxCR_CHSEL_3},
     {{PIN_C9, 4}, {PIN_H8, 4}},
     {{PIN_A8, 4}, {PIN_H7, 4}}},
-{I2C4, RCC_I2C4, RST_I2C4, NVIC_I2C4_EV_IRQ, "I2C4",
+{I2C4, RCC_I2C4, RST_I2C4, NVIC_I2C4_EV_IRQ, NVIC_I2C4_ER_IRQ, "I2C4",
+    {DMA1, 5, DMA_SxCR_CHSEL_2}, {DMA1, 6, kDMAChannel8},
     {{PIN_D13, 4}, {PIN_H5, 4}, {PIN_H12, 4}, {PIN_F15, 4}},
     {{PIN_D12, 4}, {PIN_H4, 4}, {PIN_H11, 4}, {PIN_F14, 4}}},
 }};
 
+namespace {
+
+// SYSCFG_PMC I2Cx_FMP bits are 0-3, in I2C order.
+constexpr uint32_t kSYSCFGPMCFMPShift = 0;
+
+} // namespace
+
+void SetI2CFastModePlus(uint32_t i2c, bool enable) {
+  uint32_t bit = 1 << (kSYSCFGPMCFMPShift + I2CToIndex(i2c));
+
+  if (enable) {
+    rcc_periph_clock_enable(RCC_SYSCFG);
+    SYSCFG_PMC |= bit;
+  } else if (SYSCFG_PMC & bit) {
+    SYSCFG_PMC &= ~bit;
+  }
+}
+
+const char* I2CErrorString(I2CError error) {
+  switch (error) {
+    case I2CError::kNone: return "I2C OK";
+    case I2CError::kNACK: return "I2C NACK received";
+    case I2CError::kBusError: return "I2C bus error";
+    case I2CError::kArbitrationLost: return "I2C arbitration lost";
+    case I2CError::kOverrun: return "I2C overrun";
+    case I2CError::kTimeout: return "I2C Timed out";
+    case I2CError::kBusy: return "I2C busy";
+  }
+
+  return "I2C unknown error";
+}
+
 }; // namespace Ostrich
\ No newline at end of file
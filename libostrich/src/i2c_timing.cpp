@@ -0,0 +1,175 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "i2c_timing.h"
+
+#include <algorithm>
+#include <array>
+
+namespace Ostrich {
+
+namespace {
+
+// Timing requirements from UM10204 (I2C-bus specification) table 10, in ns.
+struct I2CModeSpec {
+  uint32_t max_hz;
+  uint32_t vddat_max;
+  uint32_t sudat_min;
+  uint32_t low_min;
+  uint32_t high_min;
+};
+
+constexpr std::array<I2CModeSpec, 3> kI2CModeSpecs = {{
+  // Standard-mode
+  {100000, 3450, 250, 4700, 4000},
+
+  // Fast-mode
+  {400000, 900, 100, 1300, 600},
+
+  // Fast-mode Plus
+  {1000000, 450, 50, 500, 260},
+}};
+
+// Analog filter delay range, from the datasheet (tAF), in ps.
+constexpr int64_t kAnalogFilterDelayMin = 50000;
+constexpr int64_t kAnalogFilterDelayMax = 260000;
+
+constexpr int64_t kPsPerSecond = 1000000000000LL;
+
+constexpr int kMaxPresc = 16;
+constexpr int kMaxDel = 16;
+constexpr int kMaxSCL = 256;
+
+int64_t CeilDiv(int64_t a, int64_t b) {
+  return (a + b - 1) / b;
+}
+
+} // namespace
+
+// This follows the timing equations in RM0410 "I2C timings". All times are
+// in picoseconds, so the I2CCLK period is reasonably precise.
+I2CTiming ComputeI2CTiming(uint32_t i2cclk_hz, uint32_t bus_hz,
+                           const I2CTimingConfig& config) {
+  I2CTiming ret{};
+
+  const I2CModeSpec* spec = nullptr;
+  for (const auto& mode_spec : kI2CModeSpecs) {
+    if (bus_hz <= mode_spec.max_hz) {
+      spec = &mode_spec;
+      break;
+    }
+  }
+
+  if (bus_hz == 0 || i2cclk_hz == 0 || spec == nullptr) {
+    return ret;
+  }
+
+  const int64_t clk = kPsPerSecond / i2cclk_hz;
+  const int64_t rise = config.rise_time_ns * 1000LL;
+  const int64_t fall = config.fall_time_ns * 1000LL;
+  const int64_t af_min = config.analog_filter ? kAnalogFilterDelayMin : 0;
+  const int64_t af_max = config.analog_filter ? kAnalogFilterDelayMax : 0;
+  const int64_t dnf = config.digital_filter;
+  const int64_t dnf_delay = dnf * clk;
+
+  // Data hold time must cover the SDA fall time (tHD;DAT min is 0), but the
+  // data must be valid before tVD;DAT max.
+  const int64_t sdadel_min =
+      std::max<int64_t>(0, fall - af_min - (dnf + 3) * clk);
+  const int64_t sdadel_max =
+      spec->vddat_max * 1000LL - rise - af_max - (dnf + 4) * clk;
+
+  // Data setup time includes the rise time.
+  const int64_t scldel_min = rise + spec->sudat_min * 1000LL;
+
+  // SCL edges are delayed by the input filters and resynchronization.
+  const int64_t tsync = af_min + dnf_delay + 2 * clk;
+
+  // Never go faster than requested, and give up if we can't get within 80%.
+  const int64_t period_min = CeilDiv(kPsPerSecond, bus_hz);
+  const int64_t period_max = period_min * 5 / 4;
+
+  int64_t best_period = 0;
+
+  for (int presc = 0; presc < kMaxPresc; ++presc) {
+    const int64_t tpresc = (presc + 1) * clk;
+
+    int scldel = std::max<int64_t>(0, CeilDiv(scldel_min, tpresc) - 1);
+    if (scldel >= kMaxDel) {
+      continue;
+    }
+
+    int sdadel = -1;
+    for (int i = 0; i < kMaxDel; ++i) {
+      int64_t t = i * tpresc;
+      if (t >= sdadel_min && t <= sdadel_max) {
+        sdadel = i;
+        break;
+      }
+    }
+
+    if (sdadel == -1) {
+      continue;
+    }
+
+    for (int scll = 0; scll < kMaxSCL; ++scll) {
+      const int64_t tlow = (scll + 1) * tpresc + tsync;
+
+      // The peripheral needs at least 4 I2CCLKs of SCL low after filtering.
+      if (tlow < spec->low_min * 1000LL ||
+          clk >= (tlow - af_min - dnf_delay) / 4) {
+        continue;
+      }
+
+      // Shortest SCLH that doesn't exceed the requested frequency.
+      const int64_t high_needed = period_min - tlow - rise - fall - tsync;
+      const int sclh = std::max<int64_t>(0, CeilDiv(high_needed, tpresc) - 1);
+      if (sclh >= kMaxSCL) {
+        continue;
+      }
+
+      const int64_t thigh = (sclh + 1) * tpresc + tsync;
+      const int64_t period = tlow + thigh + rise + fall;
+
+      if (thigh < spec->high_min * 1000LL || thigh <= clk ||
+          period < period_min || period > period_max) {
+        continue;
+      }
+
+      if (!ret.valid || period < best_period) {
+        ret.valid = true;
+        ret.presc = presc;
+        ret.scll = scll;
+        ret.sclh = sclh;
+        ret.sdadel = sdadel;
+        ret.scldel = scldel;
+        best_period = period;
+      }
+    }
+  }
+
+  if (ret.valid) {
+    ret.actual_hz = kPsPerSecond / best_period;
+    ret.fast_mode_plus = bus_hz > kI2CModeSpecs[1].max_hz;
+  }
+
+  return ret;
+}
+
+}; // namespace Ostrich
@@ -31,6 +31,9 @@ uint32_t g_apb2_freq;
 uint32_t g_systick_period;
 uint32_t g_vdd_mv;
 
+Timebase g_timebase;
+bool g_sleeping_delays;
+
 volatile uint32_t g_systick_reloads_high;
 volatile uint32_t g_systick_reloads_low;
 
@@ -51,6 +54,8 @@ void Init() {
   g_apb2_freq = board_config.clock_scale.apb2_frequency;
 
   g_systick_period = board_config.systick_period_clocks;
+  g_timebase = board_config.timebase;
+  g_sleeping_delays = board_config.sleeping_delays;
 
   g_vdd_mv = board_config.vdd_voltage_mV;
 
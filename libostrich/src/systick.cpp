@@ -19,24 +19,106 @@
 
 #include "systick.h"
 
+#include <array>
+#include <optional>
+
 #include <sys/time.h>
 
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
+#include <libopencm3/stm32/timer.h>
 
 #include "ostrich.h"
+#include "timer.h"
+#include "util.h"
 
 namespace Ostrich {
 
-void InitSystick() {
-  systick_set_reload(g_systick_period);
-  systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
-  systick_clear();
-  systick_counter_enable();
-  systick_interrupt_enable();
+namespace {
+
+// On the Cortex-M7, DWT registers are write protected until this is written to
+// the lock access register.
+constexpr uint32_t kDWTLockAccessOffset = 0xfb0;
+constexpr uint32_t kDWTUnlockKey = 0xc5acce55;
+
+// High word and the last CYCCNT value seen, for extending CYCCNT to 64 bits.
+volatile uint32_t g_cyccnt_high;
+volatile uint32_t g_cyccnt_last;
+
+// The high word timer counts low word timer updates through TRGO -> ITR, which
+// takes a few timer clocks to propagate. Low word values below this may be
+// from after an overflow the high word doesn't have yet.
+constexpr uint32_t kChainSettleCounts = 8;
+
+// TIM5 ITR0 is TIM2 TRGO.
+constexpr uint32_t kLowWordTimer = TIM2;
+constexpr uint32_t kHighWordTimer = TIM5;
+
+std::optional<TimerManager::TimerAllocation> g_low_word_timer;
+std::optional<TimerManager::TimerAllocation> g_high_word_timer;
+
+// AHB clocks per timer clock (1, 2, 4, or 8).
+uint32_t g_ahb_clocks_per_timer_clock;
+
+std::array<SysTickCallback, kMaxSysTickCallbacks> g_systick_callbacks;
+volatile int g_num_systick_callbacks;
+
+std::array<IdleCallback, kMaxIdleCallbacks> g_idle_callbacks;
+int g_num_idle_callbacks;
+
+// TIM7 runs at about 1MHz for delays, so sleeps are in whole microseconds
+// (roughly), and the remainder is spun.
+constexpr uint32_t kDelayTimer = TIM7;
+constexpr uint32_t kDelayTimerTickHz = 1000000;
+constexpr uint32_t kDelayTimerMaxTicks = 0x10000;
+
+std::optional<TimerManager::TimerAllocation> g_delay_timer;
+ConstantDivider g_clocks_per_delay_tick;
+volatile bool g_delay_timer_expired;
+
+// Spin loop iterations per AHB clock, in 16.16 fixed point. Set by
+// CalibrateSpinLoop().
+uint32_t g_spin_iterations_per_clock;
+constexpr uint32_t kSpinCalibrationIterations = 1000;
+
+ClockUnitConverter g_seconds_converter;
+ClockUnitConverter g_milliseconds_converter;
+ClockUnitConverter g_microseconds_converter;
+
+void InitCycleCounter() {
+  MMIO32(DWT_BASE + kDWTLockAccessOffset) = kDWTUnlockKey;
+  if (!dwt_enable_cycle_counter()) {
+    HandleError("No DWT cycle counter");
+    LockUp();
+  }
+
+  DWT_CYCCNT = 0;
+  g_cyccnt_high = 0;
+  g_cyccnt_last = 0;
 }
 
-uint64_t GetTimeClocks() {
+void InitChainedTimers() {
+  TimerManager& timer_manager = TimerManager::GetInstance();
+  g_low_word_timer.emplace(timer_manager.AllocateTimer(kLowWordTimer));
+  g_high_word_timer.emplace(timer_manager.AllocateTimer(kHighWordTimer));
+
+  // Both timers are fresh out of reset, so prescalers are already 1.
+  timer_set_period(kLowWordTimer, 0xffffffff);
+  g_low_word_timer->SetTriggerOnUpdate();
+
+  timer_set_period(kHighWordTimer, 0xffffffff);
+  timer_slave_set_trigger(kHighWordTimer, TIM_SMCR_TS_ITR0);
+  timer_slave_set_mode(kHighWordTimer, TIM_SMCR_SMS_ECM1);
+
+  g_ahb_clocks_per_timer_clock =
+      g_ahb_freq / TimerManager::TimerClock(kLowWordTimer);
+
+  g_high_word_timer->Start();
+  g_low_word_timer->Start();
+}
+
+uint64_t ReadSysTick() {
   uint64_t num_reloads;
   uint32_t systick_val;
 
@@ -68,22 +150,278 @@ uint64_t GetTimeClocks() {
   return clocks;
 }
 
+uint64_t ReadCycleCounter() {
+  // This may be called from any interrupt, so the read-modify-write of the
+  // extension must not be interrupted. It's only a few instructions.
+  ScopedInterruptMask mask;
+
+  uint32_t now = dwt_read_cycle_counter();
+  if (now < g_cyccnt_last) {
+    ++g_cyccnt_high;
+  }
+  g_cyccnt_last = now;
+  return (static_cast<uint64_t>(g_cyccnt_high) << 32) | now;
+}
+
+uint64_t ReadChainedTimers() {
+  uint32_t high;
+  uint32_t low;
+
+  do {
+    high = timer_get_counter(kHighWordTimer);
+    low = timer_get_counter(kLowWordTimer);
+
+    // If the high word changed, or may be about to change, the low word may
+    // belong to either. This retries for at most kChainSettleCounts timer
+    // clocks every 2^32.
+  } while (high != timer_get_counter(kHighWordTimer) ||
+           low < kChainSettleCounts);
+
+  uint64_t timer_clocks = (static_cast<uint64_t>(high) << 32) | low;
+  return timer_clocks * g_ahb_clocks_per_timer_clock;
+}
+
+__attribute__((noinline)) void SpinLoop(uint32_t iterations) {
+  if (iterations == 0) {
+    return;
+  }
+
+  __asm__ volatile(
+      "1: subs %0, %0, #1\n"
+      "   bne 1b\n"
+      : "+r"(iterations) : : "cc");
+}
+
+void CalibrateSpinLoop() {
+  // Take the fastest of a few runs, in case we got interrupted.
+  uint64_t min_clocks = UINT64_MAX;
+  for (int i = 0; i < 3; ++i) {
+    uint64_t start = GetTimeClocks();
+    SpinLoop(kSpinCalibrationIterations);
+    uint64_t clocks = GetTimeClocks() - start;
+    if (clocks < min_clocks) {
+      min_clocks = clocks;
+    }
+  }
+
+  if (min_clocks == 0) {
+    min_clocks = 1;
+  }
+
+  g_spin_iterations_per_clock =
+      (static_cast<uint64_t>(kSpinCalibrationIterations) << 16) / min_clocks;
+}
+
+void SpinClocks(uint64_t clocks) {
+  // Only used for short remainders, so this doesn't overflow.
+  SpinLoop((clocks * g_spin_iterations_per_clock) >> 16);
+}
+
+void SetupDelayTimer() {
+  g_delay_timer.emplace(TimerManager::GetInstance().AllocateTimer(kDelayTimer));
+
+  uint32_t timer_clock = TimerManager::TimerClock(kDelayTimer);
+  uint32_t prescaler = timer_clock / kDelayTimerTickHz;
+  if (prescaler < 1) {
+    prescaler = 1;
+  }
+  g_clocks_per_delay_tick =
+      ConstantDivider(prescaler * (g_ahb_freq / timer_clock));
+
+  timer_set_prescaler(kDelayTimer, prescaler - 1);
+  timer_one_shot_mode(kDelayTimer);
+
+  // Only overflows set the update flag, not our UG to restart the count.
+  timer_update_on_overflow(kDelayTimer);
+  timer_enable_irq(kDelayTimer, TIM_DIER_UIE);
+  nvic_enable_irq(NVIC_TIM7_IRQ);
+}
+
+// Sleep for ticks delay timer ticks (at most kDelayTimerMaxTicks).
+void SleepDelayTicks(uint32_t ticks) {
+  g_delay_timer_expired = false;
+  timer_set_period(kDelayTimer, ticks - 1);
+
+  // Reset the counter and the prescaler counter, and load the prescaler.
+  timer_generate_event(kDelayTimer, TIM_EGR_UG);
+  g_delay_timer->Start();
+
+  while (true) {
+    // With interrupts masked, the timer interrupt can't sneak in between the
+    // check and the wfi. It still wakes us up, and then runs when we unmask.
+    //
+    // If the caller already had interrupts masked, the interrupt never runs,
+    // but the pending interrupt still ends the wfi, and the flag is still
+    // set in the timer, so check that too.
+    ScopedInterruptMask mask;
+    if (g_delay_timer_expired || timer_get_flag(kDelayTimer, TIM_SR_UIF)) {
+      // Don't leave the interrupt pending for when interrupts are unmasked
+      // (or for the next delay).
+      timer_clear_flag(kDelayTimer, TIM_SR_UIF);
+      nvic_clear_pending_irq(NVIC_TIM7_IRQ);
+      break;
+    }
+    WaitForInterrupt();
+  }
+}
+
+} // namespace
+
+void InitSystick() {
+  g_seconds_converter = ClockUnitConverter(g_ahb_freq, 1);
+  g_milliseconds_converter = ClockUnitConverter(g_ahb_freq, 1000);
+  g_microseconds_converter = ClockUnitConverter(g_ahb_freq, 1000000);
+
+  switch (g_timebase) {
+    case Timebase::kSysTick:
+      if (g_systick_period == 0) {
+        HandleError("SysTick timebase needs a SysTick period");
+        LockUp();
+      }
+      break;
+    case Timebase::kCycleCounter:
+      InitCycleCounter();
+      break;
+    case Timebase::kChainedTimers:
+      InitChainedTimers();
+      break;
+  }
+
+  if (g_systick_period != 0) {
+    systick_set_reload(g_systick_period);
+    systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+    systick_clear();
+    systick_counter_enable();
+    systick_interrupt_enable();
+  }
+
+  CalibrateSpinLoop();
+
+  if (g_sleeping_delays) {
+    SetupDelayTimer();
+  }
+}
+
+uint64_t GetTimeClocks() {
+  switch (g_timebase) {
+    case Timebase::kCycleCounter:
+      return ReadCycleCounter();
+    case Timebase::kChainedTimers:
+      return ReadChainedTimers();
+    default:
+      return ReadSysTick();
+  }
+}
+
 uint64_t GetTimeMilliseconds() {
-  return GetTimeClocks() * 1000 / g_ahb_freq;
+  return ClocksToMilliseconds(GetTimeClocks());
 }
 
 uint64_t GetTimeMicroseconds() {
-  return GetTimeClocks() * 1000000 / g_ahb_freq;
+  return ClocksToMicroseconds(GetTimeClocks());
+}
+
+uint64_t ClocksToMilliseconds(uint64_t clocks) {
+  return g_milliseconds_converter.ClocksToUnits(clocks);
+}
+
+uint64_t ClocksToMicroseconds(uint64_t clocks) {
+  return g_microseconds_converter.ClocksToUnits(clocks);
+}
+
+uint64_t MillisecondsToClocks(uint64_t milliseconds) {
+  return g_milliseconds_converter.UnitsToClocks(milliseconds);
+}
+
+uint64_t MicrosecondsToClocks(uint64_t microseconds) {
+  return g_microseconds_converter.UnitsToClocks(microseconds);
 }
 
 void DelayMilliseconds(uint64_t milliseconds) {
-  uint64_t end = GetTimeMilliseconds() + milliseconds;
-  while (GetTimeMilliseconds() < end) {}
+  DelayUntil(Deadline(Duration::Milliseconds(milliseconds)));
 }
 
 void DelayMicroseconds(uint64_t microseconds) {
-  uint64_t end = GetTimeMicroseconds() + microseconds;
-  while (GetTimeMicroseconds() < end) {}
+  DelayUntil(Deadline(Duration::Microseconds(microseconds)));
+}
+
+void DelayUntil(const Deadline& deadline) {
+  // In interrupt context, the timer interrupt may not be able to preempt us,
+  // and another delay may already be using the timer.
+  bool can_sleep = g_delay_timer && !InInterruptContext();
+
+  if (can_sleep) {
+    while (true) {
+      uint64_t ticks =
+          g_clocks_per_delay_tick.Divide(deadline.Remaining().InClocks());
+      if (ticks == 0) {
+        break;
+      }
+      SleepDelayTicks(ticks > kDelayTimerMaxTicks ? kDelayTimerMaxTicks
+                                                  : ticks);
+    }
+  }
+
+  if (can_sleep) {
+    // Less than a timer tick left. This is more precise than polling the time.
+    SpinClocks(deadline.Remaining().InClocks());
+  } else {
+    while (!deadline.Expired()) {}
+  }
+}
+
+void AddSysTickCallback(SysTickCallback callback) {
+  if (g_systick_period == 0) {
+    HandleError("SysTick is disabled");
+    return;
+  }
+
+  if (g_num_systick_callbacks == kMaxSysTickCallbacks) {
+    HandleError("Too many SysTick callbacks");
+    return;
+  }
+
+  // Only publish the callback once it's fully written.
+  g_systick_callbacks[g_num_systick_callbacks] = callback;
+  CompilerBarrier();
+  g_num_systick_callbacks = g_num_systick_callbacks + 1;
+}
+
+void RunSysTickCallbacks() {
+  int num_callbacks = g_num_systick_callbacks;
+  CompilerBarrier();
+  for (int i = 0; i < num_callbacks; ++i) {
+    g_systick_callbacks[i]();
+  }
+}
+
+void AddIdleCallback(IdleCallback callback) {
+  if (g_num_idle_callbacks == kMaxIdleCallbacks) {
+    HandleError("Too many idle callbacks");
+    return;
+  }
+
+  ScopedInterruptMask mask;
+  g_idle_callbacks[g_num_idle_callbacks++] = callback;
+}
+
+void Idle() {
+  ScopedInterruptMask mask;
+  for (int i = 0; i < g_num_idle_callbacks; ++i) {
+    if (g_idle_callbacks[i]()) {
+      return;
+    }
+  }
+
+  // Interrupts that arrive while masked still wake us up.
+  WaitForInterrupt();
+}
+
+// Whole seconds and the microseconds after, for gettimeofday.
+void GetTimeOfDay(uint64_t* seconds, uint32_t* microseconds) {
+  uint64_t clocks = GetTimeClocks();
+  *seconds = g_seconds_converter.ClocksToUnits(clocks);
+  *microseconds = ClocksToMicroseconds(clocks - *seconds * g_ahb_freq);
 }
 
 }; // namespace Ostrich
@@ -96,17 +434,30 @@ void sys_tick_handler(void) {
   } else {
     ++Ostrich::g_systick_reloads_low;
   }
+
+  // Keep the cycle counter extension up to date even if nothing else reads
+  // the time for a while.
+  if (Ostrich::g_timebase == Ostrich::Timebase::kCycleCounter) {
+    Ostrich::GetTimeClocks();
+  }
+
+  Ostrich::RunSysTickCallbacks();
+}
+
+void tim7_isr(void) {
+  timer_clear_flag(TIM7, TIM_SR_UIF);
+  Ostrich::g_delay_timer_expired = true;
 }
 
 // Use GetTimeClocks to implement gettimeofday
 int _gettimeofday(struct timeval* tp, void* tzp)
 {
   (void)tzp;
-  uint64_t now = Ostrich::GetTimeClocks() * 1000000 / Ostrich::g_ahb_freq;
-  tp->tv_sec = now / 1000000;
-  tp->tv_usec = now - (tp->tv_sec * 1000000);
+  uint64_t seconds;
+  uint32_t microseconds;
+  Ostrich::GetTimeOfDay(&seconds, &microseconds);
+  tp->tv_sec = seconds;
+  tp->tv_usec = microseconds;
   return 0;
 }
 }
-
-
@@ -0,0 +1,87 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timer.h"
+
+namespace Ostrich {
+
+TimerManager::TimerManager() : in_use_(0) {}
+
+TimerManager::TimerAllocation TimerManager::AllocateTimer(uint32_t timer) {
+  const TimerInfo& info = GetTimerInfo(timer);
+  uint16_t timer_bit = 1 << TimerToIndex(timer);
+
+  if (in_use_ & timer_bit) {
+    HandleError(std::string(info.str_name) + " already in use");
+    LockUp();
+  }
+
+  in_use_ |= timer_bit;
+  rcc_periph_clock_enable(info.rcc);
+  rcc_periph_reset_pulse(info.rst);
+
+  return TimerAllocation(timer);
+}
+
+void TimerManager::DeallocateTimer(uint32_t timer) {
+  in_use_ &= ~(1 << TimerToIndex(timer));
+  rcc_periph_clock_disable(GetTimerInfo(timer).rcc);
+}
+
+/*static*/ uint32_t TimerManager::TimerClock(uint32_t timer) {
+  uint32_t apb_freq = GetTimerInfo(timer).apb == 1 ? g_apb1_freq : g_apb2_freq;
+  return apb_freq == g_ahb_freq ? apb_freq : (apb_freq * 2);
+}
+
+float TimerManager::TimerAllocation::SetUpdateFrequency(float frequency_hz) {
+  uint32_t timer_clock = TimerClock(timer_);
+  uint64_t max_period = Info().is_32bit ? 0x100000000ULL : 0x10000ULL;
+
+  // Total number of timer clocks per update, split into the smallest prescaler
+  // that makes the period fit, to get the finest resolution.
+  uint64_t total_clocks =
+      static_cast<uint64_t>(timer_clock / frequency_hz + 0.5f);
+  if (total_clocks < 1) {
+    total_clocks = 1;
+  }
+
+  uint64_t prescaler = (total_clocks - 1) / max_period + 1;
+  if (prescaler > 0x10000) {
+    HandleError(std::string(Info().str_name) + " can't go that slow");
+    prescaler = 0x10000;
+  }
+
+  uint64_t period = (total_clocks + prescaler / 2) / prescaler;
+  if (period < 1) {
+    period = 1;
+  } else if (period > max_period) {
+    period = max_period;
+  }
+
+  timer_set_prescaler(timer_, prescaler - 1);
+  timer_set_period(timer_, period - 1);
+
+  // Load the new prescaler now instead of at the next update. Note that this
+  // also produces a trigger output if SetTriggerOnUpdate() was called before.
+  timer_generate_event(timer_, TIM_EGR_UG);
+
+  return static_cast<float>(timer_clock) / (prescaler * period);
+}
+
+}; // namespace Ostrich
@@ -0,0 +1,274 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timer_wheel.h"
+
+namespace Ostrich {
+
+namespace {
+
+constexpr uint64_t kMaxWheelDelta =
+    (static_cast<uint64_t>(1) << (kWheelSlotBits * kWheelLevels)) - 1;
+
+} // namespace
+
+SoftwareTimer::SoftwareTimer(Callback callback, Context context)
+    : callback_(callback), context_(context), next_(nullptr), pprev_(nullptr),
+      next_deferred_(nullptr), pprev_deferred_(nullptr), expiry_tick_(0),
+      period_ticks_(0) {}
+
+SoftwareTimer::~SoftwareTimer() {
+  Cancel();
+}
+
+void SoftwareTimer::StartOneShot(Duration delay) {
+  TimerWheel& wheel = TimerWheel::GetInstance();
+  wheel.Schedule(this, wheel.DurationToTicks(delay), 0);
+}
+
+void SoftwareTimer::StartPeriodic(Duration period) {
+  TimerWheel& wheel = TimerWheel::GetInstance();
+  uint64_t period_ticks = wheel.DurationToTicks(period);
+  if (period_ticks == 0) {
+    period_ticks = 1;
+  }
+  wheel.Schedule(this, period_ticks, period_ticks);
+}
+
+void SoftwareTimer::Cancel() {
+  TimerWheel::GetInstance().Cancel(this);
+}
+
+TimerWheel::TimerWheel()
+    : slots_(), current_tick_(0), deferred_head_(nullptr),
+      deferred_tail_(&deferred_head_) {
+  if (g_systick_period == 0) {
+    HandleError("Software timers need SysTick");
+    return;
+  }
+
+  systick_period_ = ConstantDivider(g_systick_period);
+  AddSysTickCallback([this]() { Tick(); });
+
+  // Keep the main loop awake while there are deferred callbacks to run.
+  AddIdleCallback([this]() { return DeferredPending(); });
+}
+
+void TimerWheel::RunDeferred() {
+  while (true) {
+    SoftwareTimer* timer;
+    {
+      ScopedInterruptMask mask;
+      timer = deferred_head_;
+      if (timer == nullptr) {
+        return;
+      }
+      UnlinkDeferred(timer);
+    }
+
+    timer->callback_();
+  }
+}
+
+uint64_t TimerWheel::DurationToTicks(Duration duration) const {
+  uint64_t clocks = duration.InClocks();
+  uint64_t ticks = systick_period_.Divide(clocks);
+  if (ticks * systick_period_.Divisor() < clocks) {
+    ++ticks;
+  }
+  return ticks;
+}
+
+void TimerWheel::Schedule(SoftwareTimer* timer, uint64_t delay_ticks,
+                          uint64_t period_ticks) {
+  ScopedInterruptMask mask;
+
+  if (timer->pprev_ != nullptr) {
+    Unlink(timer);
+  }
+
+  // We may be anywhere in the current tick, so wait one more to make sure we
+  // don't fire early.
+  timer->expiry_tick_ = current_tick_ + delay_ticks + 1;
+  timer->period_ticks_ = period_ticks;
+  Insert(timer);
+}
+
+void TimerWheel::Cancel(SoftwareTimer* timer) {
+  ScopedInterruptMask mask;
+
+  if (timer->pprev_ != nullptr) {
+    Unlink(timer);
+  }
+
+  if (timer->pprev_deferred_ != nullptr) {
+    UnlinkDeferred(timer);
+  }
+}
+
+void TimerWheel::Tick() {
+  uint64_t tick = current_tick_ + 1;
+  int index = tick & (kWheelSlots - 1);
+
+  // When level 0 wraps around, move the timers in the next slot of level 1
+  // down, and so on up the levels. This happens before current_tick_ is
+  // updated, so timers expiring at this tick end up in slots_[0][index].
+  if (index == 0) {
+    for (int level = 1; level < kWheelLevels; ++level) {
+      int slot = (tick >> (kWheelSlotBits * level)) & (kWheelSlots - 1);
+      Cascade(level, slot);
+      if (slot != 0) {
+        break;
+      }
+    }
+  }
+
+  SoftwareTimer* expired;
+  {
+    ScopedInterruptMask mask;
+    current_tick_ = tick;
+    expired = slots_[0][index];
+    slots_[0][index] = nullptr;
+    if (expired != nullptr) {
+      expired->pprev_ = &expired;
+    }
+  }
+
+  // Interrupts are only masked while we touch the lists, not during callbacks,
+  // which may start or cancel any timer, including ones still on this list.
+  while (true) {
+    SoftwareTimer* timer;
+    bool run_now;
+    {
+      ScopedInterruptMask mask;
+      timer = expired;
+      if (timer == nullptr) {
+        return;
+      }
+
+      Unlink(timer);
+      run_now = timer->context_ == SoftwareTimer::Context::kInterrupt;
+      Expire(timer);
+    }
+
+    if (run_now) {
+      timer->callback_();
+    }
+  }
+}
+
+void TimerWheel::Insert(SoftwareTimer* timer) {
+  uint64_t next_tick = current_tick_ + 1;
+  uint64_t expiry = timer->expiry_tick_;
+
+  // Already due. This happens when a periodic timer falls more than a period
+  // behind.
+  if (expiry < next_tick) {
+    expiry = next_tick;
+  }
+
+  uint64_t delta = expiry - next_tick;
+  if (delta > kMaxWheelDelta) {
+    delta = kMaxWheelDelta;
+    expiry = next_tick + delta;
+  }
+
+  int level = 0;
+  while (level < (kWheelLevels - 1) &&
+         delta >= (static_cast<uint64_t>(1) << (kWheelSlotBits * (level + 1)))) {
+    ++level;
+  }
+
+  int slot = (expiry >> (kWheelSlotBits * level)) & (kWheelSlots - 1);
+  Link(&slots_[level][slot], timer);
+}
+
+void TimerWheel::Cascade(int level, int slot) {
+  SoftwareTimer* timers;
+  {
+    ScopedInterruptMask mask;
+    timers = slots_[level][slot];
+    slots_[level][slot] = nullptr;
+    if (timers != nullptr) {
+      timers->pprev_ = &timers;
+    }
+  }
+
+  // One at a time, so a slot with thousands of timers doesn't mask
+  // interrupts for long.
+  while (true) {
+    ScopedInterruptMask mask;
+    SoftwareTimer* timer = timers;
+    if (timer == nullptr) {
+      return;
+    }
+    Unlink(timer);
+    Insert(timer);
+  }
+}
+
+void TimerWheel::Expire(SoftwareTimer* timer) {
+  if (timer->period_ticks_ != 0) {
+    timer->expiry_tick_ += timer->period_ticks_;
+    Insert(timer);
+  }
+
+  if (timer->context_ == SoftwareTimer::Context::kDeferred &&
+      timer->pprev_deferred_ == nullptr) {
+    LinkDeferred(timer);
+  }
+}
+
+/*static*/ void TimerWheel::Link(SoftwareTimer** head, SoftwareTimer* timer) {
+  timer->next_ = *head;
+  if (*head != nullptr) {
+    (*head)->pprev_ = &timer->next_;
+  }
+  *head = timer;
+  timer->pprev_ = head;
+}
+
+/*static*/ void TimerWheel::Unlink(SoftwareTimer* timer) {
+  *timer->pprev_ = timer->next_;
+  if (timer->next_ != nullptr) {
+    timer->next_->pprev_ = timer->pprev_;
+  }
+  timer->next_ = nullptr;
+  timer->pprev_ = nullptr;
+}
+
+void TimerWheel::LinkDeferred(SoftwareTimer* timer) {
+  timer->next_deferred_ = nullptr;
+  timer->pprev_deferred_ = deferred_tail_;
+  *deferred_tail_ = timer;
+  deferred_tail_ = &timer->next_deferred_;
+}
+
+void TimerWheel::UnlinkDeferred(SoftwareTimer* timer) {
+  *timer->pprev_deferred_ = timer->next_deferred_;
+  if (timer->next_deferred_ != nullptr) {
+    timer->next_deferred_->pprev_deferred_ = timer->pprev_deferred_;
+  } else {
+    deferred_tail_ = timer->pprev_deferred_;
+  }
+  timer->next_deferred_ = nullptr;
+  timer->pprev_deferred_ = nullptr;
+}
+
+}; // namespace Ostrich
@@ -0,0 +1,289 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "usb/adc_stream.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "ostrich.h"
+#include "systick.h"
+#include "usb/common.h"
+
+namespace {
+
+// There should only ever be one USB function (enforced by USBManager).
+Ostrich::USBADCStream* g_usb_adc_stream = nullptr;
+
+constexpr uint8_t kStreamingEndpoint = 0x81;
+
+} // namespace
+
+namespace Ostrich {
+
+USBADCStream::USBADCStream(uint16_t vid, uint16_t pid, uint16_t current_ma,
+                           const char* manufacturer, const char* product)
+    : pin_allocation_dm_(GPIOManager::GetInstance().AllocatePin(PIN_A11)),
+      pin_allocation_dp_(GPIOManager::GetInstance().AllocatePin(PIN_A12)),
+      usbd_dev_(nullptr),
+      dev_descriptor_(GetDeviceDescriptor(vid, pid)),
+      data_interface_(GetDataInterface()),
+      config_descriptor_(GetConfigDescriptor(current_ma)),
+      num_channels_(1),
+      sample_rate_hz_(0.0f),
+      streaming_(false),
+      endpoint_busy_(false),
+      sequence_(0),
+      block_(nullptr),
+      block_bytes_(0),
+      block_pos_(0),
+      first_packet_len_(0) {
+  ZeroInit(&stats_);
+
+  USBManager::GetInstance().AllocateUSB([this]() { Poll(); });
+
+  pin_allocation_dm_.SetAF(10);
+  pin_allocation_dp_.SetAF(10);
+
+  desig_get_unique_id_as_dfu(unique_id_);
+
+  usb_strings_[0] = manufacturer;
+  usb_strings_[1] = product;
+  usb_strings_[2] = unique_id_;
+
+  usbd_dev_ = usbd_init(&otgfs_usb_driver, &dev_descriptor_,
+                        &config_descriptor_, usb_strings_, 3, control_buffer_,
+                        sizeof(control_buffer_));
+
+  usbd_register_set_config_callback(usbd_dev_, SetConfigCallback);
+
+  g_usb_adc_stream = this;
+
+  nvic_enable_irq(NVIC_OTG_FS_IRQ);
+}
+
+USBADCStream::~USBADCStream() {
+  nvic_disable_irq(NVIC_OTG_FS_IRQ);
+  rcc_periph_clock_disable(RCC_OTGFS);
+  g_usb_adc_stream = nullptr;
+  USBManager::GetInstance().DeallocateUSB();
+}
+
+void USBADCStream::SetSource(ReleaseCallback release, uint8_t num_channels) {
+  ScopedIRQLock irq_lock(NVIC_OTG_FS_IRQ);
+  release_ = release;
+  num_channels_ = num_channels;
+}
+
+void USBADCStream::QueueBlock(const uint16_t* block, std::size_t len) {
+  ScopedIRQLock irq_lock(NVIC_OTG_FS_IRQ);
+
+  uint32_t sequence = sequence_++;
+
+  if (!streaming_) {
+    ++stats_.frames_dropped;
+    if (release_) {
+      release_(block);
+    }
+    return;
+  }
+
+  if (block_) {
+    // The source is already overwriting it.
+    ++stats_.frames_truncated;
+    FinishBlock();
+  }
+
+  ADCStreamHeader header;
+  header.magic = kADCStreamMagic;
+  header.sequence = sequence;
+  header.timestamp_us = static_cast<uint32_t>(GetTimeMicroseconds());
+  header.sample_rate_hz = static_cast<uint32_t>(sample_rate_hz_ + 0.5f);
+  header.num_samples = len;
+  header.num_channels = num_channels_;
+  header.reserved = 0;
+
+  block_ = block;
+  block_bytes_ = len * sizeof(uint16_t);
+
+  // The header goes out with as many samples as fit in the first packet, so
+  // we don't waste a short packet per frame.
+  block_pos_ = std::min(block_bytes_, kPacketSize - sizeof(header));
+  std::memcpy(first_packet_, &header, sizeof(header));
+  std::memcpy(first_packet_ + sizeof(header), block_, block_pos_);
+  first_packet_len_ = sizeof(header) + block_pos_;
+
+  SendNextPacket();
+}
+
+USBADCStream::Stats USBADCStream::GetStats() const {
+  ScopedIRQLock irq_lock(NVIC_OTG_FS_IRQ);
+  return stats_;
+}
+
+void USBADCStream::SendNextPacket() {
+  if (endpoint_busy_ || !block_) {
+    return;
+  }
+
+  const void* data;
+  std::size_t len;
+  if (first_packet_len_) {
+    data = first_packet_;
+    len = first_packet_len_;
+  } else {
+    data = reinterpret_cast<const uint8_t*>(block_) + block_pos_;
+    len = std::min(block_bytes_ - block_pos_, kPacketSize);
+  }
+
+  if (usbd_ep_write_packet(usbd_dev_, kStreamingEndpoint, data, len) != len) {
+    // Shouldn't happen since we track the endpoint state ourselves, but if it
+    // does, we'll try again on the next transfer complete.
+    return;
+  }
+
+  endpoint_busy_ = true;
+  USBManager::GetInstance().RecordPacketIn(kStreamingEndpoint, len);
+
+  if (first_packet_len_) {
+    first_packet_len_ = 0;
+  } else {
+    block_pos_ += len;
+  }
+
+  // The data is in the FIFO now, so the source can have the block back.
+  if (block_pos_ == block_bytes_) {
+    ++stats_.frames_sent;
+    FinishBlock();
+  }
+}
+
+void USBADCStream::FinishBlock() {
+  if (release_) {
+    release_(block_);
+  }
+  block_ = nullptr;
+  first_packet_len_ = 0;
+}
+
+/*static*/ void USBADCStream::SetConfigCallback(usbd_device* usbd_dev,
+                                                uint16_t /*wValue*/) {
+  usbd_ep_setup(usbd_dev, kStreamingEndpoint, USB_ENDPOINT_ATTR_BULK,
+                kPacketSize, DataTxCallback);
+  usbd_register_control_callback(usbd_dev,
+                                 USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                                 USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+                                 ControlRequestCallback);
+  g_usb_adc_stream->endpoint_busy_ = false;
+}
+
+/*static*/ void USBADCStream::DataTxCallback(usbd_device* /*usbd_dev*/,
+                                             uint8_t /*endpoint*/) {
+  g_usb_adc_stream->endpoint_busy_ = false;
+  g_usb_adc_stream->SendNextPacket();
+}
+
+/*static*/ usbd_request_return_codes USBADCStream::ControlRequestCallback(
+    usbd_device* /*usbd_dev*/, usb_setup_data* req, uint8_t** /*buf*/,
+    uint16_t* /*len*/,
+    void (**/*complete*/)(usbd_device* usbd_dev, usb_setup_data* req)) {
+  switch (req->bRequest) {
+    case kADCStreamRequestStart:
+      g_usb_adc_stream->streaming_ = true;
+      return USBD_REQ_HANDLED;
+    case kADCStreamRequestStop:
+      g_usb_adc_stream->streaming_ = false;
+      return USBD_REQ_HANDLED;
+  }
+
+  return USBD_REQ_NOTSUPP;
+}
+
+usb_device_descriptor USBADCStream::GetDeviceDescriptor(uint16_t vid,
+                                                        uint16_t pid) {
+  usb_device_descriptor dev;
+  ZeroInit(&dev);
+  dev.bLength = USB_DT_DEVICE_SIZE;
+  dev.bDescriptorType = USB_DT_DEVICE;
+  dev.bcdUSB = 0x0200;
+  dev.bDeviceClass = 0;  // Defined at interface level.
+  dev.bDeviceSubClass = 0;
+  dev.bDeviceProtocol = 0;
+  dev.bMaxPacketSize0 = 64;
+  dev.idVendor = vid;
+  dev.idProduct = pid;
+  dev.bcdDevice = 0x0200;
+  dev.iManufacturer = 1;
+  dev.iProduct = 2;
+  dev.iSerialNumber = 3;
+  dev.bNumConfigurations = 1;
+  return dev;
+}
+
+usb_config_descriptor USBADCStream::GetConfigDescriptor(
+    uint32_t max_current_ma) {
+  usb_config_descriptor config;
+  ZeroInit(&config);
+  config.bLength = USB_DT_CONFIGURATION_SIZE;
+  config.bDescriptorType = USB_DT_CONFIGURATION;
+  config.wTotalLength = 0;
+  config.bNumInterfaces = 1;
+  config.bConfigurationValue = 1;
+  config.iConfiguration = 0;
+  config.bmAttributes = 0x80;
+  config.bMaxPower = max_current_ma / 2;
+
+  ZeroInit(&interfaces_[0]);
+  interfaces_[0].num_altsetting = 1;
+  interfaces_[0].altsetting = &data_interface_;
+
+  config.interface = interfaces_;
+  return config;
+}
+
+usb_interface_descriptor USBADCStream::GetDataInterface() {
+  usb_interface_descriptor iface;
+  ZeroInit(&iface);
+  iface.bLength = USB_DT_INTERFACE_SIZE;
+  iface.bDescriptorType = USB_DT_INTERFACE;
+  iface.bInterfaceNumber = 0;
+  iface.bAlternateSetting = 0;
+  iface.bNumEndpoints = 1;
+  iface.bInterfaceClass = USB_CLASS_VENDOR;
+  iface.bInterfaceSubClass = 0;
+  iface.bInterfaceProtocol = 0;
+  iface.iInterface = 0;
+
+  ZeroInit(&data_endpoints_[0]);
+  data_endpoints_[0].bLength = USB_DT_ENDPOINT_SIZE;
+  data_endpoints_[0].bDescriptorType = USB_DT_ENDPOINT;
+  data_endpoints_[0].bEndpointAddress = kStreamingEndpoint;
+  data_endpoints_[0].bmAttributes = USB_ENDPOINT_ATTR_BULK;
+  data_endpoints_[0].wMaxPacketSize = kPacketSize;
+  data_endpoints_[0].bInterval = 0;
+
+  iface.endpoint = data_endpoints_;
+  return iface;
+}
+
+} // namespace Ostrich
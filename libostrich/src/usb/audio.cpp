@@ -0,0 +1,472 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "usb/audio.h"
+
+#include <algorithm>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/otg_fs.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "ostrich.h"
+#include "usb/common.h"
+
+namespace {
+
+// There should only ever be one USB function (enforced by USBManager).
+Ostrich::USBAudioInput* g_usb_audio = nullptr;
+
+// Audio Class 1.0 codes (Audio Devices 1.0, appendix A).
+constexpr uint8_t kAudioSubclassControl = 0x01;
+constexpr uint8_t kAudioSubclassStreaming = 0x02;
+constexpr uint8_t kCSInterface = 0x24;
+constexpr uint8_t kCSEndpoint = 0x25;
+constexpr uint8_t kACHeader = 0x01;
+constexpr uint8_t kACInputTerminal = 0x02;
+constexpr uint8_t kACOutputTerminal = 0x03;
+constexpr uint8_t kASGeneral = 0x01;
+constexpr uint8_t kASFormatType = 0x02;
+constexpr uint8_t kEPGeneral = 0x01;
+constexpr uint8_t kFormatTypeI = 0x01;
+constexpr uint16_t kFormatPCM = 0x0001;
+constexpr uint16_t kTerminalMicrophone = 0x0201;
+constexpr uint16_t kTerminalUSBStreaming = 0x0101;
+constexpr uint8_t kInputTerminalID = 1;
+constexpr uint8_t kOutputTerminalID = 2;
+constexpr uint8_t kSetCur = 0x01;
+constexpr uint8_t kGetCur = 0x81;
+constexpr uint8_t kSamplingFreqControl = 0x01;
+
+constexpr uint8_t kStreamingInterface = 1;
+constexpr uint8_t kStreamingEndpoint = 0x81;
+
+// OTG FS isochronous IN endpoints transmit only in even or odd frames, as
+// selected by these (write-only) DIEPCTL bits (RM0410 42.15.4).
+constexpr uint32_t kDIEPCTLSetEvenFrame = 1 << 28;
+constexpr uint32_t kDIEPCTLSetOddFrame = 1 << 29;
+
+// LSB of the frame number of the last SOF in DSTS.
+constexpr uint32_t kDSTSFrameNumberLSB = 1 << 8;
+
+} // namespace
+
+namespace Ostrich {
+
+USBAudioInput::USBAudioInput(uint32_t sample_rate, uint8_t num_channels,
+                             uint16_t vid, uint16_t pid, uint16_t current_ma,
+                             const char* manufacturer, const char* product)
+    : sample_rate_(sample_rate),
+      num_channels_(num_channels),
+      pin_allocation_dm_(GPIOManager::GetInstance().AllocatePin(PIN_A11)),
+      pin_allocation_dp_(GPIOManager::GetInstance().AllocatePin(PIN_A12)),
+      usbd_dev_(nullptr),
+      dev_descriptor_(GetDeviceDescriptor(vid, pid)),
+      ac_descriptors_(GetAudioControlDescriptors()),
+      as_descriptors_(GetAudioStreamingDescriptors()),
+      iso_endpoint_descriptor_(GetISOEndpointDescriptor()),
+      control_interface_(GetControlInterface()),
+      streaming_altsetting_(0),
+      config_descriptor_(GetConfigDescriptor(current_ma)),
+      streaming_(false),
+      frac_accumulator_(0),
+      window_sofs_(0),
+      window_frames_(0) {
+  ZeroInit(&stats_);
+
+  if (num_channels_ == 0 || num_channels_ > kADCChunkSize ||
+      MaxPacketSize() > kMaxPacketSize || FIFOPacketSize() > kTxFIFOSize) {
+    HandleError("USB audio sample rate/channel count too high");
+  }
+
+  stats_.target_fill_level = kRingSize / num_channels_ / 2;
+
+  SetupStreamingInterfaces();
+
+  USBManager::GetInstance().AllocateUSB([this]() { Poll(); });
+
+  pin_allocation_dm_.SetAF(10);
+  pin_allocation_dp_.SetAF(10);
+
+  desig_get_unique_id_as_dfu(unique_id_);
+
+  usb_strings_[0] = manufacturer;
+  usb_strings_[1] = product;
+  usb_strings_[2] = unique_id_;
+
+  usbd_dev_ = usbd_init(&otgfs_usb_driver, &dev_descriptor_,
+                        &config_descriptor_, usb_strings_, 3, control_buffer_,
+                        sizeof(control_buffer_));
+
+  usbd_register_set_config_callback(usbd_dev_, SetConfigCallback);
+  usbd_register_set_altsetting_callback(usbd_dev_, SetAltsettingCallback);
+  usbd_register_sof_callback(usbd_dev_, SOFCallback);
+
+  // Not all versions of the dwc driver unmask SOF when a callback is
+  // registered.
+  OTG_FS_GINTMSK |= OTG_GINTMSK_SOFM;
+
+  g_usb_audio = this;
+
+  nvic_enable_irq(NVIC_OTG_FS_IRQ);
+}
+
+USBAudioInput::~USBAudioInput() {
+  nvic_disable_irq(NVIC_OTG_FS_IRQ);
+  rcc_periph_clock_disable(RCC_OTGFS);
+  g_usb_audio = nullptr;
+  USBManager::GetInstance().DeallocateUSB();
+}
+
+std::size_t USBAudioInput::PushSamples(const int16_t* samples,
+                                       std::size_t len) {
+  std::size_t pushed = sample_ring_.Push(samples, len, num_channels_);
+  stats_.overrun_samples += len - pushed;
+  return pushed;
+}
+
+std::size_t USBAudioInput::PushADCSamples(const uint16_t* samples,
+                                          std::size_t len) {
+  int16_t converted[kADCChunkSize];
+
+  // Chunks must be whole frames, or a full ring would split a frame between
+  // one chunk and the next.
+  const std::size_t max_chunk = kADCChunkSize - kADCChunkSize % num_channels_;
+
+  std::size_t pushed = 0;
+  while (pushed < len) {
+    std::size_t chunk_size = std::min(len - pushed, max_chunk);
+    for (std::size_t i = 0; i < chunk_size; ++i) {
+      converted[i] = (static_cast<int32_t>(samples[pushed + i]) - 2048) << 4;
+    }
+    std::size_t chunk_pushed = PushSamples(converted, chunk_size);
+    pushed += chunk_pushed;
+    if (chunk_pushed < chunk_size) {
+      // PushSamples() already counted the rest as overrun.
+      stats_.overrun_samples += len - pushed - (chunk_size - chunk_pushed);
+      break;
+    }
+  }
+  return pushed;
+}
+
+USBAudioInput::Stats USBAudioInput::GetStats() const {
+  ScopedIRQLock irq_lock(NVIC_OTG_FS_IRQ);
+  Stats stats = stats_;
+  stats.fill_level = FillLevel();
+  return stats;
+}
+
+void USBAudioInput::SendPacket() {
+  // Nominal frames for this USB frame, with the fractional part accumulated.
+  std::size_t frames = sample_rate_ / 1000;
+  frac_accumulator_ += sample_rate_ % 1000;
+  if (frac_accumulator_ >= 1000) {
+    frac_accumulator_ -= 1000;
+    ++frames;
+  }
+
+  // Nudge the rate towards keeping the ring half full. One frame per packet is
+  // well within what hosts tolerate from an asynchronous source.
+  std::size_t fill = FillLevel();
+  std::size_t target = stats_.target_fill_level;
+  if (fill > target + frames) {
+    ++frames;
+    ++stats_.rate_increases;
+  } else if (fill + frames < target && frames > 0) {
+    --frames;
+    ++stats_.rate_decreases;
+  }
+
+  // We can only ever send one more than nominal (that's what MaxPacketSize()
+  // allows for).
+  frames = std::min<std::size_t>(frames, sample_rate_ / 1000 + 1);
+
+  if (fill < frames) {
+    frames = fill;
+    ++stats_.underruns;
+  }
+
+  std::size_t samples =
+      sample_ring_.Pop(packet_buf_, frames * num_channels_);
+
+  // Target the next frame.
+  if (OTG_FS_DSTS & kDSTSFrameNumberLSB) {
+    OTG_FS_DIEPCTL(kStreamingEndpoint & 0x7f) |= kDIEPCTLSetEvenFrame;
+  } else {
+    OTG_FS_DIEPCTL(kStreamingEndpoint & 0x7f) |= kDIEPCTLSetOddFrame;
+  }
+
+  uint16_t bytes = samples * sizeof(int16_t);
+  if (usbd_ep_write_packet(usbd_dev_, kStreamingEndpoint, packet_buf_,
+                           bytes) != bytes) {
+    ++stats_.missed_frames;
+    return;
+  }
+
+  USBManager::GetInstance().RecordPacketIn(kStreamingEndpoint, bytes);
+  stats_.frames_sent += frames;
+  window_frames_ += frames;
+}
+
+/*static*/ void USBAudioInput::SOFCallback() {
+  USBManager::GetInstance().RecordSOF();
+
+  USBAudioInput* self = g_usb_audio;
+  if (!self || !self->streaming_) {
+    return;
+  }
+
+  ++self->stats_.sof_count;
+  if ((self->stats_.sof_count - self->window_sofs_) >= 1000) {
+    self->stats_.measured_sample_rate = self->window_frames_;
+    self->window_sofs_ = self->stats_.sof_count;
+    self->window_frames_ = 0;
+  }
+
+  self->SendPacket();
+}
+
+/*static*/ void USBAudioInput::SetConfigCallback(usbd_device* usbd_dev,
+                                                 uint16_t /*wValue*/) {
+  usbd_ep_setup(usbd_dev, kStreamingEndpoint, USB_ENDPOINT_ATTR_ISOCHRONOUS,
+                g_usb_audio->FIFOPacketSize(), nullptr);
+  usbd_register_control_callback(usbd_dev,
+                                 USB_REQ_TYPE_CLASS | USB_REQ_TYPE_ENDPOINT,
+                                 USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+                                 ControlRequestCallback);
+}
+
+/*static*/ void USBAudioInput::SetAltsettingCallback(usbd_device* /*usbd_dev*/,
+                                                     uint16_t wIndex,
+                                                     uint16_t wValue) {
+  if (wIndex == kStreamingInterface) {
+    g_usb_audio->streaming_ = (wValue == 1);
+    g_usb_audio->frac_accumulator_ = 0;
+    g_usb_audio->window_sofs_ = g_usb_audio->stats_.sof_count;
+    g_usb_audio->window_frames_ = 0;
+  }
+}
+
+/*static*/ usbd_request_return_codes USBAudioInput::ControlRequestCallback(
+    usbd_device* /*usbd_dev*/, usb_setup_data* req, uint8_t** buf,
+    uint16_t* len,
+    void (**/*complete*/)(usbd_device* usbd_dev, usb_setup_data* req)) {
+  // The only control we have is the (fixed) sampling frequency on the
+  // streaming endpoint. Hosts like to set it before streaming, so accept
+  // any SET_CUR and report the real rate on GET_CUR.
+  if ((req->wIndex & 0xff) != kStreamingEndpoint ||
+      (req->wValue >> 8) != kSamplingFreqControl) {
+    return USBD_REQ_NOTSUPP;
+  }
+
+  switch (req->bRequest) {
+    case kSetCur:
+      return USBD_REQ_HANDLED;
+    case kGetCur: {
+      uint32_t rate = g_usb_audio->sample_rate_;
+      (*buf)[0] = rate & 0xff;
+      (*buf)[1] = (rate >> 8) & 0xff;
+      (*buf)[2] = (rate >> 16) & 0xff;
+      *len = std::min<uint16_t>(*len, 3);
+      return USBD_REQ_HANDLED;
+    }
+  }
+
+  return USBD_REQ_NOTSUPP;
+}
+
+usb_device_descriptor USBAudioInput::GetDeviceDescriptor(uint16_t vid,
+                                                         uint16_t pid) {
+  usb_device_descriptor dev;
+  ZeroInit(&dev);
+  dev.bLength = USB_DT_DEVICE_SIZE;
+  dev.bDescriptorType = USB_DT_DEVICE;
+  dev.bcdUSB = 0x0110;
+  dev.bDeviceClass = 0;  // Defined at interface level.
+  dev.bDeviceSubClass = 0;
+  dev.bDeviceProtocol = 0;
+  dev.bMaxPacketSize0 = 64;
+  dev.idVendor = vid;
+  dev.idProduct = pid;
+  dev.bcdDevice = 0x0200;
+  dev.iManufacturer = 1;
+  dev.iProduct = 2;
+  dev.iSerialNumber = 3;
+  dev.bNumConfigurations = 1;
+  return dev;
+}
+
+usb_config_descriptor USBAudioInput::GetConfigDescriptor(
+    uint32_t max_current_ma) {
+  usb_config_descriptor config;
+  ZeroInit(&config);
+  config.bLength = USB_DT_CONFIGURATION_SIZE;
+  config.bDescriptorType = USB_DT_CONFIGURATION;
+  config.wTotalLength = 0;
+  config.bNumInterfaces = 2;
+  config.bConfigurationValue = 1;
+  config.iConfiguration = 0;
+  config.bmAttributes = 0x80;
+  config.bMaxPower = max_current_ma / 2;
+
+  ZeroInit(&interfaces_[0]);
+  ZeroInit(&interfaces_[1]);
+  interfaces_[0].num_altsetting = 1;
+  interfaces_[0].altsetting = &control_interface_;
+  interfaces_[1].num_altsetting = 2;
+  interfaces_[1].altsetting = streaming_interfaces_;
+  interfaces_[1].cur_altsetting = &streaming_altsetting_;
+
+  config.interface = interfaces_;
+  return config;
+}
+
+usb_interface_descriptor USBAudioInput::GetControlInterface() {
+  usb_interface_descriptor iface;
+  ZeroInit(&iface);
+  iface.bLength = USB_DT_INTERFACE_SIZE;
+  iface.bDescriptorType = USB_DT_INTERFACE;
+  iface.bInterfaceNumber = 0;
+  iface.bAlternateSetting = 0;
+  iface.bNumEndpoints = 0;
+  iface.bInterfaceClass = USB_CLASS_AUDIO;
+  iface.bInterfaceSubClass = kAudioSubclassControl;
+  iface.bInterfaceProtocol = 0;
+  iface.iInterface = 0;
+
+  iface.extra = &ac_descriptors_;
+  iface.extralen = sizeof(AudioControlDescriptors);
+  return iface;
+}
+
+void USBAudioInput::SetupStreamingInterfaces() {
+  // Alternate setting 0 is the zero bandwidth setting the host selects when
+  // it's not capturing.
+  for (int alt = 0; alt < 2; ++alt) {
+    usb_interface_descriptor& iface = streaming_interfaces_[alt];
+    ZeroInit(&iface);
+    iface.bLength = USB_DT_INTERFACE_SIZE;
+    iface.bDescriptorType = USB_DT_INTERFACE;
+    iface.bInterfaceNumber = kStreamingInterface;
+    iface.bAlternateSetting = alt;
+    iface.bNumEndpoints = alt;
+    iface.bInterfaceClass = USB_CLASS_AUDIO;
+    iface.bInterfaceSubClass = kAudioSubclassStreaming;
+    iface.bInterfaceProtocol = 0;
+    iface.iInterface = 0;
+  }
+
+  // We use the 7 byte standard endpoint descriptor (without bRefresh and
+  // bSynchAddress) because that's what libopencm3 knows how to serialize.
+  // Both are 0 for us anyways, and hosts don't mind.
+  ZeroInit(&streaming_endpoints_[0]);
+  streaming_endpoints_[0].bLength = USB_DT_ENDPOINT_SIZE;
+  streaming_endpoints_[0].bDescriptorType = USB_DT_ENDPOINT;
+  streaming_endpoints_[0].bEndpointAddress = kStreamingEndpoint;
+  streaming_endpoints_[0].bmAttributes =
+      USB_ENDPOINT_ATTR_ISOCHRONOUS | USB_ENDPOINT_ATTR_ASYNC;
+  streaming_endpoints_[0].wMaxPacketSize = MaxPacketSize();
+  streaming_endpoints_[0].bInterval = 1;
+  streaming_endpoints_[0].extra = &iso_endpoint_descriptor_;
+  streaming_endpoints_[0].extralen = sizeof(ISOEndpointDescriptor);
+
+  streaming_interfaces_[1].endpoint = streaming_endpoints_;
+  streaming_interfaces_[1].extra = &as_descriptors_;
+  streaming_interfaces_[1].extralen = sizeof(AudioStreamingDescriptors);
+}
+
+USBAudioInput::AudioControlDescriptors
+USBAudioInput::GetAudioControlDescriptors() {
+  AudioControlDescriptors desc;
+  ZeroInit(&desc);
+
+  desc.header.bLength = sizeof(ACHeaderDescriptor);
+  desc.header.bDescriptorType = kCSInterface;
+  desc.header.bDescriptorSubtype = kACHeader;
+  desc.header.bcdADC = 0x0100;
+  desc.header.wTotalLength = sizeof(AudioControlDescriptors);
+  desc.header.bInCollection = 1;
+  desc.header.baInterfaceNr = kStreamingInterface;
+
+  desc.input_terminal.bLength = sizeof(InputTerminalDescriptor);
+  desc.input_terminal.bDescriptorType = kCSInterface;
+  desc.input_terminal.bDescriptorSubtype = kACInputTerminal;
+  desc.input_terminal.bTerminalID = kInputTerminalID;
+  desc.input_terminal.wTerminalType = kTerminalMicrophone;
+  desc.input_terminal.bAssocTerminal = 0;
+  desc.input_terminal.bNrChannels = num_channels_;
+  desc.input_terminal.wChannelConfig = 0;  // No spatial locations.
+  desc.input_terminal.iChannelNames = 0;
+  desc.input_terminal.iTerminal = 0;
+
+  desc.output_terminal.bLength = sizeof(OutputTerminalDescriptor);
+  desc.output_terminal.bDescriptorType = kCSInterface;
+  desc.output_terminal.bDescriptorSubtype = kACOutputTerminal;
+  desc.output_terminal.bTerminalID = kOutputTerminalID;
+  desc.output_terminal.wTerminalType = kTerminalUSBStreaming;
+  desc.output_terminal.bAssocTerminal = 0;
+  desc.output_terminal.bSourceID = kInputTerminalID;
+  desc.output_terminal.iTerminal = 0;
+
+  return desc;
+}
+
+USBAudioInput::AudioStreamingDescriptors
+USBAudioInput::GetAudioStreamingDescriptors() {
+  AudioStreamingDescriptors desc;
+  ZeroInit(&desc);
+
+  desc.general.bLength = sizeof(ASGeneralDescriptor);
+  desc.general.bDescriptorType = kCSInterface;
+  desc.general.bDescriptorSubtype = kASGeneral;
+  desc.general.bTerminalLink = kOutputTerminalID;
+  desc.general.bDelay = 1;
+  desc.general.wFormatTag = kFormatPCM;
+
+  desc.format.bLength = sizeof(FormatTypeIDescriptor);
+  desc.format.bDescriptorType = kCSInterface;
+  desc.format.bDescriptorSubtype = kASFormatType;
+  desc.format.bFormatType = kFormatTypeI;
+  desc.format.bNrChannels = num_channels_;
+  desc.format.bSubframeSize = sizeof(int16_t);
+  desc.format.bBitResolution = 16;
+  desc.format.bSamFreqType = 1;
+  desc.format.tSamFreq[0] = sample_rate_ & 0xff;
+  desc.format.tSamFreq[1] = (sample_rate_ >> 8) & 0xff;
+  desc.format.tSamFreq[2] = (sample_rate_ >> 16) & 0xff;
+
+  return desc;
+}
+
+USBAudioInput::ISOEndpointDescriptor
+USBAudioInput::GetISOEndpointDescriptor() {
+  ISOEndpointDescriptor desc;
+  ZeroInit(&desc);
+  desc.bLength = sizeof(ISOEndpointDescriptor);
+  desc.bDescriptorType = kCSEndpoint;
+  desc.bDescriptorSubtype = kEPGeneral;
+  desc.bmAttributes = 0x01;  // Sampling frequency control.
+  desc.bLockDelayUnits = 0;
+  desc.wLockDelay = 0;
+  return desc;
+}
+
+} // namespace Ostrich
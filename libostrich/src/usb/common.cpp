@@ -0,0 +1,78 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "usb/common.h"
+
+#include <algorithm>
+
+#include <libopencm3/stm32/otg_fs.h>
+
+extern "C" {
+void otg_fs_isr() {
+  Ostrich::USBManager::GetInstance().InvokeCallback();
+}
+}
+
+namespace {
+
+void SOFCallback() {
+  Ostrich::USBManager::GetInstance().RecordSOF();
+}
+
+} // namespace
+
+namespace Ostrich {
+
+void USBManager::EnableSOFCounting(usbd_device* usbd_dev) {
+  usbd_register_sof_callback(usbd_dev, SOFCallback);
+
+  // Not all versions of the dwc driver unmask SOF when a callback is
+  // registered.
+  OTG_FS_GINTMSK |= OTG_GINTMSK_SOFM;
+}
+
+/*static*/ void USBManager::RegisterStatsVendorRequest(usbd_device* usbd_dev) {
+  usbd_register_control_callback(usbd_dev,
+                                 USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+                                 USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+                                 StatsRequestCallback);
+}
+
+/*static*/ usbd_request_return_codes USBManager::StatsRequestCallback(
+    usbd_device* /*usbd_dev*/, usb_setup_data* req, uint8_t** buf,
+    uint16_t* len,
+    void (**/*complete*/)(usbd_device* usbd_dev, usb_setup_data* req)) {
+  switch (req->bRequest) {
+    case kUSBVendorRequestGetStats: {
+      // We are already in the OTG FS ISR, so the lock in GetStats() is a
+      // no-op, but harmless.
+      USBStats stats = GetInstance().GetStats();
+      *len = std::min<uint16_t>(*len, sizeof(stats));
+      std::memcpy(*buf, &stats, *len);
+      return USBD_REQ_HANDLED;
+    }
+    case kUSBVendorRequestResetStats:
+      GetInstance().ResetStats();
+      return USBD_REQ_HANDLED;
+  }
+
+  return USBD_REQ_NOTSUPP;
+}
+
+} // namespace Ostrich
@@ -0,0 +1,658 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "usb/mass_storage.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "ostrich.h"
+#include "usb/common.h"
+
+namespace {
+
+// There should only ever be one USB function (enforced by USBManager).
+Ostrich::USBMassStorage* g_usb_msc = nullptr;
+
+constexpr uint8_t kOutEndpoint = 0x01;
+constexpr uint8_t kInEndpoint = 0x82;
+constexpr uint16_t kPacketSize = 64;
+
+// USB MSC class codes (MSC Overview 1.4, section 2 and 3).
+constexpr uint8_t kClassMSC = 0x08;
+constexpr uint8_t kSubclassSCSI = 0x06;
+constexpr uint8_t kProtocolBulkOnly = 0x50;
+
+// Bulk-Only Transport (USB MSC BOT 1.0).
+constexpr uint8_t kRequestGetMaxLUN = 0xfe;
+constexpr uint8_t kRequestBulkOnlyReset = 0xff;
+constexpr uint32_t kCBWSignature = 0x43425355;
+constexpr uint32_t kCSWSignature = 0x53425355;
+constexpr uint8_t kCBWDirectionIn = 0x80;
+constexpr uint8_t kCSWStatusPassed = 0x00;
+constexpr uint8_t kCSWStatusFailed = 0x01;
+
+// SCSI opcodes (SPC-2/SBC-2).
+constexpr uint8_t kTestUnitReady = 0x00;
+constexpr uint8_t kRequestSense = 0x03;
+constexpr uint8_t kInquiry = 0x12;
+constexpr uint8_t kModeSense6 = 0x1a;
+constexpr uint8_t kStartStopUnit = 0x1b;
+constexpr uint8_t kPreventAllowMediumRemoval = 0x1e;
+constexpr uint8_t kReadFormatCapacities = 0x23;
+constexpr uint8_t kReadCapacity10 = 0x25;
+constexpr uint8_t kRead10 = 0x28;
+constexpr uint8_t kWrite10 = 0x2a;
+constexpr uint8_t kVerify10 = 0x2f;
+constexpr uint8_t kModeSense10 = 0x5a;
+
+// Sense keys and additional sense codes.
+constexpr uint8_t kSenseNone = 0x00;
+constexpr uint8_t kSenseNotReady = 0x02;
+constexpr uint8_t kSenseMediumError = 0x03;
+constexpr uint8_t kSenseIllegalRequest = 0x05;
+constexpr uint8_t kSenseDataProtect = 0x07;
+constexpr uint8_t kASCUnrecoveredReadError = 0x11;
+constexpr uint8_t kASCWriteFault = 0x03;
+constexpr uint8_t kASCInvalidCommand = 0x20;
+constexpr uint8_t kASCLBAOutOfRange = 0x21;
+constexpr uint8_t kASCWriteProtected = 0x27;
+constexpr uint8_t kASCMediumNotPresent = 0x3a;
+
+uint32_t ReadBE32(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+uint16_t ReadBE16(const uint8_t* p) {
+  return (static_cast<uint16_t>(p[0]) << 8) | p[1];
+}
+
+void WriteBE32(uint8_t* p, uint32_t x) {
+  p[0] = x >> 24;
+  p[1] = x >> 16;
+  p[2] = x >> 8;
+  p[3] = x;
+}
+
+// Copy a string into a fixed width space-padded SCSI field.
+void CopyPadded(uint8_t* dst, const char* src, std::size_t width) {
+  std::size_t len = std::min(std::strlen(src), width);
+  std::memcpy(dst, src, len);
+  std::memset(dst + len, ' ', width - len);
+}
+
+} // namespace
+
+namespace Ostrich {
+
+USBMassStorage::USBMassStorage(BlockDevice* device, uint16_t vid, uint16_t pid,
+                               uint16_t current_ma, const char* manufacturer,
+                               const char* product)
+    : device_(device),
+      pin_allocation_dm_(GPIOManager::GetInstance().AllocatePin(PIN_A11)),
+      pin_allocation_dp_(GPIOManager::GetInstance().AllocatePin(PIN_A12)),
+      usbd_dev_(nullptr),
+      dev_descriptor_(GetDeviceDescriptor(vid, pid)),
+      config_descriptor_(GetConfigDescriptor(current_ma)),
+      interface_(GetInterface()),
+      state_(State::kCommand),
+      host_expected_len_(0),
+      tx_ptr_(nullptr),
+      tx_remaining_(0),
+      active_buf_(0),
+      next_buf_ready_(false),
+      next_lba_(0),
+      blocks_remaining_(0),
+      rx_offset_(0),
+      sense_key_(kSenseNone),
+      sense_asc_(0),
+      sense_ascq_(0),
+      ejected_(false) {
+  if (device_->BlockSize() != kSectorSize) {
+    HandleError("USB mass storage only supports 512 byte blocks");
+  }
+
+  USBManager::GetInstance().AllocateUSB([this]() { Poll(); });
+
+  ZeroInit(&csw_);
+  csw_.dCSWSignature = kCSWSignature;
+
+  // The INQUIRY response never changes, so we build it once.
+  std::memset(inquiry_data_, 0, sizeof(inquiry_data_));
+  inquiry_data_[1] = 0x80;  // Removable.
+  inquiry_data_[2] = 0x04;  // SPC-2.
+  inquiry_data_[3] = 0x02;  // Response data format.
+  inquiry_data_[4] = sizeof(inquiry_data_) - 5;  // Additional length.
+  CopyPadded(&inquiry_data_[8], manufacturer, 8);
+  CopyPadded(&inquiry_data_[16], product, 16);
+  CopyPadded(&inquiry_data_[32], "1.00", 4);
+
+  pin_allocation_dm_.SetAF(10);
+  pin_allocation_dp_.SetAF(10);
+
+  desig_get_unique_id_as_dfu(unique_id_);
+
+  usb_strings_[0] = manufacturer;
+  usb_strings_[1] = product;
+  usb_strings_[2] = unique_id_;
+
+  usbd_dev_ = usbd_init(&otgfs_usb_driver, &dev_descriptor_,
+                        &config_descriptor_, usb_strings_, 3, control_buffer_,
+                        sizeof(control_buffer_));
+
+  usbd_register_set_config_callback(usbd_dev_, SetConfigCallback);
+
+  g_usb_msc = this;
+
+  nvic_enable_irq(NVIC_OTG_FS_IRQ);
+}
+
+USBMassStorage::~USBMassStorage() {
+  nvic_disable_irq(NVIC_OTG_FS_IRQ);
+  rcc_periph_clock_disable(RCC_OTGFS);
+  g_usb_msc = nullptr;
+  USBManager::GetInstance().DeallocateUSB();
+}
+
+void USBMassStorage::Reset() {
+  state_ = State::kCommand;
+  host_expected_len_ = 0;
+  tx_remaining_ = 0;
+  blocks_remaining_ = 0;
+  next_buf_ready_ = false;
+  rx_offset_ = 0;
+}
+
+void USBMassStorage::SetSense(uint8_t key, uint8_t asc, uint8_t ascq) {
+  sense_key_ = key;
+  sense_asc_ = asc;
+  sense_ascq_ = ascq;
+}
+
+void USBMassStorage::FailCommand(uint8_t key, uint8_t asc) {
+  SetSense(key, asc);
+  csw_.bCSWStatus = kCSWStatusFailed;
+}
+
+void USBMassStorage::HandleCommand(const CommandBlockWrapper& cbw) {
+  csw_.dCSWTag = cbw.dCBWTag;
+  csw_.bCSWStatus = kCSWStatusPassed;
+  host_expected_len_ = cbw.dCBWDataTransferLength;
+  bool host_expects_in = cbw.bmCBWFlags & kCBWDirectionIn;
+  const uint8_t* cb = cbw.CBWCB;
+
+  switch (cb[0]) {
+    case kTestUnitReady:
+      if (ejected_) {
+        FailCommand(kSenseNotReady, kASCMediumNotPresent);
+      }
+      break;
+    case kPreventAllowMediumRemoval:
+      break;
+    case kStartStopUnit:
+      // LOEJ=1, START=0 is an eject. START=1 loads the medium again.
+      if (cb[4] & 0x1) {
+        ejected_ = false;
+      } else if (cb[4] & 0x2) {
+        ejected_ = true;
+      }
+      break;
+    case kVerify10:
+      // Our devices don't have a way to verify media.
+      if (ejected_) {
+        FailCommand(kSenseNotReady, kASCMediumNotPresent);
+      }
+      break;
+    case kRequestSense: {
+      std::memset(response_buf_, 0, 18);
+      response_buf_[0] = 0x70;  // Current error, fixed format.
+      response_buf_[2] = sense_key_;
+      response_buf_[7] = 10;  // Additional sense length.
+      response_buf_[12] = sense_asc_;
+      response_buf_[13] = sense_ascq_;
+      SetSense(kSenseNone, 0);
+      SendResponse(response_buf_, std::min<std::size_t>(18, cb[4]));
+      return;
+    }
+    case kInquiry: {
+      SendResponse(inquiry_data_,
+                   std::min<std::size_t>(sizeof(inquiry_data_),
+                                         ReadBE16(&cb[3])));
+      return;
+    }
+    case kModeSense6: {
+      response_buf_[0] = 3;  // Mode data length.
+      response_buf_[1] = 0;  // Medium type.
+      response_buf_[2] = device_->WriteProtected() ? 0x80 : 0x00;
+      response_buf_[3] = 0;  // Block descriptor length.
+      SendResponse(response_buf_, std::min<std::size_t>(4, cb[4]));
+      return;
+    }
+    case kModeSense10: {
+      std::memset(response_buf_, 0, 8);
+      response_buf_[1] = 6;  // Mode data length.
+      response_buf_[3] = device_->WriteProtected() ? 0x80 : 0x00;
+      SendResponse(response_buf_,
+                   std::min<std::size_t>(8, ReadBE16(&cb[7])));
+      return;
+    }
+    case kReadFormatCapacities: {
+      std::memset(response_buf_, 0, 12);
+      response_buf_[3] = 8;  // Capacity list length.
+      WriteBE32(&response_buf_[4], device_->BlockCount());
+      WriteBE32(&response_buf_[8], kSectorSize);
+      response_buf_[8] = 0x02;  // Formatted media.
+      SendResponse(response_buf_,
+                   std::min<std::size_t>(12, ReadBE16(&cb[7])));
+      return;
+    }
+    case kReadCapacity10: {
+      if (ejected_) {
+        FailCommand(kSenseNotReady, kASCMediumNotPresent);
+        break;
+      }
+      WriteBE32(&response_buf_[0], device_->BlockCount() - 1);
+      WriteBE32(&response_buf_[4], kSectorSize);
+      SendResponse(response_buf_, 8);
+      return;
+    }
+    case kRead10: {
+      uint32_t lba = ReadBE32(&cb[2]);
+      uint32_t num_blocks = ReadBE16(&cb[7]);
+      if (ejected_) {
+        FailCommand(kSenseNotReady, kASCMediumNotPresent);
+        break;
+      }
+      if (lba >= device_->BlockCount() ||
+          num_blocks > device_->BlockCount() - lba) {
+        FailCommand(kSenseIllegalRequest, kASCLBAOutOfRange);
+        break;
+      }
+      StartRead(lba, num_blocks);
+      return;
+    }
+    case kWrite10: {
+      uint32_t lba = ReadBE32(&cb[2]);
+      uint32_t num_blocks = ReadBE16(&cb[7]);
+      if (ejected_) {
+        FailCommand(kSenseNotReady, kASCMediumNotPresent);
+        break;
+      }
+      if (device_->WriteProtected()) {
+        FailCommand(kSenseDataProtect, kASCWriteProtected);
+        break;
+      }
+      if (lba >= device_->BlockCount() ||
+          num_blocks > device_->BlockCount() - lba) {
+        FailCommand(kSenseIllegalRequest, kASCLBAOutOfRange);
+        break;
+      }
+      if (num_blocks == 0) {
+        break;
+      }
+      state_ = State::kDataOut;
+      next_lba_ = lba;
+      blocks_remaining_ = num_blocks;
+      active_buf_ = 0;
+      rx_offset_ = 0;
+      return;
+    }
+    default:
+      FailCommand(kSenseIllegalRequest, kASCInvalidCommand);
+      break;
+  }
+
+  // Commands that end up here have no data phase. If the host wanted to send
+  // us data, stall the OUT endpoint so it moves on to the status phase. If
+  // it wanted data from us, stall the IN endpoint, and the residue in the CSW
+  // tells it none is coming.
+  if (host_expects_in) {
+    EndDataIn();
+    return;
+  }
+
+  if (host_expected_len_ > 0) {
+    usbd_ep_stall_set(usbd_dev_, kOutEndpoint, 1);
+  }
+  SendStatus();
+}
+
+void USBMassStorage::SendResponse(const uint8_t* data, std::size_t len) {
+  state_ = State::kDataIn;
+  tx_ptr_ = data;
+  tx_remaining_ = len;
+  blocks_remaining_ = 0;
+  next_buf_ready_ = false;
+  SendNextPacket();
+}
+
+void USBMassStorage::StartRead(uint32_t lba, uint32_t num_blocks) {
+  state_ = State::kDataIn;
+  next_lba_ = lba;
+  blocks_remaining_ = num_blocks;
+  tx_remaining_ = 0;
+
+  if (num_blocks == 0) {
+    EndDataIn();
+    return;
+  }
+
+  // Fetch the first sector into the other buffer, then swap it in.
+  active_buf_ = 1;
+  if (!PrefetchSector()) {
+    EndDataIn();
+    return;
+  }
+  active_buf_ = 0;
+  tx_ptr_ = sector_bufs_[active_buf_];
+  tx_remaining_ = kSectorSize;
+  SendNextPacket();
+
+  // The first packet is on its way. Get the next sector ready while the host
+  // collects it.
+  next_buf_ready_ = PrefetchSector();
+}
+
+bool USBMassStorage::PrefetchSector() {
+  if (blocks_remaining_ == 0) {
+    return false;
+  }
+
+  if (!device_->ReadBlocks(next_lba_, sector_bufs_[active_buf_ ^ 1], 1)) {
+    FailCommand(kSenseMediumError, kASCUnrecoveredReadError);
+    blocks_remaining_ = 0;
+    return false;
+  }
+
+  ++next_lba_;
+  --blocks_remaining_;
+  return true;
+}
+
+void USBMassStorage::SendNextPacket() {
+  if (host_expected_len_ == 0) {
+    // Host doesn't want any more. Drop the rest of the data phase.
+    tx_remaining_ = 0;
+    blocks_remaining_ = 0;
+    next_buf_ready_ = false;
+  }
+
+  if (tx_remaining_ == 0) {
+    EndDataIn();
+    return;
+  }
+
+  uint16_t packet_size = std::min<std::size_t>(
+      std::min<std::size_t>(tx_remaining_, kPacketSize), host_expected_len_);
+  usbd_ep_write_packet(usbd_dev_, kInEndpoint, tx_ptr_, packet_size);
+  USBManager::GetInstance().RecordPacketIn(kInEndpoint, packet_size);
+  tx_ptr_ += packet_size;
+  tx_remaining_ -= packet_size;
+  host_expected_len_ -= packet_size;
+}
+
+void USBMassStorage::EndDataIn() {
+  if (host_expected_len_ == 0) {
+    SendStatus();
+    return;
+  }
+
+  state_ = State::kStatusAfterHalt;
+  usbd_ep_stall_set(usbd_dev_, kInEndpoint, 1);
+}
+
+void USBMassStorage::SendStatus() {
+  state_ = State::kStatus;
+  csw_.dCSWDataResidue = host_expected_len_;
+  usbd_ep_write_packet(usbd_dev_, kInEndpoint, &csw_, sizeof(csw_));
+  USBManager::GetInstance().RecordPacketIn(kInEndpoint, sizeof(csw_));
+}
+
+void USBMassStorage::HandleTxComplete() {
+  switch (state_) {
+    case State::kDataIn:
+      if (tx_remaining_ == 0 && next_buf_ready_) {
+        // Current sector is done. Swap to the one we prefetched, and start
+        // fetching the next one as soon as its first packet is out.
+        active_buf_ ^= 1;
+        tx_ptr_ = sector_bufs_[active_buf_];
+        tx_remaining_ = kSectorSize;
+        SendNextPacket();
+        next_buf_ready_ = PrefetchSector();
+      } else {
+        SendNextPacket();
+      }
+      break;
+    case State::kStatus:
+      state_ = State::kCommand;
+      break;
+    default:
+      break;
+  }
+}
+
+void USBMassStorage::HandleDataOut(const uint8_t* data, std::size_t len) {
+  len = std::min<std::size_t>(len, host_expected_len_);
+  host_expected_len_ -= len;
+
+  while (len > 0 && blocks_remaining_ > 0) {
+    std::size_t to_copy = std::min(len, kSectorSize - rx_offset_);
+    std::memcpy(&sector_bufs_[active_buf_][rx_offset_], data, to_copy);
+    rx_offset_ += to_copy;
+    data += to_copy;
+    len -= to_copy;
+
+    if (rx_offset_ == kSectorSize) {
+      // Start receiving into the other buffer (the OUT endpoint has already
+      // been re-armed by the read), and commit this one.
+      int full_buf = active_buf_;
+      active_buf_ ^= 1;
+      rx_offset_ = 0;
+
+      // After a failure we keep consuming data, but don't write it.
+      if (csw_.bCSWStatus == kCSWStatusPassed &&
+          !device_->WriteBlocks(next_lba_, sector_bufs_[full_buf], 1)) {
+        FailCommand(kSenseMediumError, kASCWriteFault);
+      }
+
+      ++next_lba_;
+      --blocks_remaining_;
+    }
+  }
+
+  if (blocks_remaining_ == 0 || host_expected_len_ == 0) {
+    SendStatus();
+  }
+}
+
+/*static*/ void USBMassStorage::SetConfigCallback(usbd_device* usbd_dev,
+                                                  uint16_t /*wValue*/) {
+  usbd_ep_setup(usbd_dev, kOutEndpoint, USB_ENDPOINT_ATTR_BULK, kPacketSize,
+                DataRxCallback);
+  usbd_ep_setup(usbd_dev, kInEndpoint, USB_ENDPOINT_ATTR_BULK, kPacketSize,
+                DataTxCallback);
+  usbd_register_control_callback(usbd_dev,
+                                 USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+                                 USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+                                 ControlRequestCallback);
+  usbd_register_control_callback(usbd_dev,
+                                 USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_ENDPOINT,
+                                 USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+                                 EndpointRequestCallback);
+  g_usb_msc->Reset();
+}
+
+/*static*/ void USBMassStorage::DataRxCallback(usbd_device* usbd_dev,
+                                               uint8_t /*endpoint*/) {
+  uint8_t buf[kPacketSize];
+  std::size_t len = usbd_ep_read_packet(usbd_dev, kOutEndpoint, buf,
+                                        kPacketSize);
+  USBManager::GetInstance().RecordPacketOut(kOutEndpoint, len);
+  USBMassStorage* self = g_usb_msc;
+
+  switch (self->state_) {
+    case State::kCommand: {
+      CommandBlockWrapper cbw;
+      std::memcpy(&cbw, buf, std::min(len, sizeof(cbw)));
+      if (len != sizeof(cbw) || cbw.dCBWSignature != kCBWSignature) {
+        // Invalid CBW. Stall both endpoints until reset recovery (BOT 6.6.1).
+        usbd_ep_stall_set(usbd_dev, kInEndpoint, 1);
+        usbd_ep_stall_set(usbd_dev, kOutEndpoint, 1);
+        return;
+      }
+      self->HandleCommand(cbw);
+      break;
+    }
+    case State::kDataOut:
+      self->HandleDataOut(buf, len);
+      break;
+    default:
+      // Host is not supposed to send anything now.
+      break;
+  }
+}
+
+/*static*/ void USBMassStorage::DataTxCallback(usbd_device* /*usbd_dev*/,
+                                               uint8_t /*endpoint*/) {
+  g_usb_msc->HandleTxComplete();
+}
+
+/*static*/ usbd_request_return_codes USBMassStorage::ControlRequestCallback(
+    usbd_device* /*usbd_dev*/, usb_setup_data* req, uint8_t** buf,
+    uint16_t* len,
+    void (**/*complete*/)(usbd_device* usbd_dev, usb_setup_data* req)) {
+  switch (req->bRequest) {
+    case kRequestGetMaxLUN:
+      // We only have one LUN.
+      (*buf)[0] = 0;
+      *len = 1;
+      return USBD_REQ_HANDLED;
+    case kRequestBulkOnlyReset:
+      g_usb_msc->Reset();
+      return USBD_REQ_HANDLED;
+  }
+
+  return USBD_REQ_NOTSUPP;
+}
+
+/*static*/ usbd_request_return_codes USBMassStorage::EndpointRequestCallback(
+    usbd_device* /*usbd_dev*/, usb_setup_data* req, uint8_t** /*buf*/,
+    uint16_t* /*len*/,
+    void (**complete)(usbd_device* usbd_dev, usb_setup_data* req)) {
+  // The standard request handler clears the halt (we pass the request on).
+  // Send the CSW once that's done.
+  if (req->bRequest == USB_REQ_CLEAR_FEATURE &&
+      req->wValue == USB_FEAT_ENDPOINT_HALT && req->wIndex == kInEndpoint &&
+      g_usb_msc->state_ == State::kStatusAfterHalt) {
+    *complete = InHaltClearedCallback;
+  }
+
+  return USBD_REQ_NEXT_CALLBACK;
+}
+
+/*static*/ void USBMassStorage::InHaltClearedCallback(
+    usbd_device* /*usbd_dev*/, usb_setup_data* /*req*/) {
+  // Unless there was a reset recovery in the meantime.
+  if (g_usb_msc->state_ == State::kStatusAfterHalt) {
+    g_usb_msc->SendStatus();
+  }
+}
+
+usb_device_descriptor USBMassStorage::GetDeviceDescriptor(uint16_t vid,
+                                                          uint16_t pid) {
+  usb_device_descriptor dev;
+  ZeroInit(&dev);
+  dev.bLength = USB_DT_DEVICE_SIZE;
+  dev.bDescriptorType = USB_DT_DEVICE;
+  dev.bcdUSB = 0x0200;
+  dev.bDeviceClass = 0;  // Defined at interface level.
+  dev.bDeviceSubClass = 0;
+  dev.bDeviceProtocol = 0;
+  dev.bMaxPacketSize0 = 64;
+  dev.idVendor = vid;
+  dev.idProduct = pid;
+  dev.bcdDevice = 0x0200;
+  dev.iManufacturer = 1;
+  dev.iProduct = 2;
+  dev.iSerialNumber = 3;
+  dev.bNumConfigurations = 1;
+  return dev;
+}
+
+usb_config_descriptor USBMassStorage::GetConfigDescriptor(
+    uint32_t max_current_ma) {
+  usb_config_descriptor config;
+  ZeroInit(&config);
+  config.bLength = USB_DT_CONFIGURATION_SIZE;
+  config.bDescriptorType = USB_DT_CONFIGURATION;
+  config.wTotalLength = 0;
+  config.bNumInterfaces = 1;
+  config.bConfigurationValue = 1;
+  config.iConfiguration = 0;
+  config.bmAttributes = 0x80;
+  config.bMaxPower = max_current_ma / 2;
+
+  ZeroInit(&interfaces_[0]);
+  interfaces_[0].num_altsetting = 1;
+  interfaces_[0].altsetting = &interface_;
+
+  config.interface = interfaces_;
+  return config;
+}
+
+usb_interface_descriptor USBMassStorage::GetInterface() {
+  usb_interface_descriptor iface;
+  ZeroInit(&iface);
+  iface.bLength = USB_DT_INTERFACE_SIZE;
+  iface.bDescriptorType = USB_DT_INTERFACE;
+  iface.bInterfaceNumber = 0;
+  iface.bAlternateSetting = 0;
+  iface.bNumEndpoints = 2;
+  iface.bInterfaceClass = kClassMSC;
+  iface.bInterfaceSubClass = kSubclassSCSI;
+  iface.bInterfaceProtocol = kProtocolBulkOnly;
+  iface.iInterface = 0;
+
+  ZeroInit(&endpoints_[0]);
+  endpoints_[0].bLength = USB_DT_ENDPOINT_SIZE;
+  endpoints_[0].bDescriptorType = USB_DT_ENDPOINT;
+  endpoints_[0].bEndpointAddress = kOutEndpoint;
+  endpoints_[0].bmAttributes = USB_ENDPOINT_ATTR_BULK;
+  endpoints_[0].wMaxPacketSize = kPacketSize;
+  endpoints_[0].bInterval = 0;
+
+  ZeroInit(&endpoints_[1]);
+  endpoints_[1].bLength = USB_DT_ENDPOINT_SIZE;
+  endpoints_[1].bDescriptorType = USB_DT_ENDPOINT;
+  endpoints_[1].bEndpointAddress = kInEndpoint;
+  endpoints_[1].bmAttributes = USB_ENDPOINT_ATTR_BULK;
+  endpoints_[1].wMaxPacketSize = kPacketSize;
+  endpoints_[1].bInterval = 0;
+
+  iface.endpoint = endpoints_;
+  return iface;
+}
+
+} // namespace Ostrich
@@ -20,8 +20,6 @@
 #include "usb/serial.h"
 
 #include <algorithm>
-#include <cstring>
-#include <type_traits>
 
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/desig.h>
@@ -29,30 +27,17 @@
 #include <libopencm3/usb/cdc.h>
 
 #include "ostrich.h"
+#include "systick.h"
+#include "usb/common.h"
 #include "util.h"
 
 namespace {
 
-// There should only ever be one USBSerial. We go into spin loop for 
-// debugging if user tries to construct more than one.
+// There should only ever be one USBSerial (enforced by USBManager).
 Ostrich::USBSerial* g_usb_serial = nullptr;
 
-template <typename T>
-void ZeroInit(T* obj) {
-  static_assert(std::is_pod<T>::value, "Can only zero init POD types");
-  std::memset(obj, 0, sizeof(T));
-}
-
 } // namespace
 
-extern "C" {
-void otg_fs_isr() {
-  if (g_usb_serial) {
-    g_usb_serial->Poll();
-  }
-}
-}
-
 namespace Ostrich {
 
 USBSerial::USBSerial(uint16_t vid, uint16_t pid, uint16_t current_ma,
@@ -66,11 +51,13 @@ USBSerial::USBSerial(uint16_t vid, uint16_t pid, uint16_t current_ma,
       comm_interface_(GetCommInterface()),
       data_interface_(GetDataInterface()),
       dtr_(false),
-      endpoint_nak_(false) {
+      endpoint_nak_(false),
+      stats_vendor_request_(false),
+      rx_packets_head_(0),
+      num_rx_packets_(0),
+      rx_bytes_(0) {
 
-  if (g_usb_serial != nullptr) {
-    HandleError("Only one USB service can be instantiated at a time.");
-  }
+  USBManager::GetInstance().AllocateUSB([this]() { Poll(); });
 
   pin_allocation_dm_.SetAF(10);
   pin_allocation_dp_.SetAF(10);
@@ -96,16 +83,35 @@ USBSerial::~USBSerial() {
   nvic_disable_irq(NVIC_OTG_FS_IRQ);
   rcc_periph_clock_disable(RCC_OTGFS);
   g_usb_serial = nullptr;
+  USBManager::GetInstance().DeallocateUSB();
+}
+
+void USBSerial::EnableStatistics(bool vendor_request) {
+  stats_vendor_request_ = vendor_request;
+  USBManager::GetInstance().EnableSOFCounting(usbd_dev_);
 }
 
 void USBSerial::OutputImpl(const char* data, std::size_t len) {
   if (dtr_) {
     ScopedIRQLock irq_lock(NVIC_OTG_FS_IRQ);
+    auto& usb_manager = USBManager::GetInstance();
     std::size_t length_written = 0;
+    uint64_t blocked_since = 0;
     while (length_written < len) {
       std::size_t packet_size = std::min((len - length_written), 64u);
-      length_written += usbd_ep_write_packet(usbd_dev_, 0x82,
-                                             data + length_written, packet_size);
+      std::size_t written = usbd_ep_write_packet(
+          usbd_dev_, 0x82, data + length_written, packet_size);
+      if (written) {
+        if (blocked_since) {
+          usb_manager.RecordBlocked(0x82, GetTimeClocks() - blocked_since);
+          blocked_since = 0;
+        }
+        usb_manager.RecordPacketIn(0x82, written);
+        length_written += written;
+      } else if (!blocked_since) {
+        // The previous packet hasn't been collected by the host yet.
+        blocked_since = GetTimeClocks();
+      }
     }
   }
 }
@@ -119,18 +125,59 @@ void USBSerial::OutputImpl(const char* data, std::size_t len) {
                                  USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
                                  USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
                                  ControlRequestCallback);
+  if (g_usb_serial->stats_vendor_request_) {
+    USBManager::RegisterStatsVendorRequest(usbd_dev);
+  }
 }
 
 /*static*/ void USBSerial::DataRxCallback(usbd_device* usbd_dev,
                                           uint8_t /*endpoint*/) {
   char buf[64];
   std::size_t len = usbd_ep_read_packet(usbd_dev, 0x01, buf, 64);
+  auto& usb_manager = USBManager::GetInstance();
+  usb_manager.RecordPacketOut(0x01, len);
+
+  // AddDataToBuffer() drops what doesn't fit.
+  std::size_t accepted = std::min(len, g_usb_serial->ReceiveBufferSpace());
   g_usb_serial->AddDataToBuffer(buf, len);
 
+  if (accepted > 0) {
+    uint32_t end = g_usb_serial->rx_bytes_ + accepted;
+    g_usb_serial->rx_bytes_ = end;
+    std::size_t num_packets = g_usb_serial->num_rx_packets_;
+    if (num_packets == kMaxRxPackets) {
+      std::size_t newest =
+          (g_usb_serial->rx_packets_head_ + num_packets - 1) % kMaxRxPackets;
+      g_usb_serial->rx_packets_[newest].end = end;
+    } else {
+      std::size_t tail =
+          (g_usb_serial->rx_packets_head_ + num_packets) % kMaxRxPackets;
+      g_usb_serial->rx_packets_[tail] = RxPacket{end, GetTimeClocks()};
+      g_usb_serial->num_rx_packets_ = num_packets + 1;
+    }
+  }
+
   // NAK the packet if we don't have enough space for 2 more packets.
   if (g_usb_serial->ReceiveBufferSpace() < 128) {
     usbd_ep_nak_set(usbd_dev, 0x01, 1);
     g_usb_serial->endpoint_nak_ = true;
+    usb_manager.RecordNAK(0x01);
+  }
+}
+
+void USBSerial::RecordPacketsRead() {
+  ScopedIRQLock lock(NVIC_OTG_FS_IRQ);
+  uint32_t read_pos = rx_bytes_ - DataAvailable();
+  while (num_rx_packets_ > 0) {
+    const RxPacket& packet = rx_packets_[rx_packets_head_];
+    // Positions wrap around, but are never more than 512 bytes apart.
+    if (static_cast<int32_t>(read_pos - packet.end) < 0) {
+      break;
+    }
+    USBManager::GetInstance().RecordReadLatency(
+        0x01, GetTimeClocks() - packet.arrival_clocks);
+    rx_packets_head_ = (rx_packets_head_ + 1) % kMaxRxPackets;
+    --num_rx_packets_;
   }
 }
 
@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+#
+# This file is part of the libostrich project.
+#
+# Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+#
+# This library is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this library.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Receiver for USBADCStream (libostrich/include/usb/adc_stream.h). Writes
+# samples to a file (raw little endian uint16, or CSV with one row per
+# sequence), and reports sequence gaps and short frames on stderr.
+#
+# Requires pyusb (pip install pyusb).
+#
+# ./adc_stream.py capture.bin
+# ./adc_stream.py --format csv --duration 10 capture.csv
+
+import argparse
+import struct
+import sys
+import time
+
+import usb.core
+import usb.util
+
+MAGIC = 0xADC0FFEE
+MAGIC_BYTES = struct.pack('<I', MAGIC)
+HEADER = struct.Struct('<IIIIHBB')
+
+REQUEST_START = 0x10
+REQUEST_STOP = 0x11
+ENDPOINT = 0x81
+
+# Vendor, interface recipient, host to device.
+REQUEST_TYPE_OUT = 0x41
+
+
+class FrameParser:
+  def __init__(self):
+    self.buf = bytearray()
+    self.last_sequence = None
+    self.frames = 0
+    self.lost_frames = 0
+    self.short_frames = 0
+
+  # Feed received data, and return a list of (header, samples) for complete
+  # frames.
+  def feed(self, data):
+    self.buf += data
+    frames = []
+    while True:
+      start = self.buf.find(MAGIC_BYTES)
+      if start < 0:
+        # Keep a few bytes in case the magic is split across reads.
+        del self.buf[:max(0, len(self.buf) - 3)]
+        return frames
+
+      if start > 0:
+        # Tail of a frame we didn't see the start of.
+        del self.buf[:start]
+
+      if len(self.buf) < HEADER.size:
+        return frames
+
+      magic, sequence, timestamp_us, rate, num_samples, num_channels, _ = \
+          HEADER.unpack_from(self.buf)
+      frame_len = HEADER.size + num_samples * 2
+
+      # A frame is short if the next one starts before it ends (the device
+      # abandoned it because the ADC caught up).
+      next_magic = self.buf.find(MAGIC_BYTES, HEADER.size,
+                                 min(len(self.buf), frame_len))
+      if next_magic >= 0:
+        self.short_frames += 1
+        del self.buf[:next_magic]
+        continue
+
+      if len(self.buf) < frame_len:
+        return frames
+
+      if self.last_sequence is not None:
+        lost = (sequence - self.last_sequence - 1) & 0xffffffff
+        if lost:
+          self.lost_frames += lost
+          print('Gap: {} frame(s) lost before sequence {}'.format(
+              lost, sequence), file=sys.stderr)
+      self.last_sequence = sequence
+      self.frames += 1
+
+      samples = struct.unpack_from('<{}H'.format(num_samples), self.buf,
+                                   HEADER.size)
+      header = {
+        'sequence': sequence,
+        'timestamp_us': timestamp_us,
+        'sample_rate_hz': rate,
+        'num_channels': max(num_channels, 1),
+      }
+      frames.append((header, samples))
+      del self.buf[:frame_len]
+
+
+def main():
+  parser = argparse.ArgumentParser(description='Receive ADC samples from a '
+                                   'USBADCStream device.')
+  parser.add_argument('output', help='Output file')
+  parser.add_argument('--format', choices=['raw', 'csv'], default='raw',
+                      help='raw (little endian uint16) or csv')
+  parser.add_argument('--vid', type=lambda x: int(x, 0), default=0x1209)
+  parser.add_argument('--pid', type=lambda x: int(x, 0), default=0x0001)
+  parser.add_argument('--duration', type=float, default=0,
+                      help='Seconds to capture (default: until Ctrl-C)')
+  args = parser.parse_args()
+
+  dev = usb.core.find(idVendor=args.vid, idProduct=args.pid)
+  if dev is None:
+    sys.exit('Device not found')
+
+  if dev.is_kernel_driver_active(0):
+    dev.detach_kernel_driver(0)
+  usb.util.claim_interface(dev, 0)
+
+  frame_parser = FrameParser()
+  out = open(args.output, 'wb' if args.format == 'raw' else 'w')
+
+  dev.ctrl_transfer(REQUEST_TYPE_OUT, REQUEST_START, 0, 0)
+  start_time = time.time()
+  report_time = start_time
+  report_samples = 0
+
+  try:
+    while not args.duration or (time.time() - start_time) < args.duration:
+      try:
+        data = dev.read(ENDPOINT, 16384, timeout=1000)
+      except usb.core.USBTimeoutError:
+        continue
+
+      for header, samples in frame_parser.feed(data):
+        if args.format == 'raw':
+          out.write(struct.pack('<{}H'.format(len(samples)), *samples))
+        else:
+          n = header['num_channels']
+          for i in range(0, len(samples), n):
+            out.write(','.join(str(s) for s in samples[i:i + n]) + '\n')
+        report_samples += len(samples)
+
+      now = time.time()
+      if now - report_time >= 1.0:
+        print('{:.0f} samples/s, {} frames, {} lost, {} short'.format(
+            report_samples / (now - report_time), frame_parser.frames,
+            frame_parser.lost_frames, frame_parser.short_frames),
+            file=sys.stderr)
+        report_time = now
+        report_samples = 0
+  except KeyboardInterrupt:
+    pass
+  finally:
+    dev.ctrl_transfer(REQUEST_TYPE_OUT, REQUEST_STOP, 0, 0)
+    usb.util.release_interface(dev, 0)
+    out.close()
+
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,289 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks BoxcarDecimator and CICDecimator against direct (convolution)
+// reference implementations, over a range of ratios, stage counts and channel
+// counts, with input split into blocks of random lengths. Built twice: once
+// plain, and once with -D__ARM_FEATURE_SIMD32=1, which tests the SMLAD and
+// UADD16 paths with the intrinsics emulated (arm_acle.h in this directory).
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "adc_filter.h"
+
+#include "test_util.h"
+
+using namespace Ostrich;
+
+namespace {
+
+#if __ARM_FEATURE_SIMD32
+constexpr const char* kTestName = "adc_filter_test (SIMD32)";
+#else
+constexpr const char* kTestName = "adc_filter_test";
+#endif
+
+constexpr uint16_t kMaxSample = (1 << kADCFilterInputBits) - 1;
+
+// Output scaling as documented in adc_filter.h: (value * scale) >> 48, with
+// scale = 2^(48 + output_bits - 12) / gain.
+uint16_t ReferenceScale(uint64_t value, uint64_t gain, int output_bits) {
+  uint64_t scale = (1ULL << (kADCFilterScaleShift + output_bits -
+                             kADCFilterInputBits)) / gain;
+  unsigned __int128 scaled = static_cast<unsigned __int128>(value) * scale;
+  return static_cast<uint16_t>(scaled >> kADCFilterScaleShift);
+}
+
+// Impulse response of a stages-stage CIC: a length ratio boxcar convolved
+// with itself stages times.
+std::vector<uint64_t> CICImpulseResponse(uint32_t ratio, int stages) {
+  std::vector<uint64_t> h = {1};
+  for (int s = 0; s < stages; ++s) {
+    std::vector<uint64_t> next(h.size() + ratio - 1, 0);
+    for (std::size_t i = 0; i < h.size(); ++i) {
+      for (uint32_t j = 0; j < ratio; ++j) {
+        next[i + j] += h[i];
+      }
+    }
+    h = next;
+  }
+  return h;
+}
+
+// Decimated output of the filter with impulse response h, evaluated at the
+// end of every ratio input sequences, with zero history before the start.
+// Input and output are interleaved.
+std::vector<uint16_t> ReferenceDecimate(const std::vector<uint16_t>& in,
+                                        int num_channels, uint32_t ratio,
+                                        const std::vector<uint64_t>& h,
+                                        int output_bits) {
+  uint64_t gain = 0;
+  for (uint64_t c : h) {
+    gain += c;
+  }
+
+  std::vector<uint16_t> out;
+  std::size_t sequences = in.size() / num_channels;
+  for (std::size_t n = ratio - 1; n < sequences; n += ratio) {
+    for (int ch = 0; ch < num_channels; ++ch) {
+      uint64_t sum = 0;
+      for (std::size_t j = 0; j < h.size() && j <= n; ++j) {
+        sum += h[j] * in[(n - j) * num_channels + ch];
+      }
+      out.push_back(ReferenceScale(sum, gain, output_bits));
+    }
+  }
+  return out;
+}
+
+enum class Signal {
+  kRandom,
+  kFullScale,
+  kZero,
+  kRamp
+};
+
+std::vector<uint16_t> MakeInput(std::mt19937_64& rng, Signal signal,
+                                std::size_t len) {
+  std::vector<uint16_t> in(len);
+  for (std::size_t i = 0; i < len; ++i) {
+    switch (signal) {
+      case Signal::kRandom: in[i] = rng() & kMaxSample; break;
+      case Signal::kFullScale: in[i] = kMaxSample; break;
+      case Signal::kZero: in[i] = 0; break;
+      case Signal::kRamp: in[i] = i & kMaxSample; break;
+    }
+  }
+  return in;
+}
+
+// Feeds in through the decimator in blocks of random lengths (whole sequences,
+// but not multiples of the ratio), and returns the concatenated output.
+// Also checks that no call writes more than the documented maximum.
+template <typename Decimator>
+std::vector<uint16_t> RunBlocks(std::mt19937_64& rng, Decimator* decimator,
+                                const std::vector<uint16_t>& in,
+                                int num_channels, uint32_t ratio) {
+  constexpr uint16_t kGuard = 0xdead;
+  std::vector<uint16_t> ret;
+  std::size_t sequences = in.size() / num_channels;
+  std::size_t pos = 0;
+
+  while (pos < sequences) {
+    // Mostly short blocks, sometimes long ones, occasionally empty.
+    std::size_t max_len = (rng() % 4 == 0) ? 4 * ratio + 7 : ratio + 3;
+    std::size_t n = std::min<std::size_t>(rng() % (max_len + 1),
+                                          sequences - pos);
+    std::size_t len = n * num_channels;
+
+    std::size_t max_out = (n / ratio + 1) * num_channels;
+    std::vector<uint16_t> out(max_out + 1, kGuard);
+    std::size_t num_out = decimator->Process(in.data() + pos * num_channels,
+                                             len, out.data());
+    CHECK(num_out <= max_out);
+    CHECK_EQ(num_out % num_channels, 0);
+    CHECK_EQ(out[max_out], kGuard);
+
+    ret.insert(ret.end(), out.begin(), out.begin() + num_out);
+    pos += n;
+  }
+  return ret;
+}
+
+void CheckOutput(const std::vector<uint16_t>& actual,
+                 const std::vector<uint16_t>& expected) {
+  CHECK_EQ(actual.size(), expected.size());
+  for (std::size_t i = 0; i < actual.size() && i < expected.size(); ++i) {
+    if (!CHECK_EQ(actual[i], expected[i])) {
+      return;
+    }
+  }
+}
+
+const Signal kSignals[] = {
+  Signal::kRandom, Signal::kFullScale, Signal::kZero, Signal::kRamp
+};
+
+const int kChannelCounts[] = {1, 2, 3, 4, 7, 16};
+
+void TestBoxcar(std::mt19937_64& rng) {
+  const uint32_t kRatios[] = {1, 2, 3, 4, 5, 7, 15, 16, 17, 31, 32, 33, 64,
+                              100, 256, 1000};
+
+  for (uint32_t ratio : kRatios) {
+    std::vector<uint64_t> h(ratio, 1);
+    for (int num_channels : kChannelCounts) {
+      for (Signal signal : kSignals) {
+        int output_bits = 8 + rng() % 9;
+        BoxcarDecimator decimator(ratio, output_bits, num_channels);
+
+        // Not a whole number of outputs, so the last partial sum is dropped.
+        std::size_t sequences = 5 * ratio + rng() % ratio + 40;
+        std::vector<uint16_t> in = MakeInput(rng, signal,
+                                             sequences * num_channels);
+        std::vector<uint16_t> expected =
+            ReferenceDecimate(in, num_channels, ratio, h, output_bits);
+
+        CheckOutput(RunBlocks(rng, &decimator, in, num_channels, ratio),
+                    expected);
+
+        // After a reset, the decimator starts over.
+        decimator.Reset();
+        CheckOutput(RunBlocks(rng, &decimator, in, num_channels, ratio),
+                    expected);
+      }
+    }
+  }
+}
+
+void TestCIC(std::mt19937_64& rng) {
+  const uint32_t kRatios[] = {1, 2, 3, 4, 5, 8, 13, 16, 32, 64, 100, 1024};
+
+  for (int stages = 1; stages <= kMaxCICStages; ++stages) {
+    for (uint32_t ratio : kRatios) {
+      // Skip settings whose gain doesn't fit (the constructor rejects them).
+      uint64_t gain = 1;
+      for (int s = 0; s < stages; ++s) {
+        gain *= ratio;
+      }
+      if (gain > (1ULL << (32 - kADCFilterInputBits))) {
+        continue;
+      }
+
+      std::vector<uint64_t> h = CICImpulseResponse(ratio, stages);
+      for (int num_channels : kChannelCounts) {
+        for (Signal signal : kSignals) {
+          int output_bits = 8 + rng() % 9;
+          CICDecimator decimator(ratio, stages, output_bits, num_channels);
+
+          std::size_t sequences = (stages + 4) * ratio + rng() % ratio + 10;
+          std::vector<uint16_t> in = MakeInput(rng, signal,
+                                               sequences * num_channels);
+          std::vector<uint16_t> expected =
+              ReferenceDecimate(in, num_channels, ratio, h, output_bits);
+
+          CheckOutput(RunBlocks(rng, &decimator, in, num_channels, ratio),
+                      expected);
+
+          decimator.Reset();
+          CheckOutput(RunBlocks(rng, &decimator, in, num_channels, ratio),
+                      expected);
+        }
+      }
+    }
+  }
+}
+
+// The fixed point scaling is within 1 LSB of exact, and full scale input
+// gives (nearly) full scale output.
+void TestScaling() {
+  for (int output_bits = 8; output_bits <= 16; ++output_bits) {
+    for (uint64_t gain : {1, 3, 64, 1000, 1 << 20}) {
+      for (uint64_t samples : {uint64_t{0}, uint64_t{1}, gain / 2, gain}) {
+        uint64_t value = samples * kMaxSample;
+        double exact = static_cast<double>(value) *
+                       (1 << output_bits) / (1 << kADCFilterInputBits) / gain;
+        uint16_t scaled = ReferenceScale(value, gain, output_bits);
+        CHECK(scaled <= exact);
+        CHECK(scaled + 1 >= exact);
+      }
+    }
+  }
+
+  BoxcarDecimator decimator(16, 16);
+  std::vector<uint16_t> in(16, kMaxSample);
+  uint16_t out[2];
+  CHECK_EQ(decimator.Process(in.data(), in.size(), out), 1);
+  CHECK_EQ(out[0], 0xfff0);
+}
+
+void TestInvalidSettings() {
+  int errors = 0;
+  SetErrorHandler([&](const std::string&) { ++errors; });
+
+  BoxcarDecimator zero_ratio(0, 12);
+  BoxcarDecimator too_many_channels(4, 12, kMaxScanChannels + 1);
+  BoxcarDecimator bad_bits(4, 17);
+  CICDecimator too_much_gain(64, 4, 16);
+  CICDecimator too_many_stages(2, kMaxCICStages + 1, 16);
+  CHECK_EQ(errors, 5);
+
+  // They fall back to passing samples through.
+  uint16_t in[3] = {1, 2, 4095};
+  uint16_t out[4];
+  CHECK_EQ(too_much_gain.Process(in, 3, out), 3);
+  CHECK_EQ(out[2], 4095);
+
+  SetErrorHandler(nullptr);
+}
+
+} // namespace
+
+int main() {
+  std::mt19937_64 rng(3);
+  TestScaling();
+  TestInvalidSettings();
+  TestBoxcar(rng);
+  TestCIC(rng);
+  return Test::Summary(kTestName);
+}
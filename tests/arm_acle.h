@@ -0,0 +1,48 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host emulation of the ACLE SIMD32 intrinsics used by libostrich, so code
+// paths under __ARM_FEATURE_SIMD32 can be tested on the PC (build with
+// -D__ARM_FEATURE_SIMD32=1). Semantics follow the ARMv7E-M instructions.
+
+#ifndef __HOST_ARM_ACLE_H__
+#define __HOST_ARM_ACLE_H__
+
+#include <cstdint>
+
+// Dual 16-bit signed multiply, with both products added to a 32-bit
+// accumulator.
+inline int32_t __smlad(int32_t x, int32_t y, int32_t acc) {
+  int32_t low = static_cast<int16_t>(x & 0xffff) *
+                static_cast<int16_t>(y & 0xffff);
+  int32_t high = static_cast<int16_t>((x >> 16) & 0xffff) *
+                 static_cast<int16_t>((y >> 16) & 0xffff);
+  return static_cast<int32_t>(static_cast<uint32_t>(acc) +
+                              static_cast<uint32_t>(low) +
+                              static_cast<uint32_t>(high));
+}
+
+// Dual 16-bit unsigned add, each lane wrapping around independently.
+inline uint32_t __uadd16(uint32_t x, uint32_t y) {
+  uint32_t low = (x + y) & 0xffff;
+  uint32_t high = ((x >> 16) + (y >> 16)) & 0xffff;
+  return (high << 16) | low;
+}
+
+#endif // __HOST_ARM_ACLE_H__
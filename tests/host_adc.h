@@ -0,0 +1,35 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host stand-in for adc.h, for tests of code that only needs its constants
+// (eg. adc_filter.h). Force-included like host_ostrich.h, so the real adc.h,
+// which pulls in most of the hardware layer, is skipped.
+
+#ifndef __HOST_ADC_H__
+#define __HOST_ADC_H__
+
+#define __ADC_H__
+
+namespace Ostrich {
+
+constexpr int kMaxScanChannels = 16;
+
+}; // namespace Ostrich
+
+#endif // __HOST_ADC_H__
@@ -0,0 +1,42 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host stand-in for i2c.h, for tests of code that only needs its plain types
+// (eg. I2CRegisterMap, which takes the bus as a template parameter).
+// Force-included like host_ostrich.h, so the real i2c.h is skipped.
+
+#ifndef __HOST_I2C_H__
+#define __HOST_I2C_H__
+
+#define __I2C_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Ostrich {
+
+// Same as in i2c.h.
+struct I2CSegment {
+  const uint8_t* data;
+  std::size_t len;
+};
+
+}; // namespace Ostrich
+
+#endif // __HOST_I2C_H__
@@ -0,0 +1,81 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host (PC) stand-in for ostrich.h, force-included by the test Makefile before
+// any library header. It defines the include guard, so the real ostrich.h
+// (and with it gpio.h and libopencm3) is never pulled in. Only the parts of
+// the core API that header-only and portable library code uses are provided.
+
+#ifndef __HOST_OSTRICH_H__
+#define __HOST_OSTRICH_H__
+
+#define __OSTRICH_H__
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace Ostrich {
+
+inline uint32_t g_ahb_freq = 216000000;
+inline uint32_t g_systick_period = 216000;
+
+using ErrorHandler = std::function<void(const std::string& err)>;
+inline ErrorHandler g_error_handler;
+
+inline void LockUp() {
+  for (;;) {}
+}
+
+// There is only one thread, and no interrupts, on the host.
+class ScopedIRQLock {
+ public:
+  explicit ScopedIRQLock(uint8_t /*irq*/) {}
+  ScopedIRQLock(const ScopedIRQLock&) = delete;
+  ScopedIRQLock& operator=(const ScopedIRQLock&) = delete;
+};
+
+class ScopedInterruptMask {
+ public:
+  ScopedInterruptMask() {}
+  ScopedInterruptMask(const ScopedInterruptMask&) = delete;
+  ScopedInterruptMask& operator=(const ScopedInterruptMask&) = delete;
+};
+
+inline void HandleError(const std::string& msg) {
+  if (g_error_handler) {
+    g_error_handler(msg);
+  }
+}
+
+inline void SetErrorHandler(ErrorHandler eh) {
+  g_error_handler = eh;
+}
+
+inline void Log(const std::string&) {}
+
+inline void AssertTrue(bool cond, const std::string& msg) {
+  if (!cond) {
+    HandleError(msg);
+  }
+}
+
+}; // namespace Ostrich
+
+#endif // __HOST_OSTRICH_H__
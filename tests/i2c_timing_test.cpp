@@ -0,0 +1,312 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks ComputeI2CTiming() against ST's reference TIMINGR settings (RM0410
+// "Examples of timing settings"), and checks every result it gives against an
+// independent implementation of the I2C spec (UM10204 table 10) and the
+// RM0410 SDADEL/SCLDEL constraints.
+
+#include <cstdint>
+#include <cstdio>
+
+#include "i2c_timing.h"
+
+#include "test_util.h"
+
+using namespace Ostrich;
+
+namespace {
+
+// Times in ns, as doubles, so this doesn't share the integer picosecond
+// arithmetic of the implementation.
+struct ModeLimits {
+  uint32_t max_hz;
+  double vddat_max;
+  double sudat_min;
+  double low_min;
+  double high_min;
+};
+
+const ModeLimits kStandardMode = {100000, 3450, 250, 4700, 4000};
+const ModeLimits kFastMode = {400000, 900, 100, 1300, 600};
+const ModeLimits kFastModePlus = {1000000, 450, 50, 500, 260};
+
+// I2CSpeed rates from i2c.h.
+const uint32_t kI2CSpeedHzForTest[] = {10000, 100000, 400000, 1000000};
+
+const ModeLimits& LimitsFor(uint32_t bus_hz) {
+  if (bus_hz <= kStandardMode.max_hz) {
+    return kStandardMode;
+  } else if (bus_hz <= kFastMode.max_hz) {
+    return kFastMode;
+  }
+  return kFastModePlus;
+}
+
+// Analog filter delay (tAF) from the STM32F7 datasheet.
+constexpr double kAFMin = 50;
+constexpr double kAFMax = 260;
+
+struct BusTimes {
+  double low;
+  double high;
+  double period;
+  double hz;
+};
+
+// SCL low and high times as seen on the bus, from RM0410 "I2C master
+// initialization": tSYNC = tAF + tDNF + 2 * tI2CCLK is added to both
+// programmed times. Uses the minimum synchronization delay, so this is the
+// fastest (worst case for the spec) the bus can run.
+BusTimes ComputeBusTimes(uint32_t i2cclk_hz, const I2CTiming& t,
+                         const I2CTimingConfig& config) {
+  double clk = 1e9 / i2cclk_hz;
+  double tpresc = (t.presc + 1) * clk;
+  double tsync = (config.analog_filter ? kAFMin : 0) +
+                 config.digital_filter * clk + 2 * clk;
+  BusTimes ret;
+  ret.low = (t.scll + 1) * tpresc + tsync;
+  ret.high = (t.sclh + 1) * tpresc + tsync;
+  ret.period = ret.low + ret.high + config.rise_time_ns + config.fall_time_ns;
+  ret.hz = 1e9 / ret.period;
+  return ret;
+}
+
+// Tolerance for rounding of the I2CCLK period.
+constexpr double kEps = 0.01;
+
+struct Constraint {
+  bool ok;
+  const char* what;
+};
+
+bool CheckConstraints(uint32_t i2cclk_hz, uint32_t bus_hz, const I2CTiming& t,
+                      const Constraint* constraints, int num_constraints) {
+  bool ok = true;
+  for (int i = 0; i < num_constraints; ++i) {
+    if (!CHECK(constraints[i].ok)) {
+      std::printf("  I2CCLK %u Hz, bus %u Hz (PRESC %u SCLL %u SCLH %u "
+                  "SDADEL %u SCLDEL %u): %s\n", i2cclk_hz, bus_hz, t.presc,
+                  t.scll, t.sclh, t.sdadel, t.scldel, constraints[i].what);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// SDA timing relative to SCL, from RM0410 "I2C timings".
+bool CheckDataTiming(uint32_t i2cclk_hz, uint32_t bus_hz, const I2CTiming& t,
+                     const I2CTimingConfig& config) {
+  const ModeLimits& limits = LimitsFor(bus_hz);
+  double clk = 1e9 / i2cclk_hz;
+  double tpresc = (t.presc + 1) * clk;
+  double dnf = config.digital_filter;
+  double af_min = config.analog_filter ? kAFMin : 0;
+  double af_max = config.analog_filter ? kAFMax : 0;
+
+  const Constraint constraints[] = {
+    {t.presc < 16 && t.scldel < 16 && t.sdadel < 16, "field range"},
+
+    // tSCLDEL >= tr + tSU;DAT(min).
+    {(t.scldel + 1) * tpresc + kEps >= config.rise_time_ns + limits.sudat_min,
+     "SCLDEL (data setup)"},
+
+    // tSDADEL >= tf + tHD;DAT(min) - tAF(min) - tDNF - 3 * tI2CCLK, where
+    // tHD;DAT(min) is 0.
+    {t.sdadel * tpresc + kEps >=
+         config.fall_time_ns - af_min - (dnf + 3) * clk,
+     "SDADEL (data hold)"},
+
+    // tSDADEL <= tHD;DAT(max) - tr - tAF(max) - tDNF - 4 * tI2CCLK, where
+    // tHD;DAT(max) is tVD;DAT(max).
+    {t.sdadel * tpresc <=
+         limits.vddat_max - config.rise_time_ns - af_max - (dnf + 4) * clk +
+         kEps,
+     "SDADEL (data valid)"},
+  };
+  return CheckConstraints(i2cclk_hz, bus_hz, t, constraints,
+                          sizeof(constraints) / sizeof(constraints[0]));
+}
+
+// SCL low and high times, and frequency.
+bool CheckClockTiming(uint32_t i2cclk_hz, uint32_t bus_hz, const I2CTiming& t,
+                      const I2CTimingConfig& config) {
+  const ModeLimits& limits = LimitsFor(bus_hz);
+  double clk = 1e9 / i2cclk_hz;
+  double af_min = config.analog_filter ? kAFMin : 0;
+  BusTimes bus = ComputeBusTimes(i2cclk_hz, t, config);
+
+  const Constraint constraints[] = {
+    {t.presc < 16, "field range"},
+    {bus.low + kEps >= limits.low_min, "tLOW"},
+    {bus.high + kEps >= limits.high_min, "tHIGH"},
+
+    // Never faster than requested, and not much slower.
+    {bus.hz <= bus_hz * (1 + 1e-6), "fSCL over requested"},
+    {bus.hz >= bus_hz * 0.8, "fSCL under 80% of requested"},
+
+    // The peripheral needs SCL low for at least 4 I2CCLKs after filtering,
+    // and high for more than one.
+    {bus.low - af_min - config.digital_filter * clk > 4 * clk,
+     "SCL low vs I2CCLK"},
+    {bus.high > clk, "SCL high vs I2CCLK"},
+  };
+  return CheckConstraints(i2cclk_hz, bus_hz, t, constraints,
+                          sizeof(constraints) / sizeof(constraints[0]));
+}
+
+struct Reference {
+  uint32_t i2cclk_hz;
+  uint32_t bus_hz;
+  I2CTiming timing;
+};
+
+I2CTiming Timing(uint8_t presc, uint8_t scll, uint8_t sclh, uint8_t sdadel,
+                 uint8_t scldel) {
+  I2CTiming t{};
+  t.valid = true;
+  t.presc = presc;
+  t.scll = scll;
+  t.sclh = sclh;
+  t.sdadel = sdadel;
+  t.scldel = scldel;
+  return t;
+}
+
+// RM0410 tables "Examples of timing settings for fI2CCLK = 8 MHz / 16 MHz /
+// 48 MHz" (ST's 8 MHz Fast-mode Plus entry is for 500 kHz, and is left out).
+const Reference kReferences[] = {
+  {8000000, 10000, Timing(1, 0xc7, 0xc3, 0x2, 0x4)},
+  {8000000, 100000, Timing(1, 0x13, 0xf, 0x2, 0x4)},
+  {8000000, 400000, Timing(0, 0x9, 0x3, 0x1, 0x3)},
+  {16000000, 10000, Timing(3, 0xc7, 0xc3, 0x2, 0x4)},
+  {16000000, 100000, Timing(3, 0x13, 0xf, 0x2, 0x4)},
+  {16000000, 400000, Timing(1, 0x9, 0x3, 0x2, 0x3)},
+  {16000000, 1000000, Timing(0, 0x4, 0x2, 0x0, 0x2)},
+  {48000000, 10000, Timing(0xb, 0xc7, 0xc3, 0x2, 0x4)},
+  {48000000, 100000, Timing(0xb, 0x13, 0xf, 0x2, 0x4)},
+  {48000000, 400000, Timing(5, 0x9, 0x3, 0x3, 0x3)},
+  {48000000, 1000000, Timing(5, 0x3, 0x1, 0x0, 0x1)},
+};
+
+// ST's settings are for the RM0410 examples, which count SCL rise time as
+// part of SCL low, and use the analog filter delay only as a minimum. Using
+// the same assumptions (short rise time, no analog filter in the data valid
+// bound), their data delays are the known-good baseline. Their SCL timings
+// run a little over the requested frequency under our (stricter) model, so
+// for those we only check that we're not much slower.
+void TestAgainstReference() {
+  const I2CTimingConfig config = {100, 10, false, 0};
+
+  for (const Reference& ref : kReferences) {
+    CHECK(CheckDataTiming(ref.i2cclk_hz, ref.bus_hz, ref.timing, config));
+
+    I2CTiming t = ComputeI2CTiming(ref.i2cclk_hz, ref.bus_hz, config);
+    if (!CHECK(t.valid)) {
+      std::printf("  No timing for I2CCLK %u Hz, bus %u Hz\n", ref.i2cclk_hz,
+                  ref.bus_hz);
+      continue;
+    }
+
+    CheckDataTiming(ref.i2cclk_hz, ref.bus_hz, t, config);
+    CheckClockTiming(ref.i2cclk_hz, ref.bus_hz, t, config);
+
+    double ours = ComputeBusTimes(ref.i2cclk_hz, t, config).hz;
+    double st = ComputeBusTimes(ref.i2cclk_hz, ref.timing, config).hz;
+    double target = st < ref.bus_hz ? st : ref.bus_hz;
+    CHECK(ours >= 0.95 * target);
+  }
+}
+
+// Everything ComputeI2CTiming() returns must meet the spec, across common
+// I2CCLK rates (including APB1 at 54 and 108 MHz), bus rates and board
+// configurations.
+void TestSweep() {
+  const uint32_t kClocks[] = {8000000, 16000000, 24000000, 27000000,
+                              48000000, 50000000, 54000000, 100000000,
+                              108000000, 216000000};
+  const uint32_t kBusRates[] = {10000, 50000, 100000, 250000, 333333, 400000,
+                                600000, 800000, 1000000};
+  const uint32_t kRiseTimes[] = {0, 20, 100, 120, 300, 1000};
+  const uint32_t kFallTimes[] = {0, 10, 120, 300};
+
+  for (uint32_t i2cclk_hz : kClocks) {
+    for (uint32_t bus_hz : kBusRates) {
+      for (uint32_t rise : kRiseTimes) {
+        for (uint32_t fall : kFallTimes) {
+          for (int af = 0; af < 2; ++af) {
+            for (uint8_t dnf : {0, 1, 4, 15}) {
+              I2CTimingConfig config = {rise, fall, af != 0, dnf};
+              I2CTiming t = ComputeI2CTiming(i2cclk_hz, bus_hz, config);
+              if (!t.valid) {
+                continue;
+              }
+
+              CheckDataTiming(i2cclk_hz, bus_hz, t, config);
+              CheckClockTiming(i2cclk_hz, bus_hz, t, config);
+              CHECK_EQ(t.fast_mode_plus, bus_hz > kFastMode.max_hz);
+
+              // actual_hz is the frequency for these settings.
+              double hz = ComputeBusTimes(i2cclk_hz, t, config).hz;
+              CHECK(t.actual_hz >= hz * 0.999 && t.actual_hz <= hz * 1.001);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// The usual cases must have a solution: Standard and Fast-mode with the
+// default bus config at common I2CCLK rates, Fast-mode Plus from 48 MHz, and
+// 10 kHz up to 54 MHz (above that SCLL and SCLH run out of range).
+void TestSolutionsExist() {
+  const uint32_t kClocks[] = {8000000, 16000000, 48000000, 54000000,
+                              108000000, 216000000};
+  for (uint32_t i2cclk_hz : kClocks) {
+    for (uint32_t bus_hz : kI2CSpeedHzForTest) {
+      bool expected = true;
+      if (bus_hz == 10000 && i2cclk_hz > 54000000) {
+        expected = false;
+      } else if (bus_hz == 1000000 && i2cclk_hz < 48000000) {
+        expected = false;
+      }
+      CHECK_EQ(ComputeI2CTiming(i2cclk_hz, bus_hz,
+                                kDefaultI2CTimingConfig).valid, expected);
+    }
+  }
+
+  // At 16 MHz, Fast-mode Plus only fits without the analog filter delay.
+  CHECK(ComputeI2CTiming(16000000, 1000000, {100, 10, false, 0}).valid);
+
+  // Impossible requests.
+  CHECK(!ComputeI2CTiming(16000000, 0, kDefaultI2CTimingConfig).valid);
+  CHECK(!ComputeI2CTiming(0, 100000, kDefaultI2CTimingConfig).valid);
+  CHECK(!ComputeI2CTiming(16000000, 1000001, kDefaultI2CTimingConfig).valid);
+  CHECK(!ComputeI2CTiming(1000000, 1000000, kDefaultI2CTimingConfig).valid);
+}
+
+} // namespace
+
+int main() {
+  TestAgainstReference();
+  TestSweep();
+  TestSolutionsExist();
+  return Test::Summary("i2c_timing_test");
+}
@@ -0,0 +1,179 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks ConstantDivider and ClockUnitConverter against plain 64-bit and
+// 128-bit arithmetic, over the clock rates and units we use, and the edges of
+// the 64-bit range.
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "systick.h"
+
+#include "test_util.h"
+
+using namespace Ostrich;
+
+namespace {
+
+using uint128 = unsigned __int128;
+
+constexpr uint64_t kMax = UINT64_MAX;
+
+// Dividends worth trying for a divisor: the range ends, and either side of
+// multiples of the divisor near them.
+std::vector<uint64_t> EdgeValues(uint64_t d) {
+  std::vector<uint64_t> ret = {
+    0, 1, 2, d - 1, d, d + 1, 2 * d - 1, 2 * d,
+    kMax, kMax - 1, kMax / 2, kMax / 2 + 1,
+    UINT32_MAX, static_cast<uint64_t>(UINT32_MAX) + 1
+  };
+
+  uint64_t top_multiple = kMax - kMax % d;
+  for (uint64_t i = 0; i < 3; ++i) {
+    uint64_t m = top_multiple - i * d;
+    ret.push_back(m);
+    ret.push_back(m - 1);
+    if (m != kMax) {
+      ret.push_back(m + 1);
+    }
+  }
+
+  return ret;
+}
+
+// Random values with a random bit width, so small values are covered as well
+// as large ones.
+uint64_t RandomValue(std::mt19937_64& rng) {
+  return rng() >> (rng() % 64);
+}
+
+void TestDivider(std::mt19937_64& rng) {
+  std::vector<uint32_t> divisors = {
+    1, 2, 3, 5, 6, 7, 10, 12, 25, 125, 216, 1000, 216000, 1000000,
+    216000000, 0x7fffffff, 0x80000000, 0x80000001, 0xfffffffe, 0xffffffff
+  };
+
+  for (int i = 0; i < 1000; ++i) {
+    divisors.push_back(static_cast<uint32_t>(RandomValue(rng) >> 32) | 1);
+  }
+
+  // Every small divisor.
+  for (uint32_t d = 1; d < 10000; ++d) {
+    divisors.push_back(d);
+  }
+
+  for (uint32_t d : divisors) {
+    ConstantDivider divider(d);
+    CHECK_EQ(divider.Divisor(), d);
+
+    for (uint64_t n : EdgeValues(d)) {
+      CHECK_EQ(divider.Divide(n), n / d);
+    }
+
+    for (int i = 0; i < 200; ++i) {
+      uint64_t n = RandomValue(rng);
+      CHECK_EQ(divider.Divide(n), n / d);
+    }
+  }
+
+  // Dividing by 0 reports an error, and divides by 1 instead.
+  std::string error;
+  SetErrorHandler([&](const std::string& err) { error = err; });
+  ConstantDivider zero(0);
+  CHECK(!error.empty());
+  CHECK_EQ(zero.Divisor(), 1);
+  CHECK_EQ(zero.Divide(kMax), kMax);
+  SetErrorHandler(nullptr);
+}
+
+// Reference for floor(x * num / den), or false if it doesn't fit in 64 bits
+// (the converters don't define a result then).
+bool Reference(uint64_t x, uint32_t num, uint32_t den, uint64_t* result) {
+  uint128 r = static_cast<uint128>(x) * num / den;
+  if (r > kMax) {
+    return false;
+  }
+  *result = static_cast<uint64_t>(r);
+  return true;
+}
+
+// Largest x for which floor(x * num / den) fits in 64 bits.
+uint64_t LargestInput(uint32_t num, uint32_t den) {
+  uint128 limit = ((static_cast<uint128>(1) << 64) * den + num - 1) / num - 1;
+  return limit > kMax ? kMax : static_cast<uint64_t>(limit);
+}
+
+void CheckConversion(const ClockUnitConverter& converter, uint32_t clock_hz,
+                     uint32_t units_per_second, uint64_t x) {
+  uint64_t expected;
+  if (Reference(x, units_per_second, clock_hz, &expected)) {
+    CHECK_EQ(converter.ClocksToUnits(x), expected);
+  }
+  if (Reference(x, clock_hz, units_per_second, &expected)) {
+    CHECK_EQ(converter.UnitsToClocks(x), expected);
+  }
+}
+
+void TestConverter(std::mt19937_64& rng) {
+  const uint32_t kClocks[] = {
+    216000000, 200000000, 180000000, 168000000, 96000000, 48000000,
+    16000000, 8000000, 216000001, 123456789, 0x80000000, 0xffffffff, 1, 3
+  };
+  const uint32_t kUnits[] = { 1, 1000, 1000000, 1000000000, 48000, 44100 };
+
+  for (uint32_t clock_hz : kClocks) {
+    for (uint32_t units_per_second : kUnits) {
+      ClockUnitConverter converter(clock_hz, units_per_second);
+
+      std::vector<uint64_t> values = EdgeValues(clock_hz);
+      for (uint64_t x : EdgeValues(units_per_second)) {
+        values.push_back(x);
+      }
+
+      // Both directions right at, and just under, the overflow limit.
+      for (uint64_t limit : { LargestInput(units_per_second, clock_hz),
+                              LargestInput(clock_hz, units_per_second) }) {
+        for (uint64_t i = 0; i < 4 && i <= limit; ++i) {
+          values.push_back(limit - i);
+        }
+      }
+
+      for (uint64_t x : values) {
+        CheckConversion(converter, clock_hz, units_per_second, x);
+      }
+
+      for (int i = 0; i < 20000; ++i) {
+        CheckConversion(converter, clock_hz, units_per_second,
+                        RandomValue(rng));
+      }
+    }
+  }
+}
+
+} // namespace
+
+int main() {
+  std::mt19937_64 rng(1);
+  TestDivider(rng);
+  TestConverter(rng);
+  return Test::Summary("systick_test");
+}
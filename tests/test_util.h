@@ -0,0 +1,80 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Minimal checking for the host tests. Each test is a plain executable that
+// prints failures and returns non-zero if there were any.
+
+#ifndef __TEST_UTIL_H__
+#define __TEST_UTIL_H__
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+
+namespace Ostrich {
+namespace Test {
+
+inline uint64_t g_checks = 0;
+inline uint64_t g_failures = 0;
+
+// Only the first few failures are printed, so a systematic bug doesn't bury
+// everything else.
+constexpr uint64_t kMaxPrintedFailures = 20;
+
+inline bool Check(bool cond, const char* file, int line, const char* expr) {
+  ++g_checks;
+  if (!cond) {
+    if (g_failures < kMaxPrintedFailures) {
+      std::printf("%s:%d: CHECK(%s) failed\n", file, line, expr);
+    }
+    ++g_failures;
+  }
+  return cond;
+}
+
+inline bool CheckEq(uint64_t a, uint64_t b, const char* file, int line,
+                    const char* expr_a, const char* expr_b) {
+  ++g_checks;
+  if (a != b) {
+    if (g_failures < kMaxPrintedFailures) {
+      std::printf("%s:%d: %s (%" PRIu64 ") != %s (%" PRIu64 ")\n", file, line,
+                  expr_a, a, expr_b, b);
+    }
+    ++g_failures;
+  }
+  return a == b;
+}
+
+// Returns the exit code for main().
+inline int Summary(const char* name) {
+  std::printf("%s: %" PRIu64 " checks, %" PRIu64 " failures\n", name,
+              g_checks, g_failures);
+  return g_failures == 0 ? 0 : 1;
+}
+
+}; // namespace Test
+}; // namespace Ostrich
+
+#define CHECK(cond) \
+  ::Ostrich::Test::Check((cond), __FILE__, __LINE__, #cond)
+
+#define CHECK_EQ(a, b) \
+  ::Ostrich::Test::CheckEq((a), (b), __FILE__, __LINE__, #a, #b)
+
+#endif // __TEST_UTIL_H__
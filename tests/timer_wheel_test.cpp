@@ -0,0 +1,280 @@
+/*
+ * This file is part of the libostrich project.
+ *
+ * Copyright (C) 2019 Matthew Lai <m@matthewlai.ca>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs TimerWheel through a simulated SysTick, and checks that every timer
+// fires exactly on the tick it's due, across cascades through all levels and
+// past the end of the wheel. Also times insert and expire.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "systick.h"
+#include "timer_wheel.h"
+
+#include "test_util.h"
+
+namespace Ostrich {
+
+// Stand-ins for the parts of systick.cpp the wheel uses. One tick is 1ms of
+// g_ahb_freq clocks (g_systick_period in host_ostrich.h).
+namespace {
+std::function<void()> g_systick_hook;
+std::function<bool()> g_idle_hook;
+constexpr uint64_t kClocksPerMs = 216000;
+} // namespace
+
+void AddSysTickCallback(SysTickCallback callback) {
+  g_systick_hook = callback;
+}
+
+void AddIdleCallback(IdleCallback callback) {
+  g_idle_hook = callback;
+}
+
+uint64_t MillisecondsToClocks(uint64_t milliseconds) {
+  return milliseconds * kClocksPerMs;
+}
+
+uint64_t MicrosecondsToClocks(uint64_t microseconds) {
+  return microseconds * (kClocksPerMs / 1000);
+}
+
+uint64_t ClocksToMilliseconds(uint64_t clocks) {
+  return clocks / kClocksPerMs;
+}
+
+uint64_t ClocksToMicroseconds(uint64_t clocks) {
+  return clocks / (kClocksPerMs / 1000);
+}
+
+uint64_t GetTimeClocks() {
+  return TimerWheel::GetInstance().CurrentTick() * kClocksPerMs;
+}
+
+}; // namespace Ostrich
+
+using namespace Ostrich;
+
+namespace {
+
+void RunTicks(uint64_t ticks) {
+  for (uint64_t i = 0; i < ticks; ++i) {
+    g_systick_hook();
+  }
+}
+
+// Past the end of the wheel (2^24 ticks) twice, so timers in the overflow slot
+// go around more than once.
+constexpr uint64_t kTotalTicks = (static_cast<uint64_t>(1) << 25) + 100000;
+
+struct TrackedTimer {
+  std::unique_ptr<SoftwareTimer> timer;
+  uint64_t expected_tick = 0;
+  uint64_t period = 0;
+  uint64_t fire_count = 0;
+  uint64_t expected_count = 0;
+  bool active = false;
+};
+
+uint64_t RandomDelay(std::mt19937_64& rng, int i) {
+  // Spread delays over every level, and past the end of the wheel.
+  switch (i % 5) {
+    case 0: return rng() % 70;
+    case 1: return rng() % 5000;
+    case 2: return rng() % 300000;
+    case 3: return rng() % 20000000;
+    default: return rng() % (static_cast<uint64_t>(1) << 25);
+  }
+}
+
+void TestExactExpiry() {
+  TimerWheel& wheel = TimerWheel::GetInstance();
+  std::mt19937_64 rng(5);
+
+  constexpr int kNumTimers = 3000;
+  std::vector<TrackedTimer> timers(kNumTimers);
+
+  auto start = [&](int i) {
+    TrackedTimer& t = timers[i];
+    uint64_t delay = RandomDelay(rng, i);
+    if (i % 7 == 0 && delay > 0 && delay < 100000) {
+      t.period = delay;
+      t.timer->StartPeriodic(Duration::Milliseconds(delay));
+    } else {
+      t.period = 0;
+      t.timer->StartOneShot(Duration::Milliseconds(delay));
+    }
+    // Fires on the first tick at least delay after now.
+    t.expected_tick = wheel.CurrentTick() + delay + 1;
+    t.active = true;
+  };
+
+  for (int i = 0; i < kNumTimers; ++i) {
+    timers[i].timer.reset(new SoftwareTimer([&, i]() {
+      TrackedTimer& t = timers[i];
+      CHECK(t.active);
+      CHECK_EQ(wheel.CurrentTick(), t.expected_tick);
+      ++t.fire_count;
+      if (t.period != 0) {
+        t.expected_tick += t.period;
+      } else {
+        t.active = false;
+        // Some one-shot timers restart themselves from the callback.
+        if (i % 3 == 0 && t.expected_tick < kTotalTicks / 2) {
+          start(i);
+        }
+      }
+    }, SoftwareTimer::Context::kInterrupt));
+  }
+
+  for (int i = 0; i < kNumTimers; ++i) {
+    start(i);
+  }
+
+  for (uint64_t tick = 0; tick < kTotalTicks; ++tick) {
+    // Cancel and restart some timers at odd times, so they get inserted at
+    // every offset relative to the cascades.
+    if (tick % 9973 == 0) {
+      int i = rng() % kNumTimers;
+      timers[i].timer->Cancel();
+      CHECK(!timers[i].timer->Active());
+      timers[i].active = false;
+      if (rng() % 2) {
+        start(i);
+      }
+    }
+    g_systick_hook();
+  }
+
+  // Everything that was still scheduled and due has fired, and is no longer
+  // active unless periodic.
+  for (TrackedTimer& t : timers) {
+    CHECK(!t.active || t.expected_tick > wheel.CurrentTick());
+    if (t.active) {
+      CHECK(t.timer->Active());
+    } else {
+      CHECK(!t.timer->Active());
+    }
+  }
+
+  for (TrackedTimer& t : timers) {
+    t.timer->Cancel();
+  }
+}
+
+void TestDeferred() {
+  TimerWheel& wheel = TimerWheel::GetInstance();
+
+  int count = 0;
+  SoftwareTimer timer([&]() { ++count; });
+  timer.StartPeriodic(Duration::Milliseconds(1));
+
+  RunTicks(10);
+  CHECK_EQ(count, 0);
+  CHECK(wheel.DeferredPending());
+  CHECK(g_idle_hook());
+
+  // Firing again before the main loop runs it only runs it once.
+  wheel.RunDeferred();
+  CHECK_EQ(count, 1);
+  CHECK(!wheel.DeferredPending());
+  CHECK(!g_idle_hook());
+
+  // Cancelling drops a pending run.
+  RunTicks(2);
+  CHECK(wheel.DeferredPending());
+  timer.Cancel();
+  CHECK(!wheel.DeferredPending());
+  wheel.RunDeferred();
+  CHECK_EQ(count, 1);
+
+  // A deferred one-shot can restart itself.
+  int restarts = 0;
+  SoftwareTimer* self = nullptr;
+  SoftwareTimer one_shot([&]() {
+    if (++restarts < 5) {
+      self->StartOneShot(Duration::Milliseconds(3));
+    }
+  });
+  self = &one_shot;
+  one_shot.StartOneShot(Duration::Milliseconds(3));
+  for (int i = 0; i < 100; ++i) {
+    g_systick_hook();
+    wheel.RunDeferred();
+  }
+  CHECK_EQ(restarts, 5);
+  CHECK(!one_shot.Active());
+}
+
+void TestRounding() {
+  TimerWheel& wheel = TimerWheel::GetInstance();
+  CHECK_EQ(wheel.DurationToTicks(Duration::Clocks(0)), 0);
+  CHECK_EQ(wheel.DurationToTicks(Duration::Clocks(1)), 1);
+  CHECK_EQ(wheel.DurationToTicks(Duration::Clocks(kClocksPerMs)), 1);
+  CHECK_EQ(wheel.DurationToTicks(Duration::Clocks(kClocksPerMs + 1)), 2);
+  CHECK_EQ(wheel.DurationToTicks(Duration::Microseconds(2500)), 3);
+}
+
+void Benchmark() {
+  std::mt19937_64 rng(7);
+  constexpr int kNumTimers = 100000;
+  constexpr uint64_t kMaxDelayMs = 10000;
+
+  std::vector<std::unique_ptr<SoftwareTimer>> timers;
+  uint64_t fired = 0;
+  for (int i = 0; i < kNumTimers; ++i) {
+    timers.emplace_back(new SoftwareTimer([&]() { ++fired; },
+                                          SoftwareTimer::Context::kInterrupt));
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (auto& timer : timers) {
+    timer->StartOneShot(Duration::Milliseconds(rng() % kMaxDelayMs));
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  RunTicks(kMaxDelayMs + 1);
+  auto t2 = std::chrono::steady_clock::now();
+
+  CHECK_EQ(fired, kNumTimers);
+
+  using ns = std::chrono::duration<double, std::nano>;
+  std::printf("timer_wheel_test: insert %.1f ns/timer, "
+              "ticks + cascade + expire %.1f ns/timer\n",
+              ns(t1 - t0).count() / kNumTimers,
+              ns(t2 - t1).count() / kNumTimers);
+}
+
+} // namespace
+
+int main() {
+  // Constructs the wheel, which hooks into SysTick.
+  TimerWheel::GetInstance();
+  CHECK(static_cast<bool>(g_systick_hook));
+
+  TestRounding();
+  TestExactExpiry();
+  TestDeferred();
+  Benchmark();
+  return Test::Summary("timer_wheel_test");
+}